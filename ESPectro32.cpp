@@ -3,10 +3,16 @@
 #include <BLEServer.h>
 #include <BLEUtils.h>
 #include <BLECharacteristic.h>
-#include <String>
+#include <esp_gap_ble_api.h>
 #include <Wire.h> // Make sure this is included
-#include <cmath>  // Include for log10 if calculateAbsorbance uses it
+#include <Preferences.h>
+#include <cmath>
 #include <limits.h> // Include for UINT16_MAX
+#include <atomic>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <LittleFS.h>
+#include <unistd.h> // truncate()
 
 // ============================================
 // definitions apds start
@@ -19,22 +25,33 @@
 #define APDS9930_ID_2 0x39
 #define APDS9930_ENABLE 0x00
 #define APDS9930_ATIME 0x01
+#define APDS9930_PERS 0x0C
 #define APDS9930_CONTROL 0x0F
 #define APDS9930_ID 0x12
+#define APDS9930_STATUS 0x13
 #define APDS9930_Ch0DATAL 0x14
 #define APDS9930_Ch0DATAH 0x15
 #define APDS9930_Ch1DATAL 0x16
 #define APDS9930_Ch1DATAH 0x17
 #define APDS9930_PON 0b00000001
 #define APDS9930_AEN 0b00000010
+#define APDS9930_AIEN 0b00010000
+#define APDS9930_AVALID 0b00000001
+#define APDS9930_AINT 0b00010000
+#define CLEAR_ALS_INT 0xE6 // Special function: clear ALS interrupt
+#define APERS_EVERY_CYCLE 0x00 // ALS interrupt after every integration cycle
+#define ATIME_CYCLE_US 2730 // Integration time per ATIME period
 #define OFF 0
 #define ON 1
 #define POWER 0
 #define AMBIENT_LIGHT 1
+#define AMBIENT_LIGHT_INT 4
 #define AGAIN_1X 0
 #define AGAIN_8X 1
 #define AGAIN_16X 2
 #define AGAIN_120X 3
+#define DEFAULT_PERIODS 200
+#define DEFAULT_GAIN AGAIN_1X
 
 // ============================================
 // definitions apds end
@@ -50,13 +67,34 @@ const int redLEDPin = 27;
 const int greenLEDPin = 26;
 const int blueLEDPin = 25;
 
+// LED channels, used to index per-wavelength settings
+#define LED_RED 0
+#define LED_GREEN 1
+#define LED_BLUE 2
+#define LED_COUNT 3
+#define LED_NONE 0xFF
+const int ledPins[LED_COUNT] = {redLEDPin, greenLEDPin, blueLEDPin};
+const char *const ledNames[LED_COUNT] = {"Red", "Green", "Blue"};
+
+// LEDs are driven by LEDC PWM. At 20 kHz even the shortest integration
+// (2.73 ms) spans 50+ PWM cycles, so the sensor sees the mean intensity.
+#define LED_PWM_FREQ_HZ 20000
+#define LED_PWM_BITS 10
+#define LED_DUTY_MAX ((1 << LED_PWM_BITS) - 1)
+#define LED_DUTY_MIN 8 // Below this the LED output is no longer proportional
+
 // BLE Globals
 BLEServer *pServer = nullptr;
 BLECharacteristic *pTxCharacteristic = nullptr;
 BLECharacteristic *pRxCharacteristic = nullptr;
 BLEAdvertising *pAdvertising = nullptr;
 
-bool deviceConnected = false;
+
+#define LOCAL_MTU 247 // Lets the client negotiate full-size notifications
+#define BLE_DATA_LEN_MAX 251 // Link-layer payload with data length extension
+#define I2C_CLOCK_HZ 400000 // APDS-9930 supports fast-mode I2C
+#define BLE_MAX_CLIENTS 3 // Simultaneous connections; Bluedroid allows up to CONFIG_BT_ACL_CONNECTIONS
+#define BLE_DEFAULT_MTU 23
 // String receivedMessage = ""; // This seems unused
 
 // ============================================
@@ -64,28 +102,137 @@ bool deviceConnected = false;
 // ============================================
 
 uint16_t ch0_reading; // Still used for single reads in loop()
-uint16_t ch1_reading; // Unused in current logic
+uint16_t ch1_reading; // Filled alongside ch0_reading by readChannels()
 uint16_t zeroReading = 0; // Initialize zero reading
+uint16_t darkReading = 0; // CH0 with all LEDs off, at the same exposure as zeroReading
+
+// Shadow copies of the configuration registers. The APDS-9930 never changes
+// these on its own, so gain/mode updates are computed locally and written.
+uint8_t apdsEnableShadow = 0;
+uint8_t apdsAtimeShadow = 0;
+uint8_t apdsControlShadow = 0;
+
+uint32_t i2cTransactionCount = 0; // One per START..STOP (or repeated START) on the bus
 
 // ============================================
 // global variables apds end
 // ============================================
 
+// ============================================
+// Instrumentation
+// Hot paths are timed with esp_timer (microseconds, coherent across cores)
+// into fixed log2 histograms: bucket b counts durations in [2^(b-1), 2^b) us.
+// Each probe has a single writing task, so updates need no locking; a
+// STATS command reads them back over BLE. Build with PROBES_ENABLED 0 to
+// compile every probe out.
+// ============================================
+#ifndef PROBES_ENABLED
+#define PROBES_ENABLED 1
+#endif
+#define PROBE_BUCKETS 24      // Last bucket collects everything above ~4 s
+#define PROBE_MAX_COMMANDS 32 // Room for one command histogram per AcqCommandType
+
+enum ProbeId : uint8_t
+{
+  PROBE_I2C,         // One register transaction, including retries
+  PROBE_MULTISAMPLE, // A multisample job from begin to its last sample
+  PROBE_ABSORBANCE,  // absorbanceFixed()
+  PROBE_NOTIFY,      // One notification, fanned out to every subscriber
+  PROBE_COMMAND,     // Receipt to completion, one per command type from here
+  PROBE_COUNT = PROBE_COMMAND + PROBE_MAX_COMMANDS
+};
+
+enum CounterId : uint8_t
+{
+  COUNTER_I2C_FAIL,  // Transactions that failed after every retry
+  COUNTER_I2C_RETRY,
+  COUNTER_COUNT
+};
+
+struct Histogram
+{
+  uint32_t n;
+  uint32_t maxUs;
+  uint32_t buckets[PROBE_BUCKETS];
+};
+
+#if PROBES_ENABLED
+Histogram probeHistograms[PROBE_COUNT];
+uint32_t probeCounters[COUNTER_COUNT];
+
+inline uint32_t probeNowUs()
+{
+  return (uint32_t)esp_timer_get_time();
+}
+
+void probeRecord(uint8_t id, uint32_t us)
+{
+  Histogram &h = probeHistograms[id];
+  uint8_t bucket = us == 0 ? 0 : 32 - __builtin_clz(us);
+  h.buckets[bucket < PROBE_BUCKETS ? bucket : PROBE_BUCKETS - 1]++;
+  h.n++;
+  if (us > h.maxUs)
+    h.maxUs = us;
+}
+
+// Times the enclosing scope.
+struct ProbeScope
+{
+  uint8_t id;
+  uint32_t startUs;
+  explicit ProbeScope(uint8_t probe) : id(probe), startUs(probeNowUs()) {}
+  ~ProbeScope() { probeRecord(id, probeNowUs() - startUs); }
+};
+
+#define PROBE_SCOPE(id) ProbeScope probeScope_(id)
+#define PROBE_RECORD(id, us) probeRecord(id, us)
+#define PROBE_COUNT_EVENT(counter) (probeCounters[counter]++)
+#define PROBE_NOW_US() probeNowUs()
+#else
+#define PROBE_SCOPE(id) do {} while (0)
+#define PROBE_RECORD(id, us) do {} while (0)
+#define PROBE_COUNT_EVENT(counter) do {} while (0)
+#define PROBE_NOW_US() 0U
+#endif
+
 // --- Forward Declarations ---
 bool initAPD();
 bool setIntegrationTimePeriods(uint8_t periods);
 bool setAmbientLightGain(uint8_t gain);
 bool readCh0Light(uint16_t &val);
 bool readCh1Light(uint16_t &val);
+bool readChannels(uint16_t &ch0, uint16_t &ch1);
 bool setMode(uint8_t mode, uint8_t enable);
 uint8_t getMode();
 bool enablePower();
+bool enableDataReadyFlag();
+bool clearDataReadyFlag();
+bool isDataReady(bool &ready);
+uint32_t integrationTimeMs();
+bool syncRegisterShadow();
 bool wireWriteDataByte(uint8_t reg, uint8_t val);
 bool wireReadDataByte(uint8_t reg, uint8_t &val);
+bool wireReadDataBlock(uint8_t reg, uint8_t *buf, uint8_t len);
 bool wireWriteByte(uint8_t val);
-void optimizeSensorSettings();
-float calculateAbsorbance(uint16_t sampleReading);
-uint16_t performMultisampling(int numSamples, int delayBetweenSamples); // New function
+void probesReport();
+void kineticsTransmit();
+void logTransmit();
+void bulkTransmit();
+bool bulkRequest(uint8_t kind, uint8_t source, uint8_t id, uint32_t a, uint32_t b);
+enum BulkSource : uint8_t
+{
+  BULK_SOURCE_KINETICS,
+  BULK_SOURCE_LOG,
+  BULK_SOURCE_COUNT
+};
+enum BulkRequestKind : uint8_t
+{
+  BULK_START,  // source, a: first record, b: record count
+  BULK_RESUME, // id, a: chunk, or UINT32_MAX for the last acknowledgement
+  BULK_CANCEL  // source, or BULK_SOURCE_COUNT for any
+};
+bool optimizeSensorSettings(uint16_t ch0);
+int32_t absorbanceFixed(uint16_t sample, uint16_t blank, uint16_t dark);
 
 
 // ============================================
@@ -107,14 +254,19 @@ bool initAPD()
     Serial.println(id, HEX);
     return false;
   }
+  if (!syncRegisterShadow())
+  {
+    Serial.println("Failed to read APDS configuration registers!");
+    return false;
+  }
  
   // Using original default settings from user code
-  if (!setIntegrationTimePeriods(220)) // Original value
+  if (!setIntegrationTimePeriods(DEFAULT_PERIODS))
   {
     Serial.println("Failed to set APDS default integration time!");
     return false;
   }
-  if (!setAmbientLightGain(AGAIN_1X)) // Original value
+  if (!setAmbientLightGain(DEFAULT_GAIN))
   {
     Serial.println("Failed to set APDS default gain!");
     return false;
@@ -130,6 +282,11 @@ bool initAPD()
     Serial.println("Failed to enable APDS ambient light sensor!");
     return false;
   }
+  if (!enableDataReadyFlag())
+  {
+    Serial.println("Failed to enable APDS ALS interrupt!");
+    return false;
+  }
   delay(120);
   return true;
 }
@@ -142,16 +299,15 @@ bool setIntegrationTimePeriods(uint8_t periods)
   {
     return false;
   }
+  apdsAtimeShadow = atime_val;
   return true;
 }
 
 bool setAmbientLightGain(uint8_t gain)
 {
-  uint8_t control_val;
-  if (!wireReadDataByte(APDS9930_CONTROL, control_val))
-  {
-    return false;
-  }
+  // CONTROL only changes when we write it, so the shadow copy replaces the
+  // read-modify-write round trip.
+  uint8_t control_val = apdsControlShadow;
   gain &= 0b00000011;
   control_val &= 0b11111100;
   control_val |= gain;
@@ -159,40 +315,49 @@ bool setAmbientLightGain(uint8_t gain)
   {
     return false;
   }
+  apdsControlShadow = control_val;
   return true;
 }
 
 bool readCh0Light(uint16_t &val)
 {
-  uint8_t val_low, val_high;
+  uint8_t buf[2];
   val = 0;
-  if (!wireReadDataByte(APDS9930_Ch0DATAL, val_low))
+  if (!wireReadDataBlock(APDS9930_Ch0DATAL, buf, sizeof(buf)))
     return false;
-  if (!wireReadDataByte(APDS9930_Ch0DATAH, val_high))
-    return false;
-  val = (uint16_t)val_high << 8 | val_low;
+  val = (uint16_t)buf[1] << 8 | buf[0];
   return true;
 }
 
 bool readCh1Light(uint16_t &val)
 {
-  uint8_t val_low, val_high;
+  uint8_t buf[2];
   val = 0;
-  if (!wireReadDataByte(APDS9930_Ch1DATAL, val_low))
+  if (!wireReadDataBlock(APDS9930_Ch1DATAL, buf, sizeof(buf)))
     return false;
-  if (!wireReadDataByte(APDS9930_Ch1DATAH, val_high))
+  val = (uint16_t)buf[1] << 8 | buf[0];
+  return true;
+}
+
+// Reads CH0DATAL..CH1DATAH in one auto-increment burst. Reading CH0DATAL
+// latches the upper bytes, so both channels come from the same integration.
+bool readChannels(uint16_t &ch0, uint16_t &ch1)
+{
+  uint8_t buf[4];
+  ch0 = 0;
+  ch1 = 0;
+  if (!wireReadDataBlock(APDS9930_Ch0DATAL, buf, sizeof(buf)))
     return false;
-  val = (uint16_t)val_high << 8 | val_low;
+  ch0 = (uint16_t)buf[1] << 8 | buf[0];
+  ch1 = (uint16_t)buf[3] << 8 | buf[2];
   return true;
 }
 
 bool setMode(uint8_t mode, uint8_t enable)
 {
   uint8_t reg_val = getMode();
-  if (reg_val == ERROR)
-    return false;
   enable &= 0x01;
-  if (mode == POWER || mode == AMBIENT_LIGHT)
+  if (mode == POWER || mode == AMBIENT_LIGHT || mode == AMBIENT_LIGHT_INT)
   {
     if (enable)
       reg_val |= (1 << mode);
@@ -205,15 +370,13 @@ bool setMode(uint8_t mode, uint8_t enable)
   }
   if (!wireWriteDataByte(APDS9930_ENABLE, reg_val))
     return false;
+  apdsEnableShadow = reg_val;
   return true;
 }
 
 uint8_t getMode()
 {
-  uint8_t enable_value;
-  if (!wireReadDataByte(APDS9930_ENABLE, enable_value))
-    return ERROR;
-  return enable_value;
+  return apdsEnableShadow;
 }
 
 bool enablePower()
@@ -221,439 +384,4176 @@ bool enablePower()
   return setMode(POWER, ON);
 }
 
-bool wireWriteDataByte(uint8_t reg, uint8_t val)
+// Uses the ALS interrupt as a data-ready flag: with APERS = 0 the AINT bit in
+// STATUS is set at the end of every integration cycle, and stays set until
+// cleared. Clearing it after each read guarantees the next sample comes from
+// a new integration.
+bool enableDataReadyFlag()
+{
+  if (!wireWriteDataByte(APDS9930_PERS, APERS_EVERY_CYCLE))
+    return false;
+  if (!setMode(AMBIENT_LIGHT_INT, ON))
+    return false;
+  return clearDataReadyFlag();
+}
+
+bool clearDataReadyFlag()
+{
+  return wireWriteByte(CLEAR_ALS_INT);
+}
+
+bool isDataReady(bool &ready)
+{
+  uint8_t status;
+  ready = false;
+  if (!wireReadDataByte(APDS9930_STATUS, status))
+    return false;
+  ready = (status & APDS9930_AINT) != 0;
+  return true;
+}
+
+// Duration of one ALS integration at the current ATIME, rounded up.
+uint32_t integrationTimeMs()
+{
+  uint32_t periods = 256 - apdsAtimeShadow;
+  return (periods * ATIME_CYCLE_US + 999) / 1000;
+}
+
+// Seeds the shadow registers from the device. Called once from initAPD();
+// after that every configuration write goes through the setters above.
+bool syncRegisterShadow()
+{
+  if (!wireReadDataByte(APDS9930_ENABLE, apdsEnableShadow))
+    return false;
+  if (!wireReadDataByte(APDS9930_ATIME, apdsAtimeShadow))
+    return false;
+  if (!wireReadDataByte(APDS9930_CONTROL, apdsControlShadow))
+    return false;
+  return true;
+}
+
+// Every register access is idempotent, so a transaction that NAKs or
+// comes back short is simply repeated up to I2C_RETRIES times.
+#define I2C_RETRIES 2
+
+bool wireTryWriteDataByte(uint8_t reg, uint8_t val)
 {
   Wire.beginTransmission(APDS9930_I2C_ADDR);
   Wire.write(reg | AUTO_INCREMENT);
   Wire.write(val);
+  i2cTransactionCount++;
   return Wire.endTransmission() == 0;
 }
 
-bool wireReadDataByte(uint8_t reg, uint8_t &val)
+// Sets the register pointer with a repeated start and reads len bytes in one
+// auto-increment burst.
+bool wireTryReadDataBlock(uint8_t reg, uint8_t *buf, uint8_t len)
 {
-  if (!wireWriteByte(reg | AUTO_INCREMENT))
+  Wire.beginTransmission(APDS9930_I2C_ADDR);
+  Wire.write(reg | AUTO_INCREMENT);
+  i2cTransactionCount++;
+  if (Wire.endTransmission(false) != 0)
     return false;
-  Wire.requestFrom(APDS9930_I2C_ADDR, 1);
-  if (Wire.available())
+  i2cTransactionCount++;
+  if (Wire.requestFrom((uint8_t)APDS9930_I2C_ADDR, (uint8_t)len) != len)
+    return false;
+  for (uint8_t i = 0; i < len; i++)
   {
-    val = Wire.read();
-    return true;
+    buf[i] = Wire.read();
   }
-  return false;
+  return true;
 }
 
-bool wireWriteByte(uint8_t val)
+bool wireTryWriteByte(uint8_t val)
 {
   Wire.beginTransmission(APDS9930_I2C_ADDR);
   Wire.write(val);
+  i2cTransactionCount++;
   return Wire.endTransmission() == 0;
 }
 
-
-// ============================================
-// Original function: optimizeSensorSettings
-// ============================================
-uint8_t currentIntegrationTime = 255;
-
-// ============================================
-// Original function: calculateAbsorbance
-// ============================================
-float calculateAbsorbance(uint16_t sampleReading)
+bool wireWriteDataByte(uint8_t reg, uint8_t val)
 {
-  if (zeroReading == 0)
+  PROBE_SCOPE(PROBE_I2C);
+  for (uint8_t attempt = 0; attempt <= I2C_RETRIES; attempt++)
   {
-    Serial.println("Error: Zero reading not set!");
-    return -1.0; // Return error indicator instead of 0.0
-  }
-  if (sampleReading == 0) {
-      Serial.println("Warning: Sample reading is zero. Absorbance is effectively infinite.");
-      return 99.0; // Indicate near infinite absorbance
+    if (attempt > 0)
+      PROBE_COUNT_EVENT(COUNTER_I2C_RETRY);
+    if (wireTryWriteDataByte(reg, val))
+      return true;
   }
-  //if (sampleReading >= zeroReading) {
-      // If sample is brighter than or equal to zero reading, absorbance is zero or negative (error)
-      // Serial.println("Warning: Sample reading >= Zero reading. Setting absorbance to 0.");
-    //  return 0.0;
-  //}
+  PROBE_COUNT_EVENT(COUNTER_I2C_FAIL);
+  return false;
+}
 
-  float transmittance = (float)sampleReading / (float)zeroReading;
+bool wireReadDataByte(uint8_t reg, uint8_t &val)
+{
+  return wireReadDataBlock(reg, &val, 1);
+}
 
-  if (transmittance <= 0.0f) {
-      Serial.print("Error: Invalid transmittance calculated: ");
-      Serial.println(transmittance, 6);
-      return -1.0; // Return error indicator
+bool wireReadDataBlock(uint8_t reg, uint8_t *buf, uint8_t len)
+{
+  PROBE_SCOPE(PROBE_I2C);
+  for (uint8_t attempt = 0; attempt <= I2C_RETRIES; attempt++)
+  {
+    if (attempt > 0)
+      PROBE_COUNT_EVENT(COUNTER_I2C_RETRY);
+    if (wireTryReadDataBlock(reg, buf, len))
+      return true;
   }
+  PROBE_COUNT_EVENT(COUNTER_I2C_FAIL);
+  return false;
+}
 
-  float absorbance = -log10f(transmittance); // Use log10f for float
-
-  if (isnan(absorbance) || isinf(absorbance)) {
-      Serial.println("Error: Absorbance calculation resulted in NaN or Infinity.");
-      return -1.0; // Return error indicator
+bool wireWriteByte(uint8_t val)
+{
+  PROBE_SCOPE(PROBE_I2C);
+  for (uint8_t attempt = 0; attempt <= I2C_RETRIES; attempt++)
+  {
+    if (attempt > 0)
+      PROBE_COUNT_EVENT(COUNTER_I2C_RETRY);
+    if (wireTryWriteByte(val))
+      return true;
   }
-  return absorbance;
+  PROBE_COUNT_EVENT(COUNTER_I2C_FAIL);
+  return false;
 }
 
+
 // ============================================
-// NEW FUNCTION: performMultisampling
-// Takes multiple readings and returns the average.
-// Returns 0 if all reads fail.
+// LED drive
+// Each LED has its own duty cycle, set by calibration so that every
+// wavelength reaches the target counts in about the same, short,
+// integration. selectLED() and setLEDDuty() are the only places LEDs are
+// driven.
 // ============================================
-uint16_t performMultisampling(int numSamples = 5, int delayBetweenSamples = 50) {
-    unsigned long totalReading = 0;
-    int successfulReads = 0;
-    uint16_t currentSampleReading = 0;
+uint16_t ledDuty[LED_COUNT] = {LED_DUTY_MAX, LED_DUTY_MAX, LED_DUTY_MAX};
+uint8_t litLED = LED_NONE;
 
-    Serial.print("Performing multisampling (");
-    Serial.print(numSamples);
-    Serial.println(" samples)...");
+void ledAttach()
+{
+  for (uint8_t i = 0; i < LED_COUNT; i++)
+    ledcAttach(ledPins[i], LED_PWM_FREQ_HZ, LED_PWM_BITS);
+}
 
-    for (int i = 0; i < numSamples; i++) {
-        if (readCh0Light(currentSampleReading)) {
-            totalReading += currentSampleReading;
-            successfulReads++;
-            // Serial.print("Sample "); Serial.print(i+1); Serial.print(": "); Serial.println(currentSampleReading); // Optional: print each sample
-        } else {
-            Serial.print("Multisampling: Read failed on sample ");
-            Serial.println(i + 1);
-            // Optionally add a small retry delay here? For now, just skip.
-        }
-        delay(delayBetweenSamples); // Delay between samples
-    }
+// Lights one LED (or none, for LED_NONE) at its duty cycle.
+void selectLED(uint8_t led)
+{
+  for (uint8_t i = 0; i < LED_COUNT; i++)
+    ledcWrite(ledPins[i], i == led ? ledDuty[i] : 0);
+  litLED = led;
+  if (led == LED_NONE)
+    return;
+  Serial.print(ledNames[led]);
+  Serial.println(" LED ON");
+}
 
-    if (successfulReads > 0) {
-        uint16_t averageReading = (uint16_t)(totalReading / successfulReads);
-        Serial.print("Multisampling successful. Average: ");
-        Serial.println(averageReading);
-        return averageReading;
-    } else {
-        Serial.println("Multisampling failed: No successful reads.");
-        return 0; // Indicate failure
-    }
+// Changes an LED's intensity, taking effect at once if it is lit.
+void setLEDDuty(uint8_t led, uint16_t duty)
+{
+  ledDuty[led] = duty;
+  if (led == litLED)
+    ledcWrite(ledPins[led], duty);
 }
 
 
 // ============================================
-// helper functions end
+// Auto-exposure: optimizeSensorSettings
+// Searches ATIME periods, AGAIN and LED duty for the lit LED so CH0 lands
+// between EXPOSE_TARGET_COUNTS and the saturation margin in the shortest
+// integration. A probe measures the count rate; the best setting is
+// computed from it and checked against a real integration, repeating until
+// the check agrees. An LED too bright for the shortest integration that
+// can hold the target is dimmed to fit it, instead of being left short of
+// the target. Results are kept in the calibration table per LED.
 // ============================================
+#define EXPOSE_PROBE_PERIODS 16
+#define EXPOSE_MAX_PERIODS 150     // Longest integration the search may pick (~410 ms)
+#define EXPOSE_TARGET_COUNTS 40000 // ~60% of the 16-bit range
+#define EXPOSE_SATURATION 0.9f     // Fraction of full scale treated as saturated
+#define EXPOSE_MIN_PROBE_COUNTS 100
+#define EXPOSE_MAX_ROUNDS 6
+// Fewest periods whose full scale holds the target below the saturation margin
+#define EXPOSE_SHORTEST_PERIODS ((uint8_t)(EXPOSE_TARGET_COUNTS / (EXPOSE_SATURATION * 1024) + 1))
+#define EXPOSE_DUTY_TOLERANCE 20 // Duty within 1/20 of the tested one confirms it
 
-// --- BLE Server Callbacks ---
-class MyServerCallbacks : public BLEServerCallbacks
-{
-  void onConnect(BLEServer *pServerInstance) // Renamed parameter
-  {
-    deviceConnected = true;
-    Serial.println("Client connected");
-    if (pAdvertising != nullptr) {
-        pAdvertising->stop();
-        Serial.println("Advertising stopped.");
-    } else {
-        Serial.println("Warning: pAdvertising object is null on connect.");
-    }
-  };
-
-  void onDisconnect(BLEServer *pServerInstance)
-  {
-    deviceConnected = false;
-    Serial.println("Client disconnected");
-     if (pAdvertising != nullptr) {
-        BLEDevice::startAdvertising(); // Use standard function to restart
-        Serial.println("Advertising restarted.");
-    } else {
-        Serial.println("Error: pAdvertising object is null on disconnect!");
-    }
-  }
-};
+const float gainFactor[4] = {1.0f, 8.0f, 16.0f, 120.0f};
 
-// --- BLE Characteristic Callbacks ---
-class MyCallbacks : public BLECharacteristicCallbacks
+struct ExposureSearch
 {
-  void onWrite(BLECharacteristic *pCharacteristic)
-  {
-    String rxValueString = pCharacteristic->getValue(); // Original method
-
-    if (rxValueString.length() > 0)
-    {
-      Serial.print("Received: ");
-      Serial.println(rxValueString);
-
-      if (rxValueString == "READ_SENSOR") {
-          // --- MODIFICATION: Use multisampling for sample reading ---
-          uint16_t averagedSampleReading = performMultisampling(5, 50); // Example: 5 samples, 50ms delay
-
-          if (averagedSampleReading > 0) { // Check if multisampling was successful
-              Serial.print("Averaged Ch0: ");
-              Serial.println(averagedSampleReading);
-
-              // Use the averaged reading for absorbance calculation
-              float absorbance = calculateAbsorbance(averagedSampleReading);
-
-              // Check if absorbance calculation was valid
-              if (absorbance >= 0.0 || absorbance < 0.0) { // Basic check if it's a number
-                  Serial.print("Absorbance (formatted): ");
-                  char absorbanceString[20];
-                  dtostrf(absorbance, 2, 4, absorbanceString);
-                  Serial.println(absorbanceString);
-
-                  Serial.print("Absorbance (raw): ");
-                  Serial.println(absorbance, 4);
-
-                  // Send absorbance prefixed with 'd:'
-                  String dataString = "d:" + String(absorbanceString);
-                  if (pTxCharacteristic != nullptr) {
-                      pTxCharacteristic->setValue((uint8_t*)dataString.c_str(), dataString.length());
-                      pTxCharacteristic->notify();
-                  }
-
-                  // Send continuous update prefixed with 'a:' (using the same averaged value)
-                   String continuousDataString = "a:" + String(absorbanceString);
-                   if (pTxCharacteristic != nullptr) {
-                       pTxCharacteristic->setValue((uint8_t*)continuousDataString.c_str(), continuousDataString.length());
-                       pTxCharacteristic->notify();
-                   }
-              } else {
-                   Serial.println("Absorbance calculation failed after multisampling.");
-                   String errorMsg = "Error: Absorbance calc failed";
-                   if (pTxCharacteristic != nullptr) {
-                       pTxCharacteristic->setValue((uint8_t*)errorMsg.c_str(), errorMsg.length());
-                       pTxCharacteristic->notify();
-                   }
-              }
-          } else {
-              Serial.println("Multisampling failed for READ_SENSOR");
-              String errorMsg = "Error: Sensor read failed (multi)";
-               if (pTxCharacteristic != nullptr) {
-                   pTxCharacteristic->setValue((uint8_t*)errorMsg.c_str(), errorMsg.length());
-                   pTxCharacteristic->notify();
-               }
-          }
-          // --- End of READ_SENSOR modification ---
-      }
-      else if (rxValueString == "SET_ZERO") // Original SET_ZERO block
-      {
-        Serial.println("SET_ZERO command received (integrated into LED commands)");
-        String logMessage = "SET_ZERO command received (integrated)";
-        if (pTxCharacteristic != nullptr) {
-            pTxCharacteristic->setValue((uint8_t *)logMessage.c_str(), logMessage.length());
-            pTxCharacteristic->notify();
-        }
-      }
-      else if (rxValueString == "LED_RED_ON"){
-        
-        int periods = 150;
-        digitalWrite(redLEDPin, HIGH);
-        digitalWrite(greenLEDPin, LOW);
-        digitalWrite(blueLEDPin, LOW);
-        Serial.println("Red LED ON");
-        delay(250);
-        setIntegrationTimePeriods(periods);
-        setAmbientLightGain(AGAIN_8X);
-        readCh0Light(ch0_reading);
-        delay(periods*3);
-
-        uint16_t averagedZeroReading = performMultisampling(3, periods * 3);
-        zeroReading = averagedZeroReading;
-
-        readCh0Light(ch0_reading);
-        Serial.println(calculateAbsorbance(ch0_reading));
-
-        //while(calculateAbsorbance(ch0_reading)!= 0){  
-          while (calculateAbsorbance(ch0_reading) > 0.0001 || calculateAbsorbance(ch0_reading) < -0.0001){ 
-          averagedZeroReading = performMultisampling(3, periods * 3);
-          zeroReading = averagedZeroReading;
-          delay(periods * 3);
-          readCh0Light(ch0_reading);
-          Serial.println("calculated again");
-          Serial.println(calculateAbsorbance(ch0_reading));
-        }
-
-        
-        String zeroDoneMessage = "z:DONE";
-        if (pTxCharacteristic != nullptr) {
-        pTxCharacteristic->setValue((uint8_t*)zeroDoneMessage.c_str(), zeroDoneMessage.length());
-        pTxCharacteristic->notify();
-        Serial.println("Sent: z:DONE");
-        }
+  uint8_t led;
+  uint8_t periods; // Setting under test
+  uint8_t gain;
+  uint16_t duty;
+  uint8_t rounds;
+  uint8_t discard; // Each setting change leaves one mixed integration
+};
 
+ExposureSearch exposeJob;
 
-      }
-      else if (rxValueString == "LED_GREEN_ON"){
-        int periods = 150;
-        digitalWrite(redLEDPin, LOW);
-        digitalWrite(greenLEDPin, HIGH);
-        digitalWrite(blueLEDPin, LOW);
-        Serial.println("Green LED ON");
-        delay(250);
-        setIntegrationTimePeriods(periods);
-        setAmbientLightGain(AGAIN_8X);
-        readCh0Light(ch0_reading);
-        delay(periods*3);
-
-        uint16_t averagedZeroReading = performMultisampling(3, periods * 3);
-        zeroReading = averagedZeroReading;
-
-        readCh0Light(ch0_reading);
-        Serial.println(calculateAbsorbance(ch0_reading));
-
-        //while(calculateAbsorbance(ch0_reading)!= 0){  
-          while (calculateAbsorbance(ch0_reading) > 0.0001 || calculateAbsorbance(ch0_reading) < -0.0001){
-          averagedZeroReading = performMultisampling(3, periods * 3);
-          zeroReading = averagedZeroReading;
-          delay(periods * 3);
-          readCh0Light(ch0_reading);
-          Serial.println("calculated again");
-          Serial.println(calculateAbsorbance(ch0_reading));
-        }
+// ALS full-scale count for an integration of the given length.
+uint32_t alsFullScale(uint8_t periods)
+{
+  uint32_t fullScale = 1024UL * periods;
+  return fullScale < 65535 ? fullScale : 65535;
+}
 
-        
-        String zeroDoneMessage = "z:DONE";
-        if (pTxCharacteristic != nullptr) {
-        pTxCharacteristic->setValue((uint8_t*)zeroDoneMessage.c_str(), zeroDoneMessage.length());
-        pTxCharacteristic->notify();
-        Serial.println("Sent: z:DONE");
-        }
+bool applyExposure(uint8_t periods, uint8_t gain)
+{
+  return setIntegrationTimePeriods(periods) && setAmbientLightGain(gain);
+}
 
-      }
-      else if (rxValueString == "LED_BLUE_ON"){
-        int periods = 150;
-        digitalWrite(redLEDPin, LOW);
-        digitalWrite(greenLEDPin, LOW);
-        digitalWrite(blueLEDPin, HIGH);
-        Serial.println("Blue LED ON");
-        delay(250);
-        setIntegrationTimePeriods(periods);
-        setAmbientLightGain(AGAIN_8X);
-        readCh0Light(ch0_reading);
-        delay(periods*3);
-
-        uint16_t averagedZeroReading = performMultisampling(3, periods * 3);
-        zeroReading = averagedZeroReading;
-
-        readCh0Light(ch0_reading);
-        Serial.println(calculateAbsorbance(ch0_reading));
-
-        //while(calculateAbsorbance(ch0_reading)!= 0){  
-          while (calculateAbsorbance(ch0_reading) > 0.0001 || calculateAbsorbance(ch0_reading) < -0.0001){
-          averagedZeroReading = performMultisampling(3, periods * 3);
-          zeroReading = averagedZeroReading;
-          delay(periods * 3);
-          readCh0Light(ch0_reading);
-          Serial.println("calculated again");
-          Serial.println(calculateAbsorbance(ch0_reading));
-        }
+void exposeBegin(uint8_t led)
+{
+  exposeJob.led = led;
+  exposeJob.periods = EXPOSE_PROBE_PERIODS;
+  exposeJob.gain = AGAIN_1X;
+  exposeJob.duty = LED_DUTY_MAX;
+  exposeJob.rounds = 0;
+  exposeJob.discard = 1;
+  setLEDDuty(led, exposeJob.duty);
+  applyExposure(exposeJob.periods, exposeJob.gain);
+}
 
-        
-        String zeroDoneMessage = "z:DONE";
-        if (pTxCharacteristic != nullptr) {
-        pTxCharacteristic->setValue((uint8_t*)zeroDoneMessage.c_str(), zeroDoneMessage.length());
-        pTxCharacteristic->notify();
-        Serial.println("Sent: z:DONE");
+// Picks the shortest non-saturating integration reaching the target for a
+// count rate given per period at 1X. If nothing reaches the target within
+// EXPOSE_MAX_PERIODS, takes the setting with the most counts instead.
+void chooseExposure(float rate, uint8_t &periods, uint8_t &gain)
+{
+  bool found = false;
+  float bestCounts = -1.0f;
+  for (uint8_t g = AGAIN_1X; g <= AGAIN_120X; g++)
+  {
+    for (uint16_t p = 1; p <= EXPOSE_MAX_PERIODS; p++)
+    {
+      float counts = rate * gainFactor[g] * p;
+      if (counts > EXPOSE_SATURATION * alsFullScale(p))
+        continue;
+      if (counts >= EXPOSE_TARGET_COUNTS)
+      {
+        // Lower gains were tried first, so only a strictly shorter time wins.
+        if (!found || p < periods)
+        {
+          periods = p;
+          gain = g;
         }
-
+        found = true;
+        break;
       }
-      else // Original unknown command handler
+      if (!found && counts > bestCounts)
       {
-          String logMessage = "Received unknown command: " + rxValueString;
-           if (pTxCharacteristic != nullptr) {
-              pTxCharacteristic->setValue((uint8_t *)logMessage.c_str(), logMessage.length());
-              pTxCharacteristic->notify();
-           }
+        bestCounts = counts;
+        periods = p;
+        gain = g;
       }
     }
   }
-};
+}
 
-// --- Arduino Setup Function ---
-void setup()
+// Same, with the LED duty as a third knob. rate is per period at 1X and
+// full duty. Dimming only helps when the LED overfills the shortest
+// integration that can hold the target; otherwise it stays at full duty.
+void chooseIntensity(float rate, uint8_t &periods, uint8_t &gain, uint16_t &duty)
 {
-  Serial.begin(115200);
-  Serial.println("Starting BLE server!");
-
-  pinMode(redLEDPin, OUTPUT);
-  pinMode(greenLEDPin, OUTPUT);
-  pinMode(blueLEDPin, OUTPUT);
-  digitalWrite(redLEDPin, LOW);
-  digitalWrite(greenLEDPin, LOW);
-  digitalWrite(blueLEDPin, LOW);
+  float counts = rate * EXPOSE_SHORTEST_PERIODS;
+  if (counts <= EXPOSE_TARGET_COUNTS)
+  {
+    duty = LED_DUTY_MAX;
+    chooseExposure(rate, periods, gain);
+    return;
+  }
+  periods = EXPOSE_SHORTEST_PERIODS;
+  gain = AGAIN_1X;
+  duty = (uint16_t)lroundf(LED_DUTY_MAX * EXPOSE_TARGET_COUNTS / counts);
+  if (duty < LED_DUTY_MIN)
+    duty = LED_DUTY_MIN;
+}
 
-  Wire.begin(); // Initialize I2C
+// Feeds the CH0 count of one fresh integration at the setting under test.
+// Returns true when the search is finished and exposureJob holds the result.
+bool optimizeSensorSettings(uint16_t ch0)
+{
+  exposeJob.rounds++;
+  bool saturated = ch0 >= EXPOSE_SATURATION * alsFullScale(exposeJob.periods);
+  uint8_t periods = exposeJob.periods;
+  uint8_t gain = exposeJob.gain;
+  uint16_t duty = exposeJob.duty;
 
-  // ============================================
-  // setup apds start
-  // ============================================
-  if (!initAPD())
+  if (saturated)
   {
-    Serial.println("APDS-9930 Initialization Failed! Halting.");
-    while (1); // Stop execution if sensor fails
+    // Too bright to measure a rate: collect less light and retry.
+    if (gain > AGAIN_1X)
+      gain--;
+    else if (periods > 1)
+      periods = periods > 8 ? periods / 8 : 1;
+    else if (duty > LED_DUTY_MIN)
+      duty = duty / 8 > LED_DUTY_MIN ? duty / 8 : LED_DUTY_MIN;
+    else
+      return true; // Brightest the sensor can take
+  }
+  else if (ch0 < EXPOSE_MIN_PROBE_COUNTS && gain != AGAIN_120X)
+  {
+    gain = AGAIN_120X; // Too dim for a reliable rate
   }
   else
   {
-    Serial.println("APDS-9930 Initialized Successfully.");
+    // Rate per period at 1X and full duty
+    float rate = ch0 > 0 ? (float)ch0 * LED_DUTY_MAX / (gainFactor[gain] * periods * duty) : 0.0f;
+    if (rate <= 0.0f)
+    {
+      periods = EXPOSE_MAX_PERIODS;
+      gain = AGAIN_120X;
+      duty = LED_DUTY_MAX;
+    }
+    else
+    {
+      chooseIntensity(rate, periods, gain, duty);
+    }
+    uint16_t dutyChange = duty > exposeJob.duty ? duty - exposeJob.duty : exposeJob.duty - duty;
+    if (periods == exposeJob.periods && gain == exposeJob.gain &&
+        dutyChange * EXPOSE_DUTY_TOLERANCE <= exposeJob.duty)
+      return true; // The measurement confirms the setting
   }
-  // Original optional settings from user code
-  setAmbientLightGain(AGAIN_1X);
-  setIntegrationTimePeriods(200);
-  delay(120);
-  // ============================================
-  // setup apds end
-  // ============================================
 
-  // --- Initialize BLE ---
-  BLEDevice::init("ESP32_SP"); // Using shorter name from previous suggestion
-  pServer = BLEDevice::createServer();
-  pServer->setCallbacks(new MyServerCallbacks());
-  BLEService *pService = pServer->createService(SERVICE_UUID);
+  if (exposeJob.rounds >= EXPOSE_MAX_ROUNDS)
+    return true;
+  exposeJob.periods = periods;
+  exposeJob.gain = gain;
+  exposeJob.duty = duty;
+  exposeJob.discard = 1;
+  setLEDDuty(exposeJob.led, duty);
+  applyExposure(periods, gain);
+  return false;
+}
 
-  // TX Characteristic
-  pTxCharacteristic = pService->createCharacteristic(
-      CHARACTERISTIC_TX_UUID,
-      BLECharacteristic::PROPERTY_NOTIFY
-  );
-  pTxCharacteristic->addDescriptor(new BLEDescriptor(BLEUUID((uint16_t)0x2902))); // CCCD Descriptor
+// ============================================
+// Absorbance kernel
+// A = log2(blank - dark) - log2(sample - dark), scaled by log10(2), all in
+// integer arithmetic. log2 comes from a 257-entry table of log2(1 + i/256)
+// in Q16 built at compile time, with linear interpolation between entries;
+// every 16-bit count normalises to the table without truncation, and the
+// interpolation error (< 3e-6 in log2) is far below one output unit.
+// Output is fixed point in units of 1/ABS_FIXED_SCALE (0.1 mAU).
+// ============================================
+#define ABS_FIXED_SCALE 10000
+#define ABS_INVALID INT32_MIN                 // No usable blank
+#define ABS_OPAQUE (99 * ABS_FIXED_SCALE)     // Sample at or below dark
+#define LOG2_TABLE_BITS 8
+#define LOG2_TABLE_SIZE (1 << LOG2_TABLE_BITS)
+#define LOG2_FRAC_BITS 16
+// round(log10(2) * ABS_FIXED_SCALE * 2^16): Q16 log2 difference -> output units, Q32
+#define LOG10_2_ABS_Q32 197283058LL
 
-  // RX Characteristic
-  pRxCharacteristic = pService->createCharacteristic(
-      CHARACTERISTIC_RX_UUID,
-      BLECharacteristic::PROPERTY_WRITE | BLECharacteristic::PROPERTY_WRITE_NR // Allow write without response
-  );
-  pRxCharacteristic->setCallbacks(new MyCallbacks());
+// ln(x) for x in [1, 2] from the atanh series; compile-time only.
+constexpr double constexprLn(double x)
+{
+  double z = (x - 1.0) / (x + 1.0);
+  double z2 = z * z;
+  double term = z;
+  double sum = 0.0;
+  for (int k = 1; k < 60; k += 2)
+  {
+    sum += term / k;
+    term *= z2;
+  }
+  return 2.0 * sum;
+}
 
-  pService->start();
+struct Log2Table
+{
+  int32_t q16[LOG2_TABLE_SIZE + 1];
+};
 
-  // --- Advertising ---
-  pAdvertising = BLEDevice::getAdvertising();
-  pAdvertising->addServiceUUID(SERVICE_UUID);
-  pAdvertising->setScanResponse(true); // Set to true if name is short enough for UUID
-  BLEDevice::startAdvertising();
+constexpr Log2Table makeLog2Table()
+{
+  Log2Table table{};
+  const double ln2 = constexprLn(2.0);
+  for (int i = 0; i <= LOG2_TABLE_SIZE; i++)
+    table.q16[i] = (int32_t)(constexprLn(1.0 + (double)i / LOG2_TABLE_SIZE) / ln2 * (1 << LOG2_FRAC_BITS) + 0.5);
+  return table;
+}
 
-  Serial.println("Waiting for a client connection to notify...");
-  zeroReading = 0;
+constexpr Log2Table log2Table = makeLog2Table();
+static_assert(log2Table.q16[0] == 0, "log2(1) must be 0");
+static_assert(log2Table.q16[LOG2_TABLE_SIZE] == 1 << LOG2_FRAC_BITS, "log2(2) must be 1");
+
+// log2(x) in Q16 for 1 <= x <= 65535.
+inline int32_t log2Fixed(uint32_t x)
+{
+  int32_t exponent = 31 - __builtin_clz(x);
+  uint32_t mantissa = x << (15 - exponent);   // [2^15, 2^16)
+  uint32_t fraction = mantissa - (1UL << 15); // 15 bits
+  uint32_t index = fraction >> (15 - LOG2_TABLE_BITS);
+  uint32_t weight = fraction & ((1UL << (15 - LOG2_TABLE_BITS)) - 1);
+  int32_t lo = log2Table.q16[index];
+  int32_t hi = log2Table.q16[index + 1];
+  return (exponent << LOG2_FRAC_BITS) + lo +
+         (((hi - lo) * (int32_t)weight + (1 << (14 - LOG2_TABLE_BITS))) >> (15 - LOG2_TABLE_BITS));
 }
 
-// --- Arduino Loop Function ---
-void loop()
+// Converts a Q16 log2 difference to output units, rounding to nearest.
+inline int32_t log2DiffToAbsorbance(int32_t diffQ16)
 {
-  // --- Periodic Absorbance Update (Single Sample - Unchanged) ---
-  static unsigned long lastAbsorbanceUpdateTime = 0;
-  const unsigned long absorbanceUpdateInterval = currentIntegrationTime * 2.78;
-  unsigned long currentMillis = millis();
-
-  if (currentMillis - lastAbsorbanceUpdateTime >= absorbanceUpdateInterval) {
-      lastAbsorbanceUpdateTime = currentMillis;
-      if (deviceConnected && zeroReading > 0 && pTxCharacteristic != nullptr) {
-          // Use global ch0_reading for loop updates
-          if (readCh0Light(ch0_reading)) {
-              float absorbance = calculateAbsorbance(ch0_reading);
-              // Basic check if calculation is valid
-              if (absorbance >= 0.0 || absorbance < 0.0) {
-                  char absorbanceString[10];
-                  dtostrf(absorbance, 1, 4, absorbanceString);
-                  String continuousDataString = "a:" + String(absorbanceString);
-                  pTxCharacteristic->setValue((uint8_t*)continuousDataString.c_str(), continuousDataString.length());
-                  pTxCharacteristic->notify();
-              }
-          }
-      }
+  int64_t scaled = (int64_t)diffQ16 * LOG10_2_ABS_Q32;
+  return (int32_t)((scaled + (scaled >= 0 ? (1LL << 31) : -(1LL << 31))) / (1LL << 32));
+}
+
+int32_t absorbanceFixed(uint16_t sample, uint16_t blank, uint16_t dark)
+{
+  PROBE_SCOPE(PROBE_ABSORBANCE);
+  if (blank <= dark)
+    return ABS_INVALID;
+  if (sample <= dark)
+    return ABS_OPAQUE;
+  return log2DiffToAbsorbance(log2Fixed(blank - dark) - log2Fixed(sample - dark));
+}
+
+// Same as absorbanceFixed() over a buffer, with the blank term computed once.
+void absorbanceFixedBatch(const uint16_t *samples, int32_t *out, size_t count, uint16_t blank, uint16_t dark)
+{
+  if (blank <= dark)
+  {
+    for (size_t i = 0; i < count; i++)
+      out[i] = ABS_INVALID;
+    return;
+  }
+  int32_t blankLog = log2Fixed(blank - dark);
+  for (size_t i = 0; i < count; i++)
+  {
+    uint16_t sample = samples[i];
+    out[i] = sample <= dark ? ABS_OPAQUE : log2DiffToAbsorbance(blankLog - log2Fixed(sample - dark));
   }
-  // --- End of Periodic Absorbance Update ---
+}
+
+// ============================================
+// Filter engine
+// A StreamFilter smooths integrations on two paths, configured separately
+// over BLE (FILTER): READ filters the multisample jobs behind READ_SENSOR,
+// READ_N, SCAN and the dark average, with the whole job as its window;
+// STREAM filters the idle absorbance updates over a sliding window. The
+// STREAM_START raw stream, kinetics, auto-zero and the exposure search take
+// integrations unfiltered. Counts in, counts out, integer arithmetic
+// throughout.
+//
+//   MEAN    mean of the window (window 1 passes samples through)
+//   MEDIAN  mean of the window samples within k robust sigmas (1.4826 MAD)
+//           of its median: a spike or a bubble is dropped, not averaged in
+//   EMA     exponential moving average, alpha in 1/256
+//   KALMAN  scalar Kalman filter on a constant level, with process noise q
+//           and measurement noise r in counts^2
+// ============================================
+#define FILTER_WINDOW_MAX 16
+#define FILTER_MAD_TO_SIGMA 14826 // In 1/10000
+#define FILTER_MIN_THRESHOLD 2    // Counts; a zero MAD must not reject quantisation noise
+#define FILTER_MEDIAN_K_MIN 7     // 0.7 sigma is just over one MAD, so half the window always passes
+
+enum FilterKind : uint8_t
+{
+  FILTER_MEAN,
+  FILTER_MEDIAN,
+  FILTER_EMA,
+  FILTER_KALMAN,
+  FILTER_KIND_COUNT
+};
 
-  delay(10); // Original delay
+enum FilterMode : uint8_t
+{
+  FILTER_MODE_READ,
+  FILTER_MODE_STREAM,
+  FILTER_MODE_COUNT
+};
+
+const char *const filterKindNames[FILTER_KIND_COUNT] = {"MEAN", "MEDIAN", "EMA", "KALMAN"};
+const char *const filterModeNames[FILTER_MODE_COUNT] = {"READ", "STREAM"};
+
+struct FilterConfig
+{
+  uint8_t kind;
+  uint16_t p1; // MEAN, MEDIAN: window (STREAM only); EMA: alpha; KALMAN: q
+  uint16_t p2; // MEDIAN: k in tenths of a sigma; KALMAN: r
+};
+
+// Parameters used when FILTER leaves them out, and their valid ranges
+const FilterConfig filterDefaults[FILTER_KIND_COUNT] = {
+    {FILTER_MEAN, 4, 0},
+    {FILTER_MEDIAN, 5, 35},
+    {FILTER_EMA, 32, 0},
+    {FILTER_KALMAN, 1, 100},
+};
+const uint16_t filterLimits[FILTER_KIND_COUNT][4] = {
+    // p1 min, p1 max, p2 min, p2 max
+    {1, FILTER_WINDOW_MAX, 0, 0},
+    {1, FILTER_WINDOW_MAX, FILTER_MEDIAN_K_MIN, 100},
+    {1, 256, 0, 0},
+    {0, 65535, 1, 65535},
+};
+
+FilterConfig filterConfig[FILTER_MODE_COUNT] = {
+    {FILTER_MEDIAN, FILTER_WINDOW_MAX, 35},
+    {FILTER_MEAN, 1, 0},
+};
+
+struct StreamFilter
+{
+  FilterConfig config;
+  uint8_t window; // Samples MEAN and MEDIAN keep
+  uint8_t count;  // Samples held (MEAN, MEDIAN) or seen, saturating (EMA, KALMAN)
+  uint8_t head;
+  uint8_t used;   // Samples behind the last filterValue(); MEDIAN drops outliers
+  uint16_t samples[FILTER_WINDOW_MAX];
+  int32_t level;     // EMA, KALMAN estimate in Q8 counts
+  uint32_t variance; // KALMAN estimate variance in Q8 counts^2
+};
+
+StreamFilter streamFilterCh0;
+StreamFilter streamFilterCh1;
+
+void filterBegin(StreamFilter &f, const FilterConfig &config, uint8_t window)
+{
+  f.config = config;
+  f.window = window < 1 ? 1 : (window > FILTER_WINDOW_MAX ? FILTER_WINDOW_MAX : window);
+  f.count = 0;
+  f.head = 0;
+  f.used = 0;
+}
+
+void filterPush(StreamFilter &f, uint16_t x)
+{
+  int32_t z = (int32_t)x << 8;
+  switch (f.config.kind)
+  {
+  case FILTER_MEAN:
+  case FILTER_MEDIAN:
+    f.samples[f.head] = x;
+    f.head = (f.head + 1) % f.window;
+    if (f.count < f.window)
+      f.count++;
+    return;
+  case FILTER_EMA:
+    if (f.count == 0)
+      f.level = z;
+    else
+      f.level += (int32_t)(((int64_t)(z - f.level) * f.config.p1) >> 8);
+    break;
+  case FILTER_KALMAN:
+    if (f.count == 0)
+    {
+      f.level = z;
+      f.variance = (uint32_t)f.config.p2 << 8;
+    }
+    else
+    {
+      uint64_t predicted = (uint64_t)f.variance + ((uint32_t)f.config.p1 << 8);
+      uint64_t gain = (predicted << 16) / (predicted + ((uint32_t)f.config.p2 << 8)); // Q16
+      f.level += (int32_t)(((int64_t)(z - f.level) * (int64_t)gain) >> 16);
+      f.variance = (uint32_t)((predicted * (65536 - gain)) >> 16);
+    }
+    break;
+  }
+  if (f.count < UINT8_MAX)
+    f.count++;
+}
+
+void sortCounts(uint16_t *v, uint8_t n)
+{
+  for (uint8_t i = 1; i < n; i++)
+  {
+    uint16_t x = v[i];
+    uint8_t j = i;
+    for (; j > 0 && v[j - 1] > x; j--)
+      v[j] = v[j - 1];
+    v[j] = x;
+  }
+}
+
+// Median of a sorted run, rounded down.
+uint16_t sortedMedian(const uint16_t *v, uint8_t n)
+{
+  return n % 2 ? v[n / 2] : (uint16_t)(((uint32_t)v[n / 2 - 1] + v[n / 2]) / 2);
+}
+
+// Current output in counts, or 0 before the first sample.
+uint16_t filterValue(StreamFilter &f)
+{
+  if (f.count == 0)
+    return 0;
+  if (f.config.kind == FILTER_EMA || f.config.kind == FILTER_KALMAN)
+  {
+    f.used = f.count;
+    int32_t value = (f.level + 128) >> 8;
+    return value < 0 ? 0 : (value > UINT16_MAX ? UINT16_MAX : (uint16_t)value);
+  }
+
+  uint32_t total = 0;
+  f.used = 0;
+  if (f.config.kind == FILTER_MEAN)
+  {
+    for (uint8_t i = 0; i < f.count; i++)
+      total += f.samples[i];
+    f.used = f.count;
+    return (uint16_t)(total / f.used);
+  }
+
+  uint16_t sorted[FILTER_WINDOW_MAX];
+  uint16_t deviation[FILTER_WINDOW_MAX];
+  memcpy(sorted, f.samples, f.count * sizeof(uint16_t));
+  sortCounts(sorted, f.count);
+  uint16_t median = sortedMedian(sorted, f.count);
+  for (uint8_t i = 0; i < f.count; i++)
+    deviation[i] = sorted[i] > median ? sorted[i] - median : median - sorted[i];
+  sortCounts(deviation, f.count);
+  uint32_t threshold = (uint32_t)sortedMedian(deviation, f.count) * FILTER_MAD_TO_SIGMA * f.config.p2 / 100000;
+  if (threshold < FILTER_MIN_THRESHOLD)
+    threshold = FILTER_MIN_THRESHOLD;
+  for (uint8_t i = 0; i < f.count; i++)
+  {
+    uint16_t d = sorted[i] > median ? sorted[i] - median : median - sorted[i];
+    if (d > threshold)
+      continue;
+    total += sorted[i];
+    f.used++;
+  }
+  if (f.used == 0)
+    return median; // Not reached while k >= FILTER_MEDIAN_K_MIN
+  return (uint16_t)(total / f.used);
+}
+
+// Validates and stores a FILTER setting; parameters left out get the kind's
+// defaults. Returns false, leaving the mode as it was, on a bad value.
+bool filterConfigure(int32_t mode, int32_t kind, const int32_t *params, uint8_t paramCount)
+{
+  if (mode < 0 || mode >= FILTER_MODE_COUNT || kind < 0 || kind >= FILTER_KIND_COUNT)
+    return false;
+  FilterConfig config = filterDefaults[kind];
+  const uint16_t *limits = filterLimits[kind];
+  if (paramCount > 0)
+  {
+    if (params[0] < limits[0] || params[0] > limits[1])
+      return false;
+    config.p1 = (uint16_t)params[0];
+  }
+  if (paramCount > 1)
+  {
+    if (params[1] < limits[2] || params[1] > limits[3])
+      return false;
+    config.p2 = (uint16_t)params[1];
+  }
+  filterConfig[mode] = config;
+  return true;
+}
+
+// Restarts the "a:" filters, after a configuration or light change.
+void filterStreamReset()
+{
+  const FilterConfig &config = filterConfig[FILTER_MODE_STREAM];
+  filterBegin(streamFilterCh0, config, config.p1);
+  filterBegin(streamFilterCh1, config, config.p1);
+}
+
+// ============================================
+// Multisample job
+// Incremental replacement for the old blocking performMultisampling().
+// Samples are paced by the sensor: each one is taken as soon as the AINT
+// data-ready flag reports a completed integration, never sooner.
+// ============================================
+#define ALS_POLL_MS 1 // Poll period once an integration is due
+
+enum SampleResult : uint8_t
+{
+  SAMPLE_PENDING, // No new integration yet
+  SAMPLE_TAKEN,
+  SAMPLE_DONE     // Last sample of the job taken
+};
+
+struct MultisampleJob
+{
+  uint8_t remaining;
+  uint8_t taken;
+  uint8_t successful;
+  uint8_t discard; // Integrations to drop after an exposure or LED change
+  StreamFilter ch0; // READ filter over the whole job
+  StreamFilter ch1;
+  uint16_t minCh0;
+  uint16_t maxCh0;
+  uint32_t startedUs; // PROBE_NOW_US() at multisampleBegin()
+};
+
+MultisampleJob sampler;
+
+// Takes one reading if a fresh integration is available. Returns 1 when a
+// reading was taken, 0 when none is ready yet, -1 on a bus error.
+int8_t readFreshChannels(uint16_t &ch0, uint16_t &ch1)
+{
+  bool ready;
+  if (!isDataReady(ready))
+    return -1;
+  if (!ready)
+    return 0;
+  bool ok = readChannels(ch0, ch1);
+  clearDataReadyFlag();
+  return ok ? 1 : -1;
+}
+
+// How long to sleep after a sample before polling for the next integration.
+uint32_t nextSampleWaitMs()
+{
+  uint32_t integration = integrationTimeMs();
+  return integration > ALS_POLL_MS ? integration - ALS_POLL_MS : 0;
+}
+
+// discardFirst drops the integration in progress when the job starts, for
+// use right after the exposure or the LED has changed.
+void multisampleBegin(uint8_t numSamples, bool discardFirst)
+{
+  sampler.remaining = numSamples;
+  sampler.taken = 0;
+  sampler.successful = 0;
+  sampler.discard = discardFirst ? 1 : 0;
+  filterBegin(sampler.ch0, filterConfig[FILTER_MODE_READ], numSamples);
+  filterBegin(sampler.ch1, filterConfig[FILTER_MODE_READ], numSamples);
+  sampler.minCh0 = UINT16_MAX;
+  sampler.maxCh0 = 0;
+  sampler.startedUs = PROBE_NOW_US();
+  clearDataReadyFlag();
+}
+
+SampleResult multisampleStep()
+{
+  uint16_t currentSampleReading = 0;
+  uint16_t currentCh1Reading = 0;
+  int8_t result = readFreshChannels(currentSampleReading, currentCh1Reading);
+  if (result == 0)
+    return SAMPLE_PENDING;
+  if (sampler.discard > 0)
+  {
+    sampler.discard--;
+    return SAMPLE_TAKEN;
+  }
+  sampler.taken++;
+  if (result > 0)
+  {
+    filterPush(sampler.ch0, currentSampleReading);
+    filterPush(sampler.ch1, currentCh1Reading);
+    if (currentSampleReading < sampler.minCh0)
+      sampler.minCh0 = currentSampleReading;
+    if (currentSampleReading > sampler.maxCh0)
+      sampler.maxCh0 = currentSampleReading;
+    sampler.successful++;
+  }
+  else
+  {
+    Serial.print("Multisampling: Read failed on sample ");
+    Serial.println(sampler.taken);
+  }
+  sampler.remaining--;
+  if (sampler.remaining > 0)
+    return SAMPLE_TAKEN;
+  PROBE_RECORD(PROBE_MULTISAMPLE, PROBE_NOW_US() - sampler.startedUs);
+  return SAMPLE_DONE;
+}
+
+// Filtered value of the successful reads, or 0 if all reads failed.
+uint16_t multisampleResult()
+{
+  if (sampler.successful == 0)
+  {
+    Serial.println("Multisampling failed: No successful reads.");
+    return 0;
+  }
+  uint16_t averageReading = filterValue(sampler.ch0);
+  Serial.print("Multisampling successful. Filtered: ");
+  Serial.print(averageReading);
+  Serial.print(" from ");
+  Serial.print(sampler.ch0.used);
+  Serial.print("/");
+  Serial.println(sampler.successful);
+  return averageReading;
+}
+
+uint16_t multisampleResultCh1()
+{
+  if (sampler.successful == 0)
+    return 0;
+  return filterValue(sampler.ch1);
+}
+
+// Peak-to-peak CH0 over the successful reads.
+uint16_t multisampleSpread()
+{
+  if (sampler.successful == 0)
+    return 0;
+  return sampler.maxCh0 - sampler.minCh0;
+}
+
+
+// ============================================
+// BLE clients
+// Several centrals may connect at once (a controlling PC and observers).
+// A custom GATTS handler tracks, per connection, the MTU, whether the TX
+// CCCD is subscribed and whether the stack reports it congested. Every
+// notification is encoded once, at the smallest subscribed MTU, and sent
+// to each subscriber in turn; a congested client is skipped and its drops
+// counted, so one slow tablet never holds up the others or the sensor.
+// Fields are written by the BLE task and read by the transmit task; each
+// is a single aligned store, and a stale read costs at most one packet.
+//
+// The link itself is ours to shape. On connect each client is asked for
+// the 2M PHY, full-length link-layer packets and the fast connection
+// profile; the acquisition task drops it to the idle profile once nothing
+// has been asked of the instrument for BLE_LINK_IDLE_AFTER_MS, and back as
+// soon as a command arrives. What the central actually grants is reported
+// as "c:CONN", "c:PHY" and "c:DLE" lines and in the STATS "t:LINK" line.
+// The PHY API needs a BLE 5 controller: on the original ESP32 (BLE 4.2)
+// the request is compiled out and the link reports 1M.
+// ============================================
+#define BLE_LINK_IDLE_AFTER_MS 10000
+#if CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+#define BLE_PHY_1M ESP_BLE_GAP_PHY_1M
+#else
+#define BLE_PHY_1M 1 // The only PHY a 4.2 controller has
+#endif
+
+// Intervals in 1.25 ms units, supervision timeout in 10 ms units. The
+// central picks the interval within the range.
+struct BleLinkProfile
+{
+  uint16_t minInterval;
+  uint16_t maxInterval;
+  uint16_t latency;
+  uint16_t timeout;
+};
+
+enum BleLinkMode : uint8_t
+{
+  BLE_LINK_FAST, // 7.5-30 ms: command round trips, streams, transfers
+  BLE_LINK_IDLE, // 100-200 ms: periodic "a:" updates only, lets both radios sleep
+  BLE_LINK_NONE  // Nothing requested yet
+};
+
+const BleLinkProfile bleLinkProfiles[] = {
+    {6, 24, 0, 400},
+    {80, 160, 0, 400},
+};
+
+struct BleClient
+{
+  volatile bool active;
+  volatile bool subscribed;
+  volatile bool congested;
+  volatile uint16_t connId;
+  volatile uint16_t mtu;
+  uint32_t dropped; // Notifications skipped or refused; transmit task only
+  uint32_t oversized; // Frames too long for its MTU, not sent; transmit task only
+  esp_bd_addr_t bda;
+  uint8_t linkMode; // Last profile requested; acquisition task after connect
+  volatile uint16_t interval; // Negotiated, 1.25 ms units
+  volatile uint16_t latency;
+  volatile uint16_t timeout;  // 10 ms units
+  volatile uint8_t txPhy;
+  volatile uint8_t rxPhy;
+  volatile uint16_t txOctets; // Link-layer payload after data length extension
+};
+
+BleClient bleClients[BLE_MAX_CLIENTS];
+esp_gatt_if_t bleGattsIf = 0;
+uint16_t txCccdHandle = 0; // Set in setup() once the service has started
+volatile uint32_t bleLinkActiveAt = 0; // millis() of the last command or connection
+
+BleClient *bleClientFor(uint16_t connId)
+{
+  for (uint8_t i = 0; i < BLE_MAX_CLIENTS; i++)
+    if (bleClients[i].active && bleClients[i].connId == connId)
+      return &bleClients[i];
+  return nullptr;
+}
+
+BleClient *bleClientForBda(const uint8_t *bda)
+{
+  for (uint8_t i = 0; i < BLE_MAX_CLIENTS; i++)
+    if (bleClients[i].active && memcmp(bleClients[i].bda, bda, sizeof(esp_bd_addr_t)) == 0)
+      return &bleClients[i];
+  return nullptr;
+}
+
+// Asks the central for a connection profile. Recorded even if the request
+// fails, so a refused profile is not retried on every pass.
+void bleRequestLink(BleClient &client, uint8_t mode)
+{
+  const BleLinkProfile &profile = bleLinkProfiles[mode];
+  esp_ble_conn_update_params_t params;
+  memcpy(params.bda, client.bda, sizeof(esp_bd_addr_t));
+  params.min_int = profile.minInterval;
+  params.max_int = profile.maxInterval;
+  params.latency = profile.latency;
+  params.timeout = profile.timeout;
+  client.linkMode = mode;
+  if (esp_ble_gap_update_conn_params(&params) != ESP_OK)
+    Serial.println("Connection parameter update request failed.");
+}
+
+// Acquisition task: fast while the engine is busy or a command came in
+// recently, idle otherwise. Only clients whose profile changes are asked.
+void bleLinkUpdate(bool busy, uint32_t now)
+{
+  uint8_t mode = busy || now - bleLinkActiveAt < BLE_LINK_IDLE_AFTER_MS ? BLE_LINK_FAST : BLE_LINK_IDLE;
+  for (uint8_t i = 0; i < BLE_MAX_CLIENTS; i++)
+    if (bleClients[i].active && bleClients[i].linkMode != mode)
+      bleRequestLink(bleClients[i], mode);
+}
+
+const char *blePhyName(uint8_t phy)
+{
+  switch (phy)
+  {
+  case BLE_PHY_1M:
+    return "1M";
+#if CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+  case ESP_BLE_GAP_PHY_2M:
+    return "2M";
+  case ESP_BLE_GAP_PHY_CODED:
+    return "CODED";
+#endif
+  default:
+    return "?";
+  }
+}
+
+// Runs in the BLE task after the library's own handling.
+void bleGattsEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gattsIf, esp_ble_gatts_cb_param_t *param)
+{
+  BleClient *client;
+  switch (event)
+  {
+  case ESP_GATTS_CONNECT_EVT:
+    bleGattsIf = gattsIf;
+    for (uint8_t i = 0; i < BLE_MAX_CLIENTS; i++)
+    {
+      if (bleClients[i].active)
+        continue;
+      BleClient &slot = bleClients[i];
+      slot.connId = param->connect.conn_id;
+      slot.mtu = BLE_DEFAULT_MTU;
+      slot.subscribed = false;
+      slot.congested = false;
+      slot.dropped = 0;
+      slot.oversized = 0;
+      memcpy(slot.bda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
+      slot.interval = param->connect.conn_params.interval;
+      slot.latency = param->connect.conn_params.latency;
+      slot.timeout = param->connect.conn_params.timeout;
+      slot.txPhy = BLE_PHY_1M;
+      slot.rxPhy = BLE_PHY_1M;
+      slot.txOctets = 27;
+      // The client starts the MTU exchange (we accept up to LOCAL_MTU); the
+      // rest of the link is ours to request.
+#if CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+      if (esp_ble_gap_set_preferred_phy(slot.bda, 0, ESP_BLE_GAP_PHY_2M_PREF_MASK,
+                                        ESP_BLE_GAP_PHY_2M_PREF_MASK, ESP_BLE_GAP_PHY_OPTIONS_NO_PREF) != ESP_OK)
+        Serial.println("2M PHY request failed.");
+#endif
+      if (esp_ble_gap_set_pkt_data_len(slot.bda, BLE_DATA_LEN_MAX) != ESP_OK)
+        Serial.println("Data length extension request failed.");
+      bleRequestLink(slot, BLE_LINK_FAST);
+      bleLinkActiveAt = millis();
+      slot.active = true;
+      break;
+    }
+    break;
+  case ESP_GATTS_DISCONNECT_EVT:
+    if ((client = bleClientFor(param->disconnect.conn_id)) != nullptr)
+      client->active = false;
+    break;
+  case ESP_GATTS_MTU_EVT:
+    if ((client = bleClientFor(param->mtu.conn_id)) != nullptr)
+      client->mtu = param->mtu.mtu;
+    break;
+  case ESP_GATTS_WRITE_EVT:
+    if (param->write.handle == txCccdHandle && param->write.len == 2 &&
+        (client = bleClientFor(param->write.conn_id)) != nullptr)
+      client->subscribed = (param->write.value[0] & 0x01) != 0;
+    break;
+  case ESP_GATTS_CONGEST_EVT:
+    if ((client = bleClientFor(param->congest.conn_id)) != nullptr)
+      client->congested = param->congest.congested;
+    break;
+  default:
+    break;
+  }
+}
+
+uint8_t bleSubscriberCount()
+{
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < BLE_MAX_CLIENTS; i++)
+    if (bleClients[i].active && bleClients[i].subscribed)
+      count++;
+  return count;
+}
+
+bool bleCongested()
+{
+  for (uint8_t i = 0; i < BLE_MAX_CLIENTS; i++)
+    if (bleClients[i].active && bleClients[i].subscribed && bleClients[i].congested)
+      return true;
+  return false;
+}
+
+// Smallest MTU among subscribers, so one encoding fits every one of them.
+uint16_t bleMinMtu()
+{
+  uint16_t mtu = 0;
+  for (uint8_t i = 0; i < BLE_MAX_CLIENTS; i++)
+  {
+    const BleClient &client = bleClients[i];
+    if (client.active && client.subscribed && (mtu == 0 || client.mtu < mtu))
+      mtu = client.mtu;
+  }
+  return mtu == 0 ? BLE_DEFAULT_MTU : mtu;
+}
+
+// Sends one notification to every subscriber. Text too long for a client
+// is cut to its MTU; a binary frame is never cut, since the client could
+// not tell, and is counted in oversized instead. Transmit task only.
+void bleNotify(const uint8_t *data, uint16_t len, bool frame)
+{
+  if (pTxCharacteristic == nullptr)
+    return;
+  PROBE_SCOPE(PROBE_NOTIFY);
+  uint16_t handle = pTxCharacteristic->getHandle();
+  for (uint8_t i = 0; i < BLE_MAX_CLIENTS; i++)
+  {
+    BleClient &client = bleClients[i];
+    if (!client.active || !client.subscribed)
+      continue;
+    if (client.congested)
+    {
+      client.dropped++;
+      continue;
+    }
+    uint16_t fit = client.mtu - 3 < len ? client.mtu - 3 : len;
+    if (fit < len && frame)
+    {
+      client.oversized++;
+      continue;
+    }
+    if (esp_ble_gatts_send_indicate(bleGattsIf, client.connId, handle, fit, (uint8_t *)data, false) != ESP_OK)
+      client.dropped++;
+  }
+}
+
+
+// ============================================
+// Binary notification frames
+// Readings are sent as little-endian binary frames instead of "d:"/"a:"
+// strings. Text notifications (status, errors) are unchanged; a frame is
+// recognised by its first byte, which is never printable.
+//
+//   header  magic u8, version u8, type u8, count u8, seq u16, t0 u32 (ms)
+//   sample  dt u16 (ms after t0), ch0 u16, ch1 u16, absorbance i32
+//   raw     dt u16 (ms after t0), ch0 u16, ch1 u16
+//   kinetics  index u32, ch0 u16, ch1 u16 of the first record (taken at
+//           t0), then per record varint dt (ms), zigzag varint dch0, dch1
+//   replicate  sample layout, then n u8 (integrations the READ filter
+//           kept), spread u16 (peak-to-peak ch0 over all integrations)
+//   log     seq u32, t u32 (ms in its boot), boot u16, kind u8, led u8,
+//           ch0 u16, ch1 u16, blank u16, dark u16, absorbance i32
+//   bulk    id u8, chunk u32, then count records: kinetics t u32, ch0 u16,
+//           ch1 u16, or log records as above
+//
+// Absorbance is fixed point in units of 1/ABS_FIXED_SCALE; ABS_INVALID
+// marks a sample without a valid zero and ABS_OPAQUE one at or below dark. Stream samples are batched into one
+// frame until it fills the negotiated MTU or STREAM_FLUSH_MS passes.
+// ============================================
+#define FRAME_MAGIC 0xA5
+#define FRAME_VERSION 1
+#define FRAME_TYPE_READING 0x01 // READ_SENSOR result (replaces "d:")
+#define FRAME_TYPE_STREAM 0x02  // Continuous update (replaces "a:")
+#define FRAME_TYPE_RAW 0x03     // STREAM_START raw samples (no absorbance)
+#define FRAME_TYPE_KINETICS 0x04 // KINETICS_GET records, delta encoded
+#define FRAME_TYPE_SCAN 0x05     // SCAN result: red, green, blue samples in that order
+#define FRAME_TYPE_REPLICATE 0x06 // READ_N result, one sample per averaged reading
+#define FRAME_TYPE_LOG 0x07       // LOG_GET records, in their 24-byte flash layout
+#define FRAME_TYPE_BULK 0x08      // BULK chunk: raw kinetics or log records
+#define FRAME_TYPE_BULK_ACK 0x88  // Written by the client: BULK acknowledgement
+#define FRAME_HEADER_LEN 10
+#define FRAME_SAMPLE_LEN 10
+#define FRAME_RAW_SAMPLE_LEN 6
+#define FRAME_REPLICATE_LEN 13
+#define FRAME_MAX_LEN 244 // Largest notification payload (MTU 247)
+#define ATT_NOTIFY_OVERHEAD 3
+#define STREAM_FLUSH_MS 200
+
+struct FrameBuilder
+{
+  uint8_t buf[FRAME_MAX_LEN];
+  uint8_t type;
+  uint8_t count;
+  uint16_t len;
+  uint32_t t0;
+};
+
+uint16_t frameSequence = 0;
+FrameBuilder streamFrame;
+FrameBuilder readingFrame;
+FrameBuilder scanFrame;
+FrameBuilder replicateFrame;
+uint8_t scanSamplesQueued = 0; // Wavelengths of the current SCAN handed to scanFrame
+
+void put16(uint8_t *p, uint16_t v)
+{
+  p[0] = v & 0xFF;
+  p[1] = v >> 8;
+}
+
+void put32(uint8_t *p, uint32_t v)
+{
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = v >> 24;
+}
+
+// Largest frame that fits in one notification to every subscriber.
+uint16_t frameCapacity()
+{
+  uint16_t payload = bleMinMtu() - ATT_NOTIFY_OVERHEAD;
+  return payload < FRAME_MAX_LEN ? payload : FRAME_MAX_LEN;
+}
+
+void frameBegin(FrameBuilder &frame, uint8_t type, uint32_t t0)
+{
+  frame.type = type;
+  frame.count = 0;
+  frame.len = FRAME_HEADER_LEN;
+  frame.t0 = t0;
+}
+
+// Returns false if the sample does not fit; the caller sends and restarts.
+bool frameAppend(FrameBuilder &frame, uint32_t t, uint16_t ch0, uint16_t ch1, int32_t absorbance)
+{
+  uint32_t dt = t - frame.t0;
+  if (frame.len + FRAME_SAMPLE_LEN > frameCapacity() || dt > 0xFFFF)
+    return false;
+  uint8_t *p = frame.buf + frame.len;
+  put16(p, (uint16_t)dt);
+  put16(p + 2, ch0);
+  put16(p + 4, ch1);
+  put32(p + 6, (uint32_t)absorbance);
+  frame.len += FRAME_SAMPLE_LEN;
+  frame.count++;
+  return true;
+}
+
+bool frameAppendRaw(FrameBuilder &frame, uint32_t t, uint16_t ch0, uint16_t ch1)
+{
+  uint32_t dt = t - frame.t0;
+  if (frame.len + FRAME_RAW_SAMPLE_LEN > frameCapacity() || dt > 0xFFFF)
+    return false;
+  uint8_t *p = frame.buf + frame.len;
+  put16(p, (uint16_t)dt);
+  put16(p + 2, ch0);
+  put16(p + 4, ch1);
+  frame.len += FRAME_RAW_SAMPLE_LEN;
+  frame.count++;
+  return true;
+}
+
+void frameSend(FrameBuilder &frame)
+{
+  if (frame.count == 0)
+    return;
+  frame.buf[0] = FRAME_MAGIC;
+  frame.buf[1] = FRAME_VERSION;
+  frame.buf[2] = frame.type;
+  frame.buf[3] = frame.count;
+  put16(frame.buf + 4, frameSequence++);
+  put32(frame.buf + 6, frame.t0);
+  bleNotify(frame.buf, frame.len, true);
+  frame.count = 0;
+  frame.len = FRAME_HEADER_LEN;
+}
+
+// Adds a sample to the pending stream frame, sending it once full.
+void streamSample(uint32_t now, uint16_t ch0, uint16_t ch1, int32_t absorbance)
+{
+  if (streamFrame.count > 0 && streamFrame.type != FRAME_TYPE_STREAM)
+    frameSend(streamFrame);
+  if (streamFrame.count == 0)
+    frameBegin(streamFrame, FRAME_TYPE_STREAM, now);
+  if (!frameAppend(streamFrame, now, ch0, ch1, absorbance))
+  {
+    frameSend(streamFrame);
+    frameBegin(streamFrame, FRAME_TYPE_STREAM, now);
+    frameAppend(streamFrame, now, ch0, ch1, absorbance);
+  }
+  if (streamFrame.len + FRAME_SAMPLE_LEN > frameCapacity())
+    frameSend(streamFrame);
+}
+
+// Raw streaming: samples go out only in full-size notifications (or on flush).
+void streamRawSample(uint32_t now, uint16_t ch0, uint16_t ch1)
+{
+  if (streamFrame.count > 0 && streamFrame.type != FRAME_TYPE_RAW)
+    frameSend(streamFrame);
+  if (streamFrame.count == 0)
+    frameBegin(streamFrame, FRAME_TYPE_RAW, now);
+  if (!frameAppendRaw(streamFrame, now, ch0, ch1))
+  {
+    frameSend(streamFrame);
+    frameBegin(streamFrame, FRAME_TYPE_RAW, now);
+    frameAppendRaw(streamFrame, now, ch0, ch1);
+  }
+  if (streamFrame.len + FRAME_RAW_SAMPLE_LEN > frameCapacity())
+    frameSend(streamFrame);
+}
+
+// Sends a partly filled stream frame once its oldest sample is STREAM_FLUSH_MS old.
+void streamFlushIfDue(uint32_t now)
+{
+  if (streamFrame.count > 0 && now - streamFrame.t0 >= STREAM_FLUSH_MS)
+    frameSend(streamFrame);
+}
+
+
+// ============================================
+// Sample ring and transmit task
+// The acquisition task (core 1) is the only producer and the transmit task
+// (core 0, next to the BLE stack) the only consumer, so samples are handed
+// over through a lock-free ring. A slow or stalled radio only fills the ring
+// and never delays a read; overflow and high-water counters show how close
+// that came. Text replies go through a small FreeRTOS queue instead.
+// ============================================
+#define SAMPLE_RING_CAPACITY 512 // Power of two
+#define TX_QUEUE_LENGTH 8
+#define TX_TEXT_LEN 64
+#define TX_IDLE_WAIT_MS 20 // Wakes the transmit task to flush partial frames
+#define HEAP_SAMPLE_MS 1000 // Largest-free-block sampling period
+
+enum SampleKind : uint8_t
+{
+  SAMPLE_READING, // READ_SENSOR result
+  SAMPLE_STREAM,  // Continuous update with absorbance
+  SAMPLE_RAW,     // STREAM_START raw counts
+  SAMPLE_SCAN,    // One wavelength of a SCAN, pushed red, green, blue
+  SAMPLE_REPLICATE,    // One READ_N reading
+  SAMPLE_REPLICATE_END, // The last one, which sends the frame
+  SAMPLE_REPLICATE_FLUSH // READ_N cut short: sends what is framed, carries no reading
+};
+
+struct Sample
+{
+  uint32_t t; // millis() when read
+  uint16_t ch0;
+  uint16_t ch1;
+  int32_t absorbance;
+  uint8_t kind;
+  uint8_t n;       // Replicates: integrations the filter kept
+  uint16_t spread; // Replicates: peak-to-peak ch0
+};
+
+struct TxMessage
+{
+  uint8_t len;
+  char text[TX_TEXT_LEN];
+};
+
+template <typename T, uint32_t N>
+class SpscRing
+{
+  static_assert((N & (N - 1)) == 0, "SpscRing capacity must be a power of two");
+
+public:
+  // Producer side. Returns false (and counts an overflow) when full.
+  bool push(const T &item)
+  {
+    uint32_t head = head_.load(std::memory_order_relaxed);
+    uint32_t used = head - tail_.load(std::memory_order_acquire);
+    if (used >= N)
+    {
+      overflows_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    items_[head & (N - 1)] = item;
+    head_.store(head + 1, std::memory_order_release);
+    if (used + 1 > highWater_.load(std::memory_order_relaxed))
+      highWater_.store(used + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Consumer side.
+  bool pop(T &item)
+  {
+    uint32_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire))
+      return false;
+    item = items_[tail & (N - 1)];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  uint32_t size() const
+  {
+    return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+  }
+
+  uint32_t overflows() const { return overflows_.load(std::memory_order_relaxed); }
+  uint32_t highWater() const { return highWater_.load(std::memory_order_relaxed); }
+
+private:
+  T items_[N];
+  std::atomic<uint32_t> head_{0}; // Written by the producer only
+  std::atomic<uint32_t> tail_{0}; // Written by the consumer only
+  std::atomic<uint32_t> overflows_{0};
+  std::atomic<uint32_t> highWater_{0};
+};
+
+SpscRing<Sample, SAMPLE_RING_CAPACITY> sampleRing;
+QueueHandle_t txMessageQueue = nullptr;
+TaskHandle_t txTaskHandle = nullptr;
+std::atomic<uint32_t> txMessagesDropped{0}; // notifyMessage() runs in several tasks
+std::atomic<bool> statsRequested{false}; // Set by STATS, served by the transmit task
+uint32_t heapLargestBlockMin = UINT32_MAX; // Smallest largest-free-block seen, a fragmentation gauge
+uint32_t heapSampledAt = 0;
+
+// Producer side: called from the acquisition task only.
+void publishSample(uint8_t kind, uint32_t t, uint16_t ch0, uint16_t ch1, int32_t absorbance,
+                   uint8_t n = 0, uint16_t spread = 0)
+{
+  Sample sample = {t, ch0, ch1, absorbance, kind, n, spread};
+  if (sampleRing.push(sample) && txTaskHandle != nullptr)
+    xTaskNotifyGive(txTaskHandle);
+}
+
+// Text replies are formatted in place in a TxMessage with the txAppend*()
+// functions below, truncating at TX_TEXT_LEN, and the queue copies the
+// message by value: nothing on the text path touches the heap.
+void txBegin(TxMessage &msg)
+{
+  msg.len = 0;
+}
+
+void txAppend(TxMessage &msg, const char *text)
+{
+  while (*text != '\0' && msg.len < TX_TEXT_LEN)
+    msg.text[msg.len++] = *text++;
+}
+
+void txAppendUInt(TxMessage &msg, uint32_t value)
+{
+  char digits[10];
+  uint8_t n = 0;
+  do
+  {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  while (n > 0 && msg.len < TX_TEXT_LEN)
+    msg.text[msg.len++] = digits[--n];
+}
+
+// Appends value / 10^decimals with every decimal shown, e.g. (123, 6) -> "0.000123".
+void txAppendFixed(TxMessage &msg, uint32_t value, uint8_t decimals)
+{
+  uint32_t scale = 1;
+  for (uint8_t i = 0; i < decimals; i++)
+    scale *= 10;
+  txAppendUInt(msg, value / scale);
+  txAppend(msg, ".");
+  for (uint32_t div = scale / 10; div > 0 && msg.len < TX_TEXT_LEN; div /= 10)
+    msg.text[msg.len++] = '0' + (value / div) % 10;
+}
+
+void serialPrintMessage(const TxMessage &msg)
+{
+  Serial.write((const uint8_t *)msg.text, msg.len);
+  Serial.println();
+}
+
+void notifyMessage(const TxMessage &msg)
+{
+  if (txMessageQueue == nullptr || xQueueSend(txMessageQueue, &msg, 0) != pdTRUE)
+  {
+    txMessagesDropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  if (txTaskHandle != nullptr)
+    xTaskNotifyGive(txTaskHandle);
+}
+
+void notifyText(const char *text)
+{
+  TxMessage msg;
+  txBegin(msg);
+  txAppend(msg, text);
+  notifyMessage(msg);
+}
+
+// Packs READ_N readings into as few frames as the MTU allows and sends the
+// last one with the final reading. At the default MTU a replicate does not
+// fit, and each is sent as a plain reading without its statistics.
+void transmitReplicate(const Sample &sample)
+{
+  if (frameCapacity() < FRAME_HEADER_LEN + FRAME_REPLICATE_LEN)
+  {
+    frameBegin(readingFrame, FRAME_TYPE_READING, sample.t);
+    frameAppend(readingFrame, sample.t, sample.ch0, sample.ch1, sample.absorbance);
+    frameSend(readingFrame);
+    return;
+  }
+  FrameBuilder &frame = replicateFrame;
+  if (frame.count > 0 && (frame.len + FRAME_REPLICATE_LEN > frameCapacity() ||
+                          sample.t - frame.t0 > 0xFFFF || frame.count == 255))
+    frameSend(frame);
+  if (frame.count == 0)
+    frameBegin(frame, FRAME_TYPE_REPLICATE, sample.t);
+  uint8_t *p = frame.buf + frame.len;
+  put16(p, (uint16_t)(sample.t - frame.t0));
+  put16(p + 2, sample.ch0);
+  put16(p + 4, sample.ch1);
+  put32(p + 6, (uint32_t)sample.absorbance);
+  p[10] = sample.n;
+  put16(p + 11, sample.spread);
+  frame.len += FRAME_REPLICATE_LEN;
+  frame.count++;
+  if (sample.kind == SAMPLE_REPLICATE_END)
+    frameSend(frame);
+}
+
+void transmitSample(const Sample &sample)
+{
+  switch (sample.kind)
+  {
+  case SAMPLE_READING:
+    frameBegin(readingFrame, FRAME_TYPE_READING, sample.t);
+    frameAppend(readingFrame, sample.t, sample.ch0, sample.ch1, sample.absorbance);
+    frameSend(readingFrame);
+    break;
+  case SAMPLE_STREAM:
+    streamSample(sample.t, sample.ch0, sample.ch1, sample.absorbance);
+    break;
+  case SAMPLE_RAW:
+    streamRawSample(sample.t, sample.ch0, sample.ch1);
+    break;
+  case SAMPLE_SCAN:
+    // One frame per scan; below MTU 43 it splits, still in red, green, blue order
+    if (scanFrame.count == 0)
+      frameBegin(scanFrame, FRAME_TYPE_SCAN, sample.t);
+    if (!frameAppend(scanFrame, sample.t, sample.ch0, sample.ch1, sample.absorbance))
+    {
+      frameSend(scanFrame);
+      frameBegin(scanFrame, FRAME_TYPE_SCAN, sample.t);
+      frameAppend(scanFrame, sample.t, sample.ch0, sample.ch1, sample.absorbance);
+    }
+    if (++scanSamplesQueued == LED_COUNT)
+    {
+      frameSend(scanFrame);
+      scanSamplesQueued = 0;
+    }
+    break;
+  case SAMPLE_REPLICATE:
+  case SAMPLE_REPLICATE_END:
+    transmitReplicate(sample);
+    break;
+  case SAMPLE_REPLICATE_FLUSH:
+    frameSend(replicateFrame);
+    break;
+  }
+}
+
+void transmitText(const TxMessage &msg)
+{
+  bleNotify((const uint8_t *)msg.text, msg.len, false);
+}
+
+// Sole caller of bleNotify(). Drains the ring into frames, then pending text.
+void transmitTask(void *param)
+{
+  Sample sample;
+  TxMessage msg;
+  for (;;)
+  {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(TX_IDLE_WAIT_MS));
+    while (sampleRing.pop(sample))
+      transmitSample(sample);
+    while (xQueueReceive(txMessageQueue, &msg, 0) == pdTRUE)
+      transmitText(msg);
+    if (statsRequested.exchange(false))
+      probesReport();
+    kineticsTransmit();
+    logTransmit();
+    bulkTransmit();
+    uint32_t now = millis();
+    streamFlushIfDue(now);
+    if (now - heapSampledAt >= HEAP_SAMPLE_MS)
+    {
+      uint32_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+      if (largest < heapLargestBlockMin)
+        heapLargestBlockMin = largest;
+      heapSampledAt = now;
+    }
+  }
+}
+
+
+// ============================================
+// Auto-zero
+// The blank is the running mean of fresh integrations (Welford). Zeroing
+// stops as soon as the standard error of that mean, expressed in
+// absorbance, is within the tolerance, or when the sample or time budget
+// runs out. The achieved precision is reported either way.
+// ============================================
+#define ZERO_DEFAULT_TOLERANCE_UA 100 // Standard error target, micro-absorbance
+#define ZERO_MIN_SAMPLES 3
+#define ZERO_MAX_SAMPLES 64
+#define ZERO_BUDGET_MS 5000
+#define COUNT_QUANTIZATION_VAR (1.0f / 12.0f) // Variance floor of integer counts
+
+struct RunningStats
+{
+  uint32_t n;
+  float mean;
+  float m2; // Sum of squared deviations from the mean
+};
+
+void statsReset(RunningStats &stats)
+{
+  stats.n = 0;
+  stats.mean = 0.0f;
+  stats.m2 = 0.0f;
+}
+
+void statsAdd(RunningStats &stats, float x)
+{
+  stats.n++;
+  float delta = x - stats.mean;
+  stats.mean += delta / stats.n;
+  stats.m2 += delta * (x - stats.mean);
+}
+
+// Sample variance, floored at the quantization noise of integer counts so a
+// run of identical readings does not claim infinite precision.
+float statsVariance(const RunningStats &stats)
+{
+  if (stats.n < 2)
+    return 0.0f;
+  float variance = stats.m2 / (stats.n - 1);
+  return variance > COUNT_QUANTIZATION_VAR ? variance : COUNT_QUANTIZATION_VAR;
+}
+
+// Standard error of the mean, propagated to absorbance: dA = dI / (I ln 10).
+float statsSemAbsorbance(const RunningStats &stats)
+{
+  if (stats.n < 2 || stats.mean <= 0.0f)
+    return INFINITY;
+  return sqrtf(statsVariance(stats) / stats.n) / (stats.mean * 2.302585f);
+}
+
+struct ZeroJob
+{
+  RunningStats stats;
+  uint32_t startedAt;
+  uint8_t discard; // Integrations to drop after the exposure change
+  uint8_t failedReads;
+};
+
+ZeroJob zeroJob;
+uint32_t zeroToleranceUA = ZERO_DEFAULT_TOLERANCE_UA;
+
+void zeroBegin(uint32_t now)
+{
+  statsReset(zeroJob.stats);
+  zeroJob.startedAt = now;
+  zeroJob.discard = 1;
+  zeroJob.failedReads = 0;
+  clearDataReadyFlag();
+}
+
+// Adds one fresh integration. Returns true once zeroing is finished.
+bool zeroStep(uint32_t now, uint16_t ch0, bool ok)
+{
+  if (zeroJob.discard > 0)
+  {
+    zeroJob.discard--;
+    return false;
+  }
+  if (ok)
+    statsAdd(zeroJob.stats, ch0);
+  else
+    zeroJob.failedReads++;
+
+  if (zeroJob.stats.n >= ZERO_MIN_SAMPLES &&
+      statsSemAbsorbance(zeroJob.stats) * 1e6f <= zeroToleranceUA)
+    return true;
+  return zeroJob.stats.n + zeroJob.failedReads >= ZERO_MAX_SAMPLES ||
+         now - zeroJob.startedAt >= ZERO_BUDGET_MS;
+}
+
+// Applies the new blank. Returns false if no reading succeeded.
+bool zeroFinish(uint32_t now)
+{
+  if (zeroJob.stats.n == 0)
+  {
+    Serial.println("Zeroing failed: No successful reads.");
+    notifyText("Error: Zero failed");
+    return false;
+  }
+  zeroReading = (uint16_t)lroundf(zeroJob.stats.mean);
+  Serial.print("Zero ");
+  Serial.print(zeroReading);
+  Serial.print(" in ");
+  Serial.print(now - zeroJob.startedAt);
+  Serial.println(" ms");
+  return true;
+}
+
+// Reports "z:DONE n=<samples> sem=<absorbance> dark=<counts>", with " limit"
+// appended when a budget ran out before the tolerance was met.
+void zeroReport()
+{
+  float sem = statsSemAbsorbance(zeroJob.stats);
+  bool converged = zeroJob.stats.n >= ZERO_MIN_SAMPLES && sem * 1e6f <= zeroToleranceUA;
+  TxMessage msg;
+  txBegin(msg);
+  txAppend(msg, "z:DONE n=");
+  txAppendUInt(msg, zeroJob.stats.n);
+  txAppend(msg, " sem=");
+  if (sem < 1.0f)
+    txAppendFixed(msg, (uint32_t)lroundf(sem * 1e6f), 6);
+  else
+    txAppend(msg, "inf"); // Fewer than two samples, or no light at all
+  txAppend(msg, " dark=");
+  txAppendUInt(msg, darkReading);
+  if (!converged)
+    txAppend(msg, " limit");
+  notifyMessage(msg);
+  serialPrintMessage(msg);
+}
+
+
+// ============================================
+// Calibration store
+// One entry per LED holding its exposure, LED duty, blank and dark counts,
+// persisted in NVS so switching wavelength or power cycling restores the
+// zero instead of re-measuring it. A blank is stale once it is CAL_MAX_AGE_MS
+// old; one from an earlier boot, whose millis() cannot be compared with
+// this one's, ages from this boot and is kept for CAL_BLANK_MAX_BOOTS boots
+// after it was measured. The exposure and duty carry over until the entry
+// goes CAL_MAX_BOOTS boots without a write. SET_ZERO re-measures on demand.
+// ============================================
+#define CAL_NAMESPACE "espectro"
+#define CAL_KEY "cal"
+#define CAL_BOOT_KEY "boot"
+#define CAL_VERSION 2 // 2: per-LED duty cycle
+#define CAL_MAX_AGE_MS (30UL * 60UL * 1000UL)
+#define CAL_MAX_BOOTS 3
+#define CAL_BLANK_MAX_BOOTS 1 // Earlier boots a blank is still loaded from
+#define CAL_HAS_EXPOSURE 0x01
+#define CAL_HAS_BLANK 0x02
+#define DARK_SAMPLES 4
+
+struct Calibration
+{
+  uint8_t version;
+  uint8_t flags; // CAL_HAS_*
+  uint8_t periods;
+  uint8_t gain;
+  uint16_t blank;
+  uint16_t dark;
+  uint16_t duty;      // LED PWM duty the exposure was chosen at
+  uint32_t bootId;    // Boot in which the entry was last written
+  uint32_t takenAtMs; // millis() of the blank measurement in that boot
+};
+
+Calibration calibration[LED_COUNT];
+Preferences calPrefs;
+uint32_t bootId = 0;
+
+// Bumps the boot counter and loads the table, discarding entries written
+// by another layout or too many boots ago, and blanks measured too many
+// boots ago.
+void calibrationLoad()
+{
+  calPrefs.begin(CAL_NAMESPACE, false);
+  bootId = calPrefs.getUInt(CAL_BOOT_KEY, 0) + 1;
+  calPrefs.putUInt(CAL_BOOT_KEY, bootId);
+
+  memset(calibration, 0, sizeof(calibration));
+  if (calPrefs.getBytesLength(CAL_KEY) == sizeof(calibration))
+    calPrefs.getBytes(CAL_KEY, calibration, sizeof(calibration));
+  for (uint8_t i = 0; i < LED_COUNT; i++)
+  {
+    Calibration &cal = calibration[i];
+    if (cal.version != CAL_VERSION || bootId - cal.bootId > CAL_MAX_BOOTS)
+    {
+      memset(&cal, 0, sizeof(cal));
+      continue;
+    }
+    if (bootId - cal.bootId > CAL_BLANK_MAX_BOOTS)
+      cal.flags &= ~CAL_HAS_BLANK;
+    cal.takenAtMs = 0; // Age restarts from this boot
+  }
+}
+
+// Moves the boot counter on to id if it is behind, for a log that outlived
+// an NVS erase.
+void bootIdAdvance(uint32_t id)
+{
+  if (id <= bootId)
+    return;
+  bootId = id;
+  calPrefs.putUInt(CAL_BOOT_KEY, bootId);
+}
+
+void calibrationSave()
+{
+  calPrefs.putBytes(CAL_KEY, calibration, sizeof(calibration));
+}
+
+bool calibrationHasExposure(uint8_t led)
+{
+  return (calibration[led].flags & CAL_HAS_EXPOSURE) != 0;
+}
+
+// A usable blank: measured, and not older than CAL_MAX_AGE_MS.
+bool calibrationBlankFresh(uint8_t led, uint32_t now)
+{
+  const Calibration &cal = calibration[led];
+  return (cal.flags & CAL_HAS_BLANK) && now - cal.takenAtMs <= CAL_MAX_AGE_MS;
+}
+
+void calibrationSetExposure(uint8_t led, uint8_t periods, uint8_t gain, uint16_t duty)
+{
+  Calibration &cal = calibration[led];
+  cal.version = CAL_VERSION;
+  cal.flags = CAL_HAS_EXPOSURE; // A blank taken at another exposure no longer applies
+  cal.periods = periods;
+  cal.gain = gain;
+  cal.duty = duty;
+  cal.bootId = bootId;
+  calibrationSave();
+}
+
+// Puts the sensor and the LED at the stored setting for led.
+void calibrationApply(uint8_t led)
+{
+  const Calibration &cal = calibration[led];
+  setLEDDuty(led, cal.duty);
+  applyExposure(cal.periods, cal.gain);
+}
+
+void calibrationSetBlank(uint8_t led, uint16_t blank, uint16_t dark, uint32_t now)
+{
+  Calibration &cal = calibration[led];
+  cal.flags |= CAL_HAS_BLANK;
+  cal.blank = blank;
+  cal.dark = dark;
+  cal.bootId = bootId;
+  cal.takenAtMs = now;
+  calibrationSave();
+}
+
+void calibrationForget(uint8_t led)
+{
+  memset(&calibration[led], 0, sizeof(Calibration));
+  calibrationSave();
+}
+
+
+// ============================================
+// Kinetics
+// A run samples one LED on an absolute schedule (start + k * interval, so
+// jitter never accumulates) and appends device-timestamped raw counts to a
+// buffer in PSRAM when fitted, internal RAM otherwise. The acquisition task
+// is the only writer; the transmit task reads records below the published
+// count, so KINETICS_GET works during a run as well as after it, and a
+// dropped link loses nothing. Blank and dark are fixed for the run and
+// reported in "k:START", so absorbance is computed by the client.
+// ============================================
+#define KINETICS_RAM_RECORDS 2048    // Internal RAM fallback, 16 KB
+#define KINETICS_PSRAM_RECORDS 65536 // 512 KB; ~1.8 h at 100 ms
+#define KINETICS_MIN_INTERVAL_MS 100
+#define KINETICS_FRAMES_PER_WAKE 4   // Frames sent per transmit-task pass
+
+struct KineticsRecord
+{
+  uint32_t t; // millis() when read
+  uint16_t ch0;
+  uint16_t ch1;
+};
+
+struct KineticsRun
+{
+  uint8_t led;
+  uint16_t blank;
+  uint16_t dark;
+  uint32_t intervalMs;
+  uint32_t startAt;
+  uint32_t planned; // Scheduled samples in the run
+  uint32_t ticks;   // Scheduled samples taken or missed so far
+  uint32_t missed;  // Ticks skipped because the task ran late, or failed reads
+  uint8_t discard;  // Integrations still to drop before the first tick
+  std::atomic<uint32_t> count{0}; // Records written; published with release
+};
+
+KineticsRecord kineticsRam[KINETICS_RAM_RECORDS];
+KineticsRecord *kineticsBuffer = kineticsRam;
+uint32_t kineticsCapacity = KINETICS_RAM_RECORDS;
+KineticsRun kinetics;
+FrameBuilder kineticsFrame;
+std::atomic<int32_t> kineticsSendFrom{-1}; // Set by KINETICS_GET, taken by the transmit task
+uint32_t kineticsSendIndex = 0;
+std::atomic<bool> kineticsSending{false}; // Transmit task's; read by the acquisition task
+
+// Moves the buffer to PSRAM when the module has it. Called once from setup().
+void kineticsInit()
+{
+  void *psram = heap_caps_malloc(KINETICS_PSRAM_RECORDS * sizeof(KineticsRecord), MALLOC_CAP_SPIRAM);
+  if (psram == nullptr)
+    return;
+  kineticsBuffer = (KineticsRecord *)psram;
+  kineticsCapacity = KINETICS_PSRAM_RECORDS;
+}
+
+void kineticsBegin(uint8_t led, uint32_t intervalMs, uint32_t planned, uint32_t startAt)
+{
+  kinetics.led = led;
+  kinetics.blank = zeroReading;
+  kinetics.dark = darkReading;
+  kinetics.intervalMs = intervalMs;
+  kinetics.startAt = startAt;
+  kinetics.planned = planned;
+  kinetics.ticks = 0;
+  kinetics.missed = 0;
+  kinetics.discard = 1;
+  kinetics.count.store(0, std::memory_order_release);
+  clearDataReadyFlag();
+}
+
+// Takes the sample due now once AINT shows a fresh integration, polling
+// until it does, and returns when to wake next: the next scheduled sample,
+// skipping (and counting) ticks that have already passed. A tick whose
+// integration never finished before the next one is due counts as missed.
+// Before the first tick it polls for, and drops, the integration the LED
+// and exposure switch fell in, which has ended by the first tick.
+uint32_t kineticsStep(uint32_t now)
+{
+  uint32_t count = kinetics.count.load(std::memory_order_relaxed);
+  KineticsRecord &record = kineticsBuffer[count];
+  int8_t result = readFreshChannels(record.ch0, record.ch1);
+  if (kinetics.discard > 0)
+  {
+    if (result > 0)
+      kinetics.discard--;
+    if ((int32_t)(now - kinetics.startAt) < 0)
+      return kinetics.discard > 0 ? now + ALS_POLL_MS : kinetics.startAt;
+    kinetics.discard = 0; // The switch's integration is over by now, flagged or not
+    if (result > 0)
+      return now + ALS_POLL_MS;
+  }
+  uint32_t next = kinetics.startAt + (kinetics.ticks + 1) * kinetics.intervalMs;
+  if (result == 0 && (int32_t)(next - now) > ALS_POLL_MS)
+    return now + ALS_POLL_MS;
+  if (result > 0)
+  {
+    record.t = now;
+    kinetics.count.store(count + 1, std::memory_order_release);
+  }
+  else
+  {
+    kinetics.missed++;
+  }
+  kinetics.ticks++;
+  while ((int32_t)(now - next) >= 0 && kinetics.ticks < kinetics.planned)
+  {
+    kinetics.ticks++;
+    kinetics.missed++;
+    next += kinetics.intervalMs;
+  }
+  return next;
+}
+
+bool kineticsDone()
+{
+  return kinetics.ticks >= kinetics.planned;
+}
+
+void kineticsReport()
+{
+  TxMessage msg;
+  txBegin(msg);
+  txAppend(msg, "k:DONE n=");
+  txAppendUInt(msg, kinetics.count.load(std::memory_order_relaxed));
+  txAppend(msg, " missed=");
+  txAppendUInt(msg, kinetics.missed);
+  notifyMessage(msg);
+}
+
+uint8_t putVarint(uint8_t *p, uint32_t v)
+{
+  uint8_t n = 0;
+  while (v >= 0x80)
+  {
+    p[n++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (uint8_t)v;
+  return n;
+}
+
+uint32_t zigzag(int32_t v)
+{
+  return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+// Sends records from index first (< available) in one frame; returns how many.
+uint32_t kineticsSendFrame(uint32_t first, uint32_t available)
+{
+  FrameBuilder &frame = kineticsFrame;
+  const KineticsRecord *records = kineticsBuffer;
+  frameBegin(frame, FRAME_TYPE_KINETICS, records[first].t);
+  uint8_t *p = frame.buf + frame.len;
+  put32(p, first);
+  put16(p + 4, records[first].ch0);
+  put16(p + 6, records[first].ch1);
+  frame.len += 8;
+  frame.count = 1;
+
+  uint16_t capacity = frameCapacity();
+  uint32_t i = first + 1;
+  while (i < available && frame.count < 255)
+  {
+    uint8_t encoded[15];
+    uint8_t n = putVarint(encoded, records[i].t - records[i - 1].t);
+    n += putVarint(encoded + n, zigzag((int32_t)records[i].ch0 - records[i - 1].ch0));
+    n += putVarint(encoded + n, zigzag((int32_t)records[i].ch1 - records[i - 1].ch1));
+    if (frame.len + n > capacity)
+      break;
+    memcpy(frame.buf + frame.len, encoded, n);
+    frame.len += n;
+    frame.count++;
+    i++;
+  }
+  frameSend(frame);
+  return i - first;
+}
+
+// Transmit-task side of KINETICS_GET: a few frames per pass until the
+// records published so far are sent, then "k:END n=<next index>".
+void kineticsTransmit()
+{
+  int32_t from = kineticsSendFrom.exchange(-1);
+  if (from >= 0)
+  {
+    kineticsSendIndex = from;
+    kineticsSending = true;
+  }
+  if (!kineticsSending)
+    return;
+  uint32_t available = kinetics.count.load(std::memory_order_acquire);
+  for (uint8_t frames = 0; frames < KINETICS_FRAMES_PER_WAKE && kineticsSendIndex < available; frames++)
+    kineticsSendIndex += kineticsSendFrame(kineticsSendIndex, available);
+  if (kineticsSendIndex < available)
+    return;
+  kineticsSending = false;
+  TxMessage msg;
+  txBegin(msg);
+  txAppend(msg, "k:END n=");
+  txAppendUInt(msg, available);
+  transmitText(msg);
+}
+
+
+// ============================================
+// Sample log
+// Every reading (READ_SENSOR, READ_N, SCAN) is appended to a binary log on
+// LittleFS, so it outlives the browser tab, the link and a power cycle.
+// Records are fixed size and numbered by a sequence that runs on across
+// boots; segment files hold LOG_SEGMENT_RECORDS each, so a sequence number
+// maps straight to a file and an offset. For time lookups the first record
+// of every segment is kept in RAM as a sparse index, and the one segment
+// it points at is binary searched by seeking.
+//
+// The acquisition task only pushes records into a ring. The log task
+// gathers them into a batch of one flash sector and appends it when full,
+// after LOG_FLUSH_MS, or before it answers a request, so flash is written
+// a sector at a time instead of once per reading. Flash writes pause the
+// caches of both cores; batching keeps those pauses rare, and a pause
+// shorter than an integration loses nothing, as AINT stays latched. The
+// oldest segment is deleted to make room. A power cut costs the unflushed
+// batch at most, and a torn record at the end is cut off at mount.
+//
+// The transmit task also reads the files, for BULK, so every open of a
+// segment holds logFileLock: a read never sees an append half done or a
+// segment that logMakeRoom() is deleting. Records carry the NVS bootId.
+// ============================================
+#define LOG_MOUNT_POINT "/littlefs"
+#define LOG_DIR "/log"
+#define LOG_PATH_LEN 32
+#define LOG_SEGMENT_RECORDS 4096 // 96 KB per segment file
+#define LOG_MAX_SEGMENTS 10      // Fits the default 1.4 MB partition with room to spare
+#define LOG_BATCH_RECORDS 170    // One 4 KB flash sector
+#define LOG_FLUSH_MS 5000
+#define LOG_RING_CAPACITY 64     // Power of two
+#define LOG_REQUEST_QUEUE_LENGTH 4
+#define LOG_CHUNK_RECORDS 9      // One full-MTU frame
+#define LOG_CHUNK_QUEUE_LENGTH 4
+#define LOG_GET_DEFAULT 4096
+#define LOG_IDLE_WAIT_MS 100
+
+struct LogRecord
+{
+  uint32_t seq;  // Assigned when the record reaches flash
+  uint32_t t;    // millis() in its boot
+  uint16_t boot; // bootId of the power cycle the record was taken in
+  uint8_t kind;  // SAMPLE_READING, SAMPLE_REPLICATE(_END) or SAMPLE_SCAN
+  uint8_t led;
+  uint16_t ch0;
+  uint16_t ch1;
+  uint16_t blank;
+  uint16_t dark;
+  int32_t absorbance;
+};
+static_assert(sizeof(LogRecord) == 24, "LogRecord is both the flash and the frame layout");
+
+// Time of the first record in a segment
+struct LogIndexEntry
+{
+  uint16_t boot;
+  uint32_t t;
+};
+
+enum LogRequestType : uint8_t
+{
+  LOG_REQUEST_INFO,
+  LOG_REQUEST_GET,
+  LOG_REQUEST_FIND,
+  LOG_REQUEST_BULK
+};
+
+struct LogRequest
+{
+  uint8_t type;
+  uint32_t a; // GET, BULK: first sequence; FIND: boot
+  uint32_t b; // GET, BULK: record count; FIND: ms
+};
+
+// Records read for the transmit task; a chunk of count 0 ends a LOG_GET.
+struct LogChunk
+{
+  uint8_t count;
+  uint32_t next; // Sequence after the last record read
+  LogRecord records[LOG_CHUNK_RECORDS];
+};
+
+SpscRing<LogRecord, LOG_RING_CAPACITY> logRing;
+QueueHandle_t logRequestQueue = nullptr;
+QueueHandle_t logChunkQueue = nullptr;
+TaskHandle_t logTaskHandle = nullptr;
+SemaphoreHandle_t logFileLock = nullptr; // Held across each segment file access
+bool logMounted = false;
+uint32_t logFirstSeq = 0; // Oldest record on flash
+uint32_t logNextSeq = 0;  // Sequence the next flushed record gets
+uint32_t logLost = 0;     // Records a failed write dropped
+LogIndexEntry logIndex[LOG_MAX_SEGMENTS]; // By segment % LOG_MAX_SEGMENTS
+LogRecord logBatch[LOG_BATCH_RECORDS];
+uint16_t logBatched = 0;
+uint32_t logBatchStartedAt = 0;
+FrameBuilder logFrame;
+
+void logSegmentPath(char *path, uint32_t segment)
+{
+  snprintf(path, LOG_PATH_LEN, LOG_DIR "/%lu.bin", (unsigned long)segment);
+}
+
+bool logKeyBefore(uint16_t boot, uint32_t t, uint16_t otherBoot, uint32_t otherT)
+{
+  return boot < otherBoot || (boot == otherBoot && t < otherT);
+}
+
+// Reads count records from seq on; they must lie in one segment.
+bool logRead(uint32_t seq, LogRecord *records, uint16_t count)
+{
+  char path[LOG_PATH_LEN];
+  logSegmentPath(path, seq / LOG_SEGMENT_RECORDS);
+  xSemaphoreTake(logFileLock, portMAX_DELAY);
+  File file = LittleFS.open(path, FILE_READ);
+  size_t len = count * sizeof(LogRecord);
+  bool ok = file && file.seek((seq % LOG_SEGMENT_RECORDS) * sizeof(LogRecord)) &&
+            file.read((uint8_t *)records, len) == len;
+  file.close();
+  xSemaphoreGive(logFileLock);
+  return ok;
+}
+
+// As logRead(), across segment boundaries. Also called by the transmit
+// task for BULK.
+bool logReadSpan(uint32_t seq, LogRecord *records, uint32_t count)
+{
+  while (count > 0)
+  {
+    uint32_t n = LOG_SEGMENT_RECORDS - seq % LOG_SEGMENT_RECORDS;
+    n = n < count ? n : count;
+    if (!logRead(seq, records, n))
+      return false;
+    seq += n;
+    records += n;
+    count -= n;
+  }
+  return true;
+}
+
+// Mounts the log and picks up where the last boot left off. Called once
+// from setup(), before the tasks start.
+void logInit()
+{
+  logFileLock = xSemaphoreCreateMutex();
+  if (!LittleFS.begin(true))
+  {
+    Serial.println("LittleFS mount failed; readings will not be logged.");
+    return;
+  }
+  LittleFS.mkdir(LOG_DIR);
+
+  uint32_t first = UINT32_MAX;
+  uint32_t last = 0;
+  File dir = LittleFS.open(LOG_DIR);
+  for (File file = dir.openNextFile(); file; file = dir.openNextFile())
+  {
+    uint32_t segment = strtoul(file.name(), nullptr, 10);
+    first = segment < first ? segment : first;
+    last = segment > last ? segment : last;
+    file.close();
+  }
+  dir.close();
+
+  logMounted = true;
+  if (first == UINT32_MAX)
+    return;
+  char path[LOG_PATH_LEN];
+  for (;;)
+  {
+    // The newest segment may end in a record torn by a power cut
+    logSegmentPath(path, last);
+    File file = LittleFS.open(path, FILE_READ);
+    size_t size = file ? file.size() : 0;
+    file.close();
+    size_t whole = size - size % sizeof(LogRecord);
+    if (whole != size)
+    {
+      char fullPath[LOG_PATH_LEN + sizeof(LOG_MOUNT_POINT)];
+      snprintf(fullPath, sizeof(fullPath), LOG_MOUNT_POINT "%s", path);
+      truncate(fullPath, whole);
+    }
+    if (whole > 0 || last == first)
+    {
+      logNextSeq = last * LOG_SEGMENT_RECORDS + whole / sizeof(LogRecord);
+      break;
+    }
+    LittleFS.remove(path);
+    last--;
+  }
+  logFirstSeq = first * LOG_SEGMENT_RECORDS;
+  if (logNextSeq == logFirstSeq)
+    return;
+
+  LogRecord record;
+  for (uint32_t segment = first; segment <= last; segment++)
+  {
+    if (logRead(segment * LOG_SEGMENT_RECORDS, &record, 1))
+      logIndex[segment % LOG_MAX_SEGMENTS] = {record.boot, record.t};
+  }
+  // An NVS erase restarts the boot count; records must keep sorting by boot
+  if (logRead(logNextSeq - 1, &record, 1))
+    bootIdAdvance(record.boot + 1);
+  Serial.print("Log: records ");
+  Serial.print(logFirstSeq);
+  Serial.print("-");
+  Serial.print(logNextSeq);
+  Serial.print(", boot ");
+  Serial.println(bootId);
+}
+
+// Acquisition task: hands a reading to the log task. Never blocks; a full
+// ring counts an overflow instead.
+void logReading(uint8_t kind, uint8_t led, uint32_t t, uint16_t ch0, uint16_t ch1,
+                uint16_t blank, uint16_t dark, int32_t absorbance)
+{
+  if (!logMounted)
+    return;
+  LogRecord record = {0, t, (uint16_t)bootId, kind, led, ch0, ch1, blank, dark, absorbance};
+  logRing.push(record);
+}
+
+// Deletes the oldest segments until the one about to start fits.
+void logMakeRoom(uint32_t segment)
+{
+  while (logFirstSeq / LOG_SEGMENT_RECORDS < segment &&
+         (segment - logFirstSeq / LOG_SEGMENT_RECORDS + 1 > LOG_MAX_SEGMENTS ||
+          LittleFS.totalBytes() - LittleFS.usedBytes() < 2 * LOG_SEGMENT_RECORDS * sizeof(LogRecord)))
+  {
+    char path[LOG_PATH_LEN];
+    logSegmentPath(path, logFirstSeq / LOG_SEGMENT_RECORDS);
+    LittleFS.remove(path);
+    logFirstSeq += LOG_SEGMENT_RECORDS;
+  }
+}
+
+// Appends the batch, a segment at a time, numbering the records as they
+// go. A failed write is cut back to the last whole record and the rest of
+// the batch is dropped, so the files stay aligned. Holds logFileLock
+// across each segment's clean-up and append. Log task only.
+void logFlush()
+{
+  uint16_t done = 0;
+  while (done < logBatched)
+  {
+    uint32_t segment = logNextSeq / LOG_SEGMENT_RECORDS;
+    uint32_t offset = logNextSeq % LOG_SEGMENT_RECORDS;
+    uint16_t count = logBatched - done;
+    if (count > LOG_SEGMENT_RECORDS - offset)
+      count = LOG_SEGMENT_RECORDS - offset;
+    if (offset == 0)
+      logIndex[segment % LOG_MAX_SEGMENTS] = {logBatch[done].boot, logBatch[done].t};
+    for (uint16_t i = 0; i < count; i++)
+      logBatch[done + i].seq = logNextSeq + i;
+
+    char path[LOG_PATH_LEN];
+    logSegmentPath(path, segment);
+    xSemaphoreTake(logFileLock, portMAX_DELAY);
+    if (offset == 0)
+      logMakeRoom(segment);
+    File file = LittleFS.open(path, FILE_APPEND);
+    size_t len = count * sizeof(LogRecord);
+    size_t written = file ? file.write((const uint8_t *)&logBatch[done], len) : 0;
+    file.close();
+    if (written != len)
+    {
+      char fullPath[LOG_PATH_LEN + sizeof(LOG_MOUNT_POINT)];
+      snprintf(fullPath, sizeof(fullPath), LOG_MOUNT_POINT "%s", path);
+      truncate(fullPath, offset * sizeof(LogRecord));
+    }
+    xSemaphoreGive(logFileLock);
+    if (written != len)
+    {
+      logLost += logBatched - done;
+      Serial.println("Log write failed; batch dropped.");
+      break;
+    }
+    logNextSeq += count;
+    done += count;
+  }
+  logBatched = 0;
+}
+
+// Moves records from the ring into the batch, flushing when it fills or
+// has waited LOG_FLUSH_MS.
+void logCollect(uint32_t now)
+{
+  LogRecord record;
+  while (logRing.pop(record))
+  {
+    if (logBatched == 0)
+      logBatchStartedAt = now;
+    logBatch[logBatched++] = record;
+    if (logBatched == LOG_BATCH_RECORDS)
+      logFlush();
+  }
+  if (logBatched > 0 && now - logBatchStartedAt >= LOG_FLUSH_MS)
+    logFlush();
+}
+
+// First sequence taken at or after (boot, t), or logNextSeq if none was.
+uint32_t logFind(uint16_t boot, uint32_t t)
+{
+  if (logNextSeq == logFirstSeq)
+    return logNextSeq;
+  uint32_t segment = logFirstSeq / LOG_SEGMENT_RECORDS;
+  uint32_t lastSegment = (logNextSeq - 1) / LOG_SEGMENT_RECORDS;
+  while (segment < lastSegment)
+  {
+    const LogIndexEntry &next = logIndex[(segment + 1) % LOG_MAX_SEGMENTS];
+    if (logKeyBefore(boot, t, next.boot, next.t))
+      break;
+    segment++;
+  }
+  uint32_t lo = segment * LOG_SEGMENT_RECORDS;
+  uint32_t hi = lo + LOG_SEGMENT_RECORDS;
+  lo = lo > logFirstSeq ? lo : logFirstSeq;
+  hi = hi < logNextSeq ? hi : logNextSeq;
+  LogRecord record;
+  while (lo < hi)
+  {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (!logRead(mid, &record, 1))
+      return mid;
+    if (logKeyBefore(record.boot, record.t, boot, t))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Hands a chunk to the transmit task, filing new readings while it waits.
+void logSendChunk(const LogChunk &chunk)
+{
+  while (xQueueSend(logChunkQueue, &chunk, pdMS_TO_TICKS(LOG_IDLE_WAIT_MS)) != pdTRUE)
+    logCollect(millis());
+  if (txTaskHandle != nullptr)
+    xTaskNotifyGive(txTaskHandle);
+}
+
+void logGet(uint32_t first, uint32_t count)
+{
+  if (frameCapacity() < FRAME_HEADER_LEN + sizeof(LogRecord))
+  {
+    notifyText("Error: LOG_GET needs an MTU of 37 or more");
+    return;
+  }
+  uint32_t seq = first > logFirstSeq ? first : logFirstSeq;
+  uint32_t end = logNextSeq - seq < count ? logNextSeq : seq + count;
+  LogChunk chunk;
+  while (seq < end)
+  {
+    uint32_t n = end - seq;
+    n = n < LOG_CHUNK_RECORDS ? n : LOG_CHUNK_RECORDS;
+    uint32_t segmentLeft = LOG_SEGMENT_RECORDS - seq % LOG_SEGMENT_RECORDS;
+    n = n < segmentLeft ? n : segmentLeft;
+    if (!logRead(seq, chunk.records, n))
+      break;
+    chunk.count = n;
+    seq += n;
+    chunk.next = seq;
+    logSendChunk(chunk);
+  }
+  chunk.count = 0;
+  chunk.next = seq;
+  logSendChunk(chunk);
+}
+
+void logServe(const LogRequest &request)
+{
+  TxMessage msg;
+  switch (request.type)
+  {
+  case LOG_REQUEST_INFO:
+    txBegin(msg);
+    txAppend(msg, "l:INFO first=");
+    txAppendUInt(msg, logFirstSeq);
+    txAppend(msg, " next=");
+    txAppendUInt(msg, logNextSeq);
+    txAppend(msg, " boot=");
+    txAppendUInt(msg, bootId);
+    txAppend(msg, " lost=");
+    txAppendUInt(msg, logLost + logRing.overflows());
+    notifyMessage(msg);
+    break;
+  case LOG_REQUEST_GET:
+    logGet(request.a, request.b);
+    break;
+  case LOG_REQUEST_FIND:
+    txBegin(msg);
+    txAppend(msg, "l:FIND seq=");
+    txAppendUInt(msg, logFind((uint16_t)request.a, request.b));
+    notifyMessage(msg);
+    break;
+  case LOG_REQUEST_BULK:
+  {
+    // Fixed here, after the flush, so the transfer covers exactly what is on flash
+    uint32_t first = request.a > logFirstSeq ? request.a : logFirstSeq;
+    uint32_t count = first >= logNextSeq ? 0 : logNextSeq - first;
+    if (!bulkRequest(BULK_START, BULK_SOURCE_LOG, 0, first, request.b < count ? request.b : count))
+      notifyText("Error: Bulk transfer busy");
+    break;
+  }
+  }
+}
+
+// Acquisition task: queues a LOG_* command for the log task.
+bool logSubmit(uint8_t type, uint32_t a, uint32_t b)
+{
+  if (!logMounted || logRequestQueue == nullptr)
+    return false;
+  LogRequest request = {type, a, b};
+  return xQueueSend(logRequestQueue, &request, 0) == pdTRUE;
+}
+
+// Owns the log files: files readings and answers requests, flushing the
+// batch first so a request sees every reading taken before it.
+void logTask(void *param)
+{
+  LogRequest request;
+  for (;;)
+  {
+    bool requested = xQueueReceive(logRequestQueue, &request, pdMS_TO_TICKS(LOG_IDLE_WAIT_MS)) == pdTRUE;
+    logCollect(millis());
+    if (!requested)
+      continue;
+    logFlush();
+    logServe(request);
+  }
+}
+
+// Transmit-task side of LOG_GET: frames the chunks the log task has read,
+// records as they are on flash, then "l:END next=<sequence>".
+void logTransmit()
+{
+  LogChunk chunk;
+  while (logChunkQueue != nullptr && xQueueReceive(logChunkQueue, &chunk, 0) == pdTRUE)
+  {
+    if (chunk.count == 0)
+    {
+      TxMessage msg;
+      txBegin(msg);
+      txAppend(msg, "l:END next=");
+      txAppendUInt(msg, chunk.next);
+      transmitText(msg);
+      continue;
+    }
+    uint8_t i = 0;
+    while (i < chunk.count)
+    {
+      frameBegin(logFrame, FRAME_TYPE_LOG, chunk.records[i].t);
+      uint16_t capacity = frameCapacity();
+      for (; i < chunk.count && logFrame.len + sizeof(LogRecord) <= capacity; i++)
+      {
+        memcpy(logFrame.buf + logFrame.len, &chunk.records[i], sizeof(LogRecord));
+        logFrame.len += sizeof(LogRecord);
+        logFrame.count++;
+      }
+      if (logFrame.count == 0)
+        break; // A client joined with a smaller MTU; the rest is cut short
+      frameSend(logFrame);
+    }
+  }
+}
+
+
+// ============================================
+// Bulk transfer
+// Moves a kinetics run or a log range off the device at link speed.
+// BULK <source> [first] [count] fixes the records per chunk from the
+// current MTU and streams numbered chunks as BULK frames; the client
+// acknowledges with short binary writes without response:
+//
+//   ack     magic u8, type u8 (FRAME_TYPE_BULK_ACK), id u8, cumulative u32
+//           (every chunk below it arrived), bitmap u32 (bit i: chunk
+//           cumulative + 1 + i arrived as well)
+//
+// At most BULK_WINDOW chunks are unacknowledged. A chunk that was sent
+// before one the client has acknowledged, but is itself missing, is sent
+// again at once; any other after BULK_RETRANSMIT_MS. Sending pauses while
+// a client is congested or none is subscribed, and the transfer is kept:
+// after a reconnect, BULK_RESUME <id> [chunk] carries on from the
+// client's first missing chunk, or from the last acknowledgement. Chunk
+// numbers depend on the records per chunk, so a link whose MTU can no
+// longer carry a whole chunk ends the transfer with an error and
+// "b:CANCEL", and the client starts a new BULK. One transfer runs at a
+// time: BULK is refused while one is active, until it ends or BULK_CANCEL
+// ends it, so no client loses its transfer unannounced. The transmit task
+// owns the transfer; requests and acknowledgements reach it through queues.
+// ============================================
+#define BULK_WINDOW 32
+#define BULK_RETRANSMIT_MS 300
+#define BULK_FRAMES_PER_WAKE 8
+#define BULK_REQUEST_QUEUE_LENGTH 2
+#define BULK_ACK_QUEUE_LENGTH 8
+#define BULK_ACK_LEN 11
+#define BULK_CHUNK_HEADER_LEN 5 // id u8, chunk u32, after the frame header
+
+enum BulkChunkState : uint8_t
+{
+  BULK_CHUNK_DUE, // To be sent (again)
+  BULK_CHUNK_SENT,
+  BULK_CHUNK_ACKED
+};
+
+struct BulkRequest
+{
+  uint8_t kind;
+  uint8_t source;
+  uint8_t id;
+  uint32_t a;
+  uint32_t b;
+};
+
+struct BulkAck
+{
+  uint8_t id;
+  uint32_t cumulative;
+  uint32_t bitmap;
+};
+
+struct BulkTransfer
+{
+  bool active;
+  uint8_t id;
+  uint8_t source;
+  uint8_t recordSize;
+  uint8_t perChunk; // Records per chunk, fixed at the start
+  uint32_t first;
+  uint32_t count;
+  uint32_t chunks;
+  uint32_t base; // Lowest unacknowledged chunk
+  uint32_t next; // Lowest chunk not sent yet
+  uint32_t serial; // Transmissions so far; orders them for loss detection
+  uint8_t state[BULK_WINDOW]; // In-flight chunks, by chunk % BULK_WINDOW
+  uint32_t sentAt[BULK_WINDOW];
+  uint32_t sentSerial[BULK_WINDOW];
+  uint32_t sent;
+  uint32_t resent;
+};
+
+QueueHandle_t bulkRequestQueue = nullptr;
+QueueHandle_t bulkAckQueue = nullptr;
+BulkTransfer bulk;
+FrameBuilder bulkFrame;
+
+// Any task except the transmit task.
+bool bulkRequest(uint8_t kind, uint8_t source, uint8_t id, uint32_t a, uint32_t b)
+{
+  if (bulkRequestQueue == nullptr)
+    return false;
+  BulkRequest request = {kind, source, id, a, b};
+  if (xQueueSend(bulkRequestQueue, &request, 0) != pdTRUE)
+    return false;
+  if (txTaskHandle != nullptr)
+    xTaskNotifyGive(txTaskHandle);
+  return true;
+}
+
+// BLE task: takes an acknowledgement written to RX. Returns false for
+// anything else, which is then parsed as a command.
+bool bulkOnWrite(const uint8_t *data, size_t len)
+{
+  if (len != BULK_ACK_LEN || data[0] != FRAME_MAGIC || data[1] != FRAME_TYPE_BULK_ACK)
+    return false;
+  BulkAck ack;
+  ack.id = data[2];
+  ack.cumulative = data[3] | (data[4] << 8) | (data[5] << 16) | ((uint32_t)data[6] << 24);
+  ack.bitmap = data[7] | (data[8] << 8) | (data[9] << 16) | ((uint32_t)data[10] << 24);
+  if (bulkAckQueue != nullptr && xQueueSend(bulkAckQueue, &ack, 0) == pdTRUE && txTaskHandle != nullptr)
+    xTaskNotifyGive(txTaskHandle);
+  return true;
+}
+
+void bulkReport(const char *event)
+{
+  TxMessage msg;
+  txBegin(msg);
+  txAppend(msg, event);
+  txAppend(msg, " id=");
+  txAppendUInt(msg, bulk.id);
+  txAppend(msg, " sent=");
+  txAppendUInt(msg, bulk.sent);
+  txAppend(msg, " resent=");
+  txAppendUInt(msg, bulk.resent);
+  transmitText(msg);
+  bulk.active = false;
+}
+
+void bulkStart(const BulkRequest &request)
+{
+  TxMessage msg;
+  if (bulk.active)
+  {
+    txBegin(msg);
+    txAppend(msg, "Error: Bulk transfer ");
+    txAppendUInt(msg, bulk.id);
+    txAppend(msg, " busy; BULK_CANCEL first");
+    transmitText(msg);
+    return;
+  }
+  uint8_t recordSize = request.source == BULK_SOURCE_LOG ? sizeof(LogRecord) : sizeof(KineticsRecord);
+  uint32_t perChunk = (frameCapacity() - FRAME_HEADER_LEN - BULK_CHUNK_HEADER_LEN) / recordSize;
+  if (frameCapacity() < FRAME_HEADER_LEN + BULK_CHUNK_HEADER_LEN + recordSize)
+  {
+    notifyText("Error: BULK needs a larger MTU");
+    return;
+  }
+  uint32_t first = request.a;
+  uint32_t count = request.b;
+  if (request.source == BULK_SOURCE_KINETICS)
+  {
+    // What has been recorded now; a running run's later records need another BULK
+    uint32_t available = kinetics.count.load(std::memory_order_acquire);
+    first = first < available ? first : available;
+    count = available - first < count ? available - first : count;
+  }
+  bulk.active = true;
+  bulk.id++;
+  bulk.source = request.source;
+  bulk.recordSize = recordSize;
+  bulk.perChunk = perChunk < 255 ? perChunk : 255;
+  bulk.first = first;
+  bulk.count = count;
+  bulk.chunks = (count + bulk.perChunk - 1) / bulk.perChunk;
+  bulk.base = 0;
+  bulk.next = 0;
+  bulk.sent = 0;
+  bulk.resent = 0;
+
+  txBegin(msg);
+  txAppend(msg, "b:START id=");
+  txAppendUInt(msg, bulk.id);
+  txAppend(msg, " src=");
+  txAppendUInt(msg, bulk.source);
+  txAppend(msg, " first=");
+  txAppendUInt(msg, first);
+  txAppend(msg, " n=");
+  txAppendUInt(msg, count);
+  txAppend(msg, " per=");
+  txAppendUInt(msg, bulk.perChunk);
+  transmitText(msg);
+}
+
+void bulkHandleRequest(const BulkRequest &request)
+{
+  switch (request.kind)
+  {
+  case BULK_START:
+    bulkStart(request);
+    break;
+  case BULK_RESUME:
+    if (!bulk.active || request.id != bulk.id)
+    {
+      notifyText("Error: No such bulk transfer");
+      break;
+    }
+    // The client knows best what it holds, even where its acknowledgement was lost
+    if (request.a != UINT32_MAX)
+      bulk.base = request.a < bulk.chunks ? request.a : bulk.chunks;
+    if (bulk.next < bulk.base || bulk.next > bulk.base + BULK_WINDOW)
+      bulk.next = bulk.base;
+    // Whatever was in flight went down with the link
+    for (uint32_t chunk = bulk.base; chunk < bulk.next; chunk++)
+      bulk.state[chunk % BULK_WINDOW] = BULK_CHUNK_DUE;
+    break;
+  case BULK_CANCEL:
+    if (bulk.active && (request.source == BULK_SOURCE_COUNT || request.source == bulk.source))
+      bulkReport("b:CANCEL");
+    break;
+  }
+}
+
+void bulkApplyAck(const BulkAck &ack)
+{
+  if (!bulk.active || ack.id != bulk.id)
+    return;
+  uint32_t cumulative = ack.cumulative < bulk.next ? ack.cumulative : bulk.next;
+  if (cumulative > bulk.base)
+    bulk.base = cumulative;
+  // Anything sent before the newest chunk known to have arrived, and still
+  // missing, was lost on the way
+  uint32_t newestSerial = 0;
+  bool any = false;
+  for (uint8_t i = 0; i < 32; i++)
+  {
+    uint32_t chunk = cumulative + 1 + i;
+    if (!(ack.bitmap & (1UL << i)) || chunk < bulk.base || chunk >= bulk.next)
+      continue;
+    uint8_t slot = chunk % BULK_WINDOW;
+    if (!any || bulk.sentSerial[slot] > newestSerial)
+      newestSerial = bulk.sentSerial[slot];
+    any = true;
+    bulk.state[slot] = BULK_CHUNK_ACKED;
+  }
+  if (!any)
+    return;
+  for (uint32_t chunk = bulk.base; chunk < bulk.next; chunk++)
+  {
+    uint8_t slot = chunk % BULK_WINDOW;
+    if (bulk.state[slot] == BULK_CHUNK_SENT && bulk.sentSerial[slot] < newestSerial)
+      bulk.state[slot] = BULK_CHUNK_DUE;
+  }
+}
+
+// Frames one chunk, its records as they are in memory or on flash.
+bool bulkSendChunk(uint32_t chunk, uint32_t now)
+{
+  uint32_t start = bulk.first + chunk * bulk.perChunk;
+  uint32_t records = bulk.count - chunk * bulk.perChunk;
+  records = records < bulk.perChunk ? records : bulk.perChunk;
+  frameBegin(bulkFrame, FRAME_TYPE_BULK, now);
+  uint8_t *p = bulkFrame.buf + FRAME_HEADER_LEN;
+  p[0] = bulk.id;
+  put32(p + 1, chunk);
+  p += BULK_CHUNK_HEADER_LEN;
+  if (bulk.source == BULK_SOURCE_LOG)
+  {
+    LogRecord logRecords[FRAME_MAX_LEN / sizeof(LogRecord)];
+    if (!logReadSpan(start, logRecords, records))
+      return false;
+    memcpy(p, logRecords, records * sizeof(LogRecord));
+  }
+  else
+  {
+    memcpy(p, kineticsBuffer + start, records * sizeof(KineticsRecord));
+  }
+  bulkFrame.len = FRAME_HEADER_LEN + BULK_CHUNK_HEADER_LEN + records * bulk.recordSize;
+  bulkFrame.count = records;
+  frameSend(bulkFrame);
+
+  uint8_t slot = chunk % BULK_WINDOW;
+  bulk.state[slot] = BULK_CHUNK_SENT;
+  bulk.sentAt[slot] = now;
+  bulk.sentSerial[slot] = bulk.serial++;
+  return true;
+}
+
+// Transmit task, every pass: requests, acknowledgements, then up to
+// BULK_FRAMES_PER_WAKE chunks, retransmissions first.
+void bulkTransmit()
+{
+  BulkRequest request;
+  while (bulkRequestQueue != nullptr && xQueueReceive(bulkRequestQueue, &request, 0) == pdTRUE)
+    bulkHandleRequest(request);
+  BulkAck ack;
+  while (bulkAckQueue != nullptr && xQueueReceive(bulkAckQueue, &ack, 0) == pdTRUE)
+    bulkApplyAck(ack);
+  if (!bulk.active)
+    return;
+  if (bulk.base >= bulk.chunks)
+  {
+    bulkReport("b:END");
+    return;
+  }
+  if (bleSubscriberCount() == 0 || bleCongested())
+    return;
+  if (FRAME_HEADER_LEN + BULK_CHUNK_HEADER_LEN + bulk.perChunk * bulk.recordSize > frameCapacity())
+  {
+    TxMessage msg;
+    txBegin(msg);
+    txAppend(msg, "Error: MTU too small for this BULK; start a new one");
+    transmitText(msg);
+    bulkReport("b:CANCEL");
+    return;
+  }
+
+  uint32_t now = millis();
+  uint8_t frames = 0;
+  for (uint32_t chunk = bulk.base; chunk < bulk.next && frames < BULK_FRAMES_PER_WAKE; chunk++)
+  {
+    uint8_t slot = chunk % BULK_WINDOW;
+    if (bulk.state[slot] == BULK_CHUNK_SENT && now - bulk.sentAt[slot] >= BULK_RETRANSMIT_MS)
+      bulk.state[slot] = BULK_CHUNK_DUE;
+    if (bulk.state[slot] != BULK_CHUNK_DUE)
+      continue;
+    if (!bulkSendChunk(chunk, now))
+    {
+      bulkReport("b:ERROR");
+      return;
+    }
+    bulk.resent++;
+    frames++;
+  }
+  while (frames < BULK_FRAMES_PER_WAKE && bulk.next < bulk.chunks && bulk.next < bulk.base + BULK_WINDOW)
+  {
+    if (!bulkSendChunk(bulk.next, now))
+    {
+      bulkReport("b:ERROR");
+      return;
+    }
+    bulk.next++;
+    bulk.sent++;
+    frames++;
+  }
+}
+
+
+// ============================================
+// Acquisition engine
+// BLE callbacks only enqueue commands; all sensor and LED work runs in
+// acquisitionTask() as an explicit state machine. acqHandleCommand() and
+// acqStep() take the current time as a parameter and never sleep, so the
+// sequencing can be driven by any clock. Below this point the hardware is
+// only reached through the wire*() register functions, selectLED() and the
+// sample and log rings, which is the whole surface a simulated instrument
+// replaces.
+// ============================================
+#define ACQ_QUEUE_LENGTH 8
+#define ACQ_COMMAND_TEXT_LEN 56 // Longest well-formed command and its NUL; checked below
+#define LED_SETTLE_MS 250
+#define READ_SAMPLES 5
+#define ACQ_MAX_ARGS 4
+#define SCAN_SETTLE_MS 20   // LED warm-up allowed inside a SCAN, covered by discarded integrations
+#define SCAN_MAX_SAMPLES 16
+#define READ_N_MAX 100
+#define READ_N_MAX_INTERVAL_MS 60000
+
+enum AcqCommandType : uint8_t
+{
+  CMD_UNKNOWN,
+  CMD_READ_SENSOR,
+  CMD_SET_ZERO,
+  CMD_LED_RED_ON,
+  CMD_LED_GREEN_ON,
+  CMD_LED_BLUE_ON,
+  CMD_STREAM_START,
+  CMD_STREAM_STOP,
+  CMD_ZERO_TOL,
+  CMD_AUTO_EXPOSE,
+  CMD_STATS,
+  CMD_SET_EXPOSURE,
+  CMD_KINETICS,
+  CMD_KINETICS_STOP,
+  CMD_KINETICS_GET,
+  CMD_SCAN,
+  CMD_READ_N,
+  CMD_FILTER,
+  CMD_LOG_INFO,
+  CMD_LOG_GET,
+  CMD_LOG_FIND,
+  CMD_BULK,
+  CMD_BULK_RESUME,
+  CMD_BULK_CANCEL,
+  CMD_COUNT
+};
+static_assert(CMD_COUNT <= PROBE_MAX_COMMANDS, "PROBE_MAX_COMMANDS too small for the command set");
+
+enum CommandArgKind : uint8_t
+{
+  ARG_INT,  // Decimal integer
+  ARG_MICRO // Decimal fraction, carried in millionths ("0.0002" -> 200)
+};
+
+struct CommandSpec
+{
+  const char *name;
+  uint8_t type;
+  uint8_t maxArgs;
+  uint8_t argKind;
+};
+
+// Wire names and argument shapes, indexed by AcqCommandType. The dispatcher
+// index below is built from this table at compile time.
+constexpr CommandSpec commandTable[CMD_COUNT] = {
+    {"UNKNOWN", CMD_UNKNOWN, 0, ARG_INT},
+    {"READ_SENSOR", CMD_READ_SENSOR, 0, ARG_INT},
+    {"SET_ZERO", CMD_SET_ZERO, 0, ARG_INT},
+    {"LED_RED_ON", CMD_LED_RED_ON, 0, ARG_INT},
+    {"LED_GREEN_ON", CMD_LED_GREEN_ON, 0, ARG_INT},
+    {"LED_BLUE_ON", CMD_LED_BLUE_ON, 0, ARG_INT},
+    {"STREAM_START", CMD_STREAM_START, 0, ARG_INT},
+    {"STREAM_STOP", CMD_STREAM_STOP, 0, ARG_INT},
+    {"ZERO_TOL", CMD_ZERO_TOL, 1, ARG_MICRO},   // ZERO_TOL <absorbance>
+    {"AUTO_EXPOSE", CMD_AUTO_EXPOSE, 0, ARG_INT},
+    {"STATS", CMD_STATS, 0, ARG_INT},
+    {"SET_EXPOSURE", CMD_SET_EXPOSURE, 3, ARG_INT}, // SET_EXPOSURE <periods> <gain 1|8|16|120> [duty]
+    {"KINETICS", CMD_KINETICS, 3, ARG_INT},         // KINETICS <interval ms> <duration s> <LED 0|1|2>
+    {"KINETICS_STOP", CMD_KINETICS_STOP, 0, ARG_INT},
+    {"KINETICS_GET", CMD_KINETICS_GET, 1, ARG_INT}, // KINETICS_GET [first index]
+    {"SCAN", CMD_SCAN, 1, ARG_INT},                 // SCAN [samples per LED]
+    {"READ_N", CMD_READ_N, 2, ARG_INT},             // READ_N <count> [interval ms]
+    {"FILTER", CMD_FILTER, 4, ARG_INT},             // FILTER [mode 0|1 [kind 0-3 [p1] [p2]]]
+    {"LOG_INFO", CMD_LOG_INFO, 0, ARG_INT},
+    {"LOG_GET", CMD_LOG_GET, 2, ARG_INT},           // LOG_GET [first sequence] [count]
+    {"LOG_FIND", CMD_LOG_FIND, 2, ARG_INT},         // LOG_FIND <boot> <ms>
+    {"BULK", CMD_BULK, 3, ARG_INT},                 // BULK <source 0 kinetics|1 log> [first] [count]
+    {"BULK_RESUME", CMD_BULK_RESUME, 2, ARG_INT},   // BULK_RESUME <id> [chunk]
+    {"BULK_CANCEL", CMD_BULK_CANCEL, 0, ARG_INT},
+};
+
+struct AcqCommand
+{
+  uint8_t type;
+  uint8_t argc;
+  uint32_t receivedUs; // PROBE_NOW_US() when the BLE write arrived
+  int32_t args[ACQ_MAX_ARGS];
+  char text[ACQ_COMMAND_TEXT_LEN]; // Raw command, kept for the unknown-command reply
+};
+
+enum AcqState : uint8_t
+{
+  ACQ_IDLE,         // Periodic "a:" updates
+  ACQ_LED_SETTLE,   // LED switched on, waiting for it to stabilise
+  ACQ_EXPOSE,       // Auto-exposure search for the lit LED
+  ACQ_ZERO,         // Accumulating blank statistics until precise enough
+  ACQ_DARK,         // LEDs off, averaging dark counts
+  ACQ_READ,         // Averaging sample readings for READ_SENSOR
+  ACQ_STREAM,       // Raw CH0/CH1 at the sensor's own rate
+  ACQ_KINETICS,     // Scheduled samples into the kinetics buffer
+  ACQ_SCAN,         // Red, green and blue in turn, on their stored calibrations
+  ACQ_READ_N        // READ_N replicates, each one averaged like READ_SENSOR
+};
+
+struct Acquisition
+{
+  AcqState state;
+  uint8_t led;     // LED_RED/LED_GREEN/LED_BLUE, or LED_NONE before the first LED command
+  uint8_t discard; // Idle integrations to skip after the light changed
+  uint32_t wakeAt; // millis() at which acqStep() next has work to do
+  uint8_t scanLed; // LED being measured by SCAN
+  uint8_t scanSamples;
+  uint8_t command; // Command being timed until the engine accepts the next one
+  uint32_t commandReceivedUs;
+  uint8_t readRemaining;  // READ_N readings still to take
+  uint32_t readInterval;  // ms between READ_N reading starts, 0 for back to back
+  uint32_t readStartedAt; // millis() when the current READ_N reading began
+};
+
+QueueHandle_t acqCommandQueue = nullptr;
+TaskHandle_t acqTaskHandle = nullptr;
+Acquisition acq = {ACQ_IDLE, LED_NONE, 0, 0, 0, 0, CMD_UNKNOWN, 0, 0, 0, 0};
+
+// Called from the BLE callback task; must not block.
+bool enqueueCommand(const AcqCommand &cmd)
+{
+  if (acqCommandQueue == nullptr)
+    return false;
+  return xQueueSend(acqCommandQueue, &cmd, 0) == pdTRUE;
+}
+
+void publishReading(uint32_t now, uint16_t averagedSampleReading, uint16_t averagedCh1Reading)
+{
+  if (averagedSampleReading == 0)
+  {
+    Serial.println("Multisampling failed for READ_SENSOR");
+    notifyText("Error: Sensor read failed (multi)");
+    return;
+  }
+  Serial.print("Averaged Ch0: ");
+  Serial.println(averagedSampleReading);
+
+  int32_t absorbance = absorbanceFixed(averagedSampleReading, zeroReading, darkReading);
+  if (absorbance == ABS_INVALID)
+  {
+    Serial.println("Error: Zero reading not set!");
+    notifyText("Error: Absorbance calc failed");
+    return;
+  }
+  Serial.print("Absorbance (x10000): ");
+  Serial.println(absorbance);
+
+  publishSample(SAMPLE_READING, now, averagedSampleReading, averagedCh1Reading, absorbance);
+  logReading(SAMPLE_READING, acq.led, now, averagedSampleReading, averagedCh1Reading, zeroReading, darkReading,
+             absorbance);
+}
+
+// "f:<mode> <kind> <p1> <p2>", the reply to FILTER.
+void filterReport(uint8_t mode)
+{
+  const FilterConfig &config = filterConfig[mode];
+  TxMessage msg;
+  txBegin(msg);
+  txAppend(msg, "f:");
+  txAppend(msg, filterModeNames[mode]);
+  txAppend(msg, " ");
+  txAppend(msg, filterKindNames[config.kind]);
+  txAppend(msg, " ");
+  txAppendUInt(msg, config.p1);
+  txAppend(msg, " ");
+  txAppendUInt(msg, config.p2);
+  notifyMessage(msg);
+}
+
+// READ_N: every reading goes into one packed replicate result, and the
+// statistics across the readings are summed here for the closing
+// "r:DONE n= valid= mean= sd= late=" line. Readings without a usable
+// absorbance are sent but left out of the mean. A series stopped by another
+// command ends the same way, with " left=" the readings it did not take.
+struct ReplicateStats
+{
+  uint8_t count;
+  uint8_t valid;
+  uint8_t late; // Readings started after their slot because the last one overran
+  int64_t sum;
+  int64_t sumSq;
+};
+
+ReplicateStats replicates;
+
+void readNBegin(uint32_t now)
+{
+  if (acq.readInterval > 0 && replicates.count > 0 &&
+      (int32_t)(now - (acq.readStartedAt + acq.readInterval)) > (int32_t)ALS_POLL_MS)
+    replicates.late++;
+  acq.readStartedAt = now;
+  multisampleBegin(READ_SAMPLES, false);
+  acq.wakeAt = now + nextSampleWaitMs();
+}
+
+void readNRecord(uint32_t now)
+{
+  uint16_t ch0 = multisampleResult();
+  int32_t absorbance = ch0 == 0 ? ABS_INVALID : absorbanceFixed(ch0, zeroReading, darkReading);
+  if (absorbance != ABS_INVALID && absorbance != ABS_OPAQUE)
+  {
+    replicates.valid++;
+    replicates.sum += absorbance;
+    replicates.sumSq += (int64_t)absorbance * absorbance;
+  }
+  replicates.count++;
+  acq.readRemaining--;
+  uint8_t kind = acq.readRemaining == 0 ? SAMPLE_REPLICATE_END : SAMPLE_REPLICATE;
+  uint16_t ch1 = multisampleResultCh1();
+  publishSample(kind, now, ch0, ch1, absorbance, sampler.ch0.used, multisampleSpread());
+  logReading(kind, acq.led, now, ch0, ch1, zeroReading, darkReading, absorbance);
+}
+
+// Appends a signed fixed-point absorbance with four decimals.
+void txAppendAbsorbance(TxMessage &msg, int32_t value)
+{
+  if (value < 0)
+    txAppend(msg, "-");
+  txAppendFixed(msg, value < 0 ? -(uint32_t)value : (uint32_t)value, 4);
+}
+
+void readNReport()
+{
+  TxMessage msg;
+  txBegin(msg);
+  txAppend(msg, "r:DONE n=");
+  txAppendUInt(msg, replicates.count);
+  txAppend(msg, " valid=");
+  txAppendUInt(msg, replicates.valid);
+  if (replicates.valid > 0)
+  {
+    int64_t n = replicates.valid;
+    txAppend(msg, " mean=");
+    txAppendAbsorbance(msg, (int32_t)(replicates.sum / n));
+    // Sample standard deviation, in the same fixed-point units
+    int64_t spread = n > 1 ? (replicates.sumSq - replicates.sum * replicates.sum / n) / (n - 1) : 0;
+    txAppend(msg, " sd=");
+    txAppendAbsorbance(msg, (int32_t)lroundf(sqrtf((float)(spread > 0 ? spread : 0))));
+  }
+  txAppend(msg, " late=");
+  txAppendUInt(msg, replicates.late);
+  if (acq.readRemaining > 0)
+  {
+    txAppend(msg, " left=");
+    txAppendUInt(msg, acq.readRemaining);
+  }
+  notifyMessage(msg);
+}
+
+// Ends a READ_N early, on a command that needs the sensor: the readings
+// taken so far are framed and reported, the one in progress is dropped.
+void readNStop(uint32_t now)
+{
+  if (replicates.count > 0)
+    publishSample(SAMPLE_REPLICATE_FLUSH, now, 0, 0, 0);
+  readNReport();
+  acq.state = ACQ_IDLE;
+  acq.wakeAt = now + nextSampleWaitMs();
+}
+
+// Queues a stream sample if a new integration has completed. Returns false
+// when there was nothing new to read.
+bool publishContinuousReading(uint32_t now)
+{
+  if (bleSubscriberCount() == 0 || zeroReading == 0)
+    return true;
+  bool ready;
+  if (!isDataReady(ready) || !ready)
+    return false;
+  bool ok = readChannels(ch0_reading, ch1_reading);
+  clearDataReadyFlag();
+  if (!ok)
+    return true;
+  if (acq.discard > 0)
+  {
+    acq.discard--;
+    filterStreamReset(); // The light changed; don't blend across it
+    return true;
+  }
+  filterPush(streamFilterCh0, ch0_reading);
+  filterPush(streamFilterCh1, ch1_reading);
+  uint16_t ch0 = filterValue(streamFilterCh0);
+  publishSample(SAMPLE_STREAM, now, ch0, filterValue(streamFilterCh1), absorbanceFixed(ch0, zeroReading, darkReading));
+  return true;
+}
+
+// Idle, streaming, kinetics and READ_N accept new commands; the other
+// states run to completion first. READ_N can run for over an hour, so it
+// must stay stoppable.
+bool acqAcceptsCommands()
+{
+  return acq.state == ACQ_IDLE || acq.state == ACQ_STREAM || acq.state == ACQ_KINETICS ||
+         acq.state == ACQ_READ_N;
+}
+
+// Commands that leave a kinetics run undisturbed.
+bool kineticsAllows(uint8_t type)
+{
+  return type == CMD_KINETICS_GET || type == CMD_KINETICS_STOP || type == CMD_STATS ||
+         type == CMD_BULK || type == CMD_BULK_RESUME || type == CMD_BULK_CANCEL;
+}
+
+// Commands served alongside a READ_N series; any other one stops it.
+bool readNAllows(uint8_t type)
+{
+  return type == CMD_STATS || type == CMD_KINETICS_GET || type == CMD_BULK || type == CMD_BULK_RESUME ||
+         type == CMD_BULK_CANCEL;
+}
+
+void kineticsStop(uint32_t now)
+{
+  kineticsReport();
+  clearDataReadyFlag();
+  acq.discard = 1;
+  acq.state = ACQ_IDLE;
+  acq.wakeAt = now + nextSampleWaitMs();
+}
+
+// SCAN pipelining: the LED and exposure for the next wavelength are switched
+// the moment the previous wavelength's last integration has been read, and
+// the integration that straddles the switch doubles as the LED settle time
+// (more are dropped only if it is shorter than SCAN_SETTLE_MS). There is no
+// idle wait between wavelengths, and no re-zero: each uses its stored blank.
+void scanSelect(uint8_t led)
+{
+  acq.scanLed = led;
+  calibrationApply(led);
+  selectLED(led);
+  multisampleBegin(acq.scanSamples, true);
+  uint32_t integration = integrationTimeMs();
+  sampler.discard += (SCAN_SETTLE_MS + integration - 1) / integration - 1;
+}
+
+// Queues this wavelength's result and moves on. Returns false after blue.
+bool scanNext(uint32_t now)
+{
+  const Calibration &cal = calibration[acq.scanLed];
+  uint16_t ch0 = sampler.successful > 0 ? filterValue(sampler.ch0) : 0;
+  int32_t absorbance = ch0 > 0 ? absorbanceFixed(ch0, cal.blank, cal.dark) : ABS_INVALID;
+  uint16_t ch1 = multisampleResultCh1();
+  publishSample(SAMPLE_SCAN, now, ch0, ch1, absorbance);
+  logReading(SAMPLE_SCAN, acq.scanLed, now, ch0, ch1, cal.blank, cal.dark, absorbance);
+  if (acq.scanLed + 1 < LED_COUNT)
+  {
+    scanSelect(acq.scanLed + 1);
+    return true;
+  }
+  // Back to the LED (and exposure) that was lit before the scan
+  if (acq.led != LED_NONE && calibrationHasExposure(acq.led))
+    calibrationApply(acq.led);
+  selectLED(acq.led);
+  clearDataReadyFlag();
+  acq.discard = 1;
+  return false;
+}
+
+void streamStop()
+{
+  acq.state = ACQ_IDLE;
+  Serial.println("Stream stopped");
+  TxMessage msg;
+  txBegin(msg);
+  txAppend(msg, "s:STOP overflows=");
+  txAppendUInt(msg, sampleRing.overflows());
+  txAppend(msg, " highwater=");
+  txAppendUInt(msg, sampleRing.highWater());
+  notifyMessage(msg);
+}
+
+// Starts the command. Only called while acqAcceptsCommands() is true.
+void acqHandleCommand(const AcqCommand &cmd, uint32_t now)
+{
+  TxMessage reply;
+
+  if (acq.state == ACQ_STREAM && cmd.type != CMD_STREAM_START)
+    streamStop();
+  if (acq.state == ACQ_READ_N && !readNAllows(cmd.type))
+    readNStop(now);
+  if (acq.state == ACQ_KINETICS && !kineticsAllows(cmd.type))
+  {
+    notifyText("Error: Kinetics run in progress");
+    return;
+  }
+
+  switch (cmd.type)
+  {
+  case CMD_STREAM_START:
+    if (acq.state == ACQ_STREAM)
+      break;
+    clearDataReadyFlag();
+    acq.state = ACQ_STREAM;
+    acq.wakeAt = now + nextSampleWaitMs();
+    Serial.println("Stream started");
+    break;
+
+  case CMD_STREAM_STOP:
+    // Already stopped above
+    break;
+
+  case CMD_READ_SENSOR:
+    multisampleBegin(READ_SAMPLES, false);
+    acq.state = ACQ_READ;
+    acq.wakeAt = now;
+    break;
+
+  case CMD_READ_N:
+    if (cmd.argc < 1 || cmd.args[0] < 1 || cmd.args[0] > READ_N_MAX ||
+        (cmd.argc > 1 && (cmd.args[1] < 0 || cmd.args[1] > READ_N_MAX_INTERVAL_MS)))
+    {
+      notifyText("Error: READ_N <1-100> [interval 0-60000 ms]");
+      break;
+    }
+    replicates = {};
+    acq.readRemaining = (uint8_t)cmd.args[0];
+    acq.readInterval = cmd.argc > 1 ? (uint32_t)cmd.args[1] : 0;
+    readNBegin(now);
+    acq.state = ACQ_READ_N;
+    break;
+
+  case CMD_LOG_INFO:
+    if (!logSubmit(LOG_REQUEST_INFO, 0, 0))
+      notifyText("Error: Log unavailable");
+    break;
+
+  case CMD_LOG_GET:
+    if (!logSubmit(LOG_REQUEST_GET, cmd.argc > 0 && cmd.args[0] > 0 ? cmd.args[0] : 0,
+                   cmd.argc > 1 && cmd.args[1] > 0 ? cmd.args[1] : LOG_GET_DEFAULT))
+      notifyText("Error: Log unavailable");
+    break;
+
+  case CMD_LOG_FIND:
+    if (cmd.argc < 2 || cmd.args[0] < 0 || cmd.args[0] > UINT16_MAX || cmd.args[1] < 0)
+    {
+      notifyText("Error: LOG_FIND <boot> <ms>");
+      break;
+    }
+    if (!logSubmit(LOG_REQUEST_FIND, cmd.args[0], cmd.args[1]))
+      notifyText("Error: Log unavailable");
+    break;
+
+  case CMD_BULK:
+  {
+    if (cmd.argc < 1 || cmd.args[0] < 0 || cmd.args[0] >= BULK_SOURCE_COUNT)
+    {
+      notifyText("Error: BULK <source 0|1> [first] [count]");
+      break;
+    }
+    uint32_t first = cmd.argc > 1 && cmd.args[1] > 0 ? cmd.args[1] : 0;
+    uint32_t count = cmd.argc > 2 && cmd.args[2] > 0 ? cmd.args[2] : UINT32_MAX;
+    bool queued = cmd.args[0] == BULK_SOURCE_LOG ? logSubmit(LOG_REQUEST_BULK, first, count)
+                                                 : bulkRequest(BULK_START, BULK_SOURCE_KINETICS, 0, first, count);
+    if (!queued)
+      notifyText("Error: Bulk transfer busy");
+    break;
+  }
+
+  case CMD_BULK_RESUME:
+    if (cmd.argc < 1 || cmd.args[0] < 0 || cmd.args[0] > UINT8_MAX || (cmd.argc > 1 && cmd.args[1] < 0))
+    {
+      notifyText("Error: BULK_RESUME <id> [chunk]");
+      break;
+    }
+    if (!bulkRequest(BULK_RESUME, 0, (uint8_t)cmd.args[0], cmd.argc > 1 ? cmd.args[1] : UINT32_MAX, 0))
+      notifyText("Error: Bulk transfer busy");
+    break;
+
+  case CMD_BULK_CANCEL:
+    bulkRequest(BULK_CANCEL, BULK_SOURCE_COUNT, 0, 0, 0);
+    break;
+
+  case CMD_FILTER:
+    if (cmd.argc >= 2 && !filterConfigure(cmd.args[0], cmd.args[1], cmd.args + 2, cmd.argc - 2))
+    {
+      notifyText("Error: FILTER <mode 0|1> <kind 0-3> [p1] [p2]");
+      break;
+    }
+    if (cmd.argc == 1 && (cmd.args[0] < 0 || cmd.args[0] >= FILTER_MODE_COUNT))
+    {
+      notifyText("Error: FILTER mode is 0 (READ) or 1 (STREAM)");
+      break;
+    }
+    filterStreamReset();
+    for (uint8_t mode = 0; mode < FILTER_MODE_COUNT; mode++)
+      if (cmd.argc == 0 || cmd.args[0] == mode)
+        filterReport(mode);
+    break;
+
+  case CMD_SET_ZERO:
+    if (acq.led == LED_NONE)
+    {
+      notifyText("Error: No LED on");
+      break;
+    }
+    // Re-measure blank and dark for the lit LED, keeping its exposure
+    calibration[acq.led].flags &= ~CAL_HAS_BLANK;
+    acq.state = ACQ_LED_SETTLE;
+    acq.wakeAt = now;
+    break;
+
+  case CMD_LED_RED_ON:
+  case CMD_LED_GREEN_ON:
+  case CMD_LED_BLUE_ON:
+    acq.led = cmd.type == CMD_LED_RED_ON ? LED_RED : cmd.type == CMD_LED_GREEN_ON ? LED_GREEN : LED_BLUE;
+    selectLED(acq.led);
+    acq.state = ACQ_LED_SETTLE;
+    acq.wakeAt = now + LED_SETTLE_MS;
+    break;
+
+  case CMD_AUTO_EXPOSE:
+    if (acq.led == LED_NONE)
+    {
+      notifyText("Error: No LED on");
+      break;
+    }
+    // Forget the calibration for the lit LED and search (and zero) again
+    calibrationForget(acq.led);
+    acq.state = ACQ_LED_SETTLE;
+    acq.wakeAt = now;
+    break;
+
+  case CMD_SET_EXPOSURE:
+  {
+    uint8_t gain = 0;
+    while (cmd.argc >= 2 && gain < 4 && gainFactor[gain] != cmd.args[1])
+      gain++;
+    int32_t duty = cmd.argc > 2 ? cmd.args[2] : LED_DUTY_MAX;
+    if (cmd.argc < 2 || cmd.args[0] < 1 || cmd.args[0] > 255 || gain == 4 ||
+        duty < LED_DUTY_MIN || duty > LED_DUTY_MAX)
+    {
+      notifyText("Error: SET_EXPOSURE periods 1-255, gain 1/8/16/120, duty 8-1023");
+      break;
+    }
+    if (acq.led == LED_NONE)
+    {
+      notifyText("Error: No LED on");
+      break;
+    }
+    // Stored like a search result, which drops the blank and zeros again
+    calibrationSetExposure(acq.led, (uint8_t)cmd.args[0], gain, (uint16_t)duty);
+    acq.state = ACQ_LED_SETTLE;
+    acq.wakeAt = now;
+    break;
+  }
+
+  case CMD_KINETICS:
+  {
+    if (cmd.argc < 3 || cmd.args[0] < KINETICS_MIN_INTERVAL_MS || cmd.args[1] <= 0 ||
+        cmd.args[2] < 0 || cmd.args[2] >= LED_COUNT)
+    {
+      notifyText("Error: KINETICS needs interval >= 100 ms, duration s, LED 0-2");
+      break;
+    }
+    uint8_t led = (uint8_t)cmd.args[2];
+    uint32_t planned = (uint32_t)cmd.args[1] * 1000UL / (uint32_t)cmd.args[0];
+    if (planned > kineticsCapacity)
+    {
+      txBegin(reply);
+      txAppend(reply, "Error: KINETICS capacity is ");
+      txAppendUInt(reply, kineticsCapacity);
+      notifyMessage(reply);
+      break;
+    }
+    if (kineticsSending || kineticsSendFrom >= 0)
+    {
+      notifyText("Error: KINETICS_GET still sending");
+      break;
+    }
+    if (!calibrationBlankFresh(led, now))
+    {
+      notifyText("Error: Zero this LED first");
+      break;
+    }
+    const Calibration &cal = calibration[led];
+    if ((uint32_t)cmd.args[0] < ((uint32_t)cal.periods * ATIME_CYCLE_US + 999) / 1000)
+    {
+      notifyText("Error: Interval shorter than integration");
+      break;
+    }
+    acq.led = led;
+    calibrationApply(led);
+    selectLED(led);
+    zeroReading = cal.blank;
+    darkReading = cal.dark;
+    // First sample once the LED has settled and a full integration has run
+    bulkRequest(BULK_CANCEL, BULK_SOURCE_KINETICS, 0, 0, 0); // Its records are about to be overwritten
+    kineticsBegin(led, cmd.args[0], planned, now + LED_SETTLE_MS + integrationTimeMs());
+    acq.state = ACQ_KINETICS;
+    acq.wakeAt = now;
+    txBegin(reply);
+    txAppend(reply, "k:START n=");
+    txAppendUInt(reply, planned);
+    txAppend(reply, " interval=");
+    txAppendUInt(reply, kinetics.intervalMs);
+    txAppend(reply, " blank=");
+    txAppendUInt(reply, kinetics.blank);
+    txAppend(reply, " dark=");
+    txAppendUInt(reply, kinetics.dark);
+    notifyMessage(reply);
+    break;
+  }
+
+  case CMD_SCAN:
+    if (cmd.argc > 0 && (cmd.args[0] < 1 || cmd.args[0] > SCAN_MAX_SAMPLES))
+    {
+      notifyText("Error: SCAN takes 1-16 samples per LED");
+      break;
+    }
+    for (uint8_t led = 0; led < LED_COUNT; led++)
+    {
+      if (!calibrationBlankFresh(led, now))
+      {
+        txBegin(reply);
+        txAppend(reply, "Error: Zero ");
+        txAppend(reply, ledNames[led]);
+        txAppend(reply, " first");
+        notifyMessage(reply);
+        return;
+      }
+    }
+    acq.scanSamples = cmd.argc > 0 ? (uint8_t)cmd.args[0] : 1;
+    scanSelect(LED_RED);
+    acq.state = ACQ_SCAN;
+    acq.wakeAt = now + nextSampleWaitMs();
+    break;
+
+  case CMD_KINETICS_STOP:
+    if (acq.state == ACQ_KINETICS)
+      kineticsStop(now);
+    break;
+
+  case CMD_KINETICS_GET:
+    kineticsSendFrom = cmd.argc > 0 && cmd.args[0] > 0 ? cmd.args[0] : 0;
+    if (txTaskHandle != nullptr)
+      xTaskNotifyGive(txTaskHandle);
+    break;
+
+  case CMD_STATS:
+    statsRequested = true;
+    if (txTaskHandle != nullptr)
+      xTaskNotifyGive(txTaskHandle);
+    break;
+
+  case CMD_ZERO_TOL:
+    if (cmd.argc < 1 || cmd.args[0] <= 0)
+    {
+      notifyText("Error: ZERO_TOL needs a positive absorbance");
+      break;
+    }
+    zeroToleranceUA = cmd.args[0];
+    txBegin(reply);
+    txAppend(reply, "ZERO_TOL set to ");
+    txAppendUInt(reply, zeroToleranceUA);
+    txAppend(reply, " uA");
+    notifyMessage(reply);
+    break;
+
+  default:
+    txBegin(reply);
+    txAppend(reply, "Received unknown command: ");
+    txAppend(reply, cmd.text);
+    notifyMessage(reply);
+    break;
+  }
+}
+
+// Advances the state machine if its deadline has passed. Returns the number
+// of ms until it next needs to run.
+uint32_t acqStep(uint32_t now)
+{
+  if ((int32_t)(now - acq.wakeAt) < 0)
+    return acq.wakeAt - now;
+
+  SampleResult sample;
+
+  switch (acq.state)
+  {
+  case ACQ_IDLE:
+    acq.wakeAt = now + (publishContinuousReading(now) ? nextSampleWaitMs() : ALS_POLL_MS);
+    break;
+
+  case ACQ_LED_SETTLE:
+    if (calibrationBlankFresh(acq.led, now))
+    {
+      const Calibration &cal = calibration[acq.led];
+      calibrationApply(acq.led);
+      zeroReading = cal.blank;
+      darkReading = cal.dark;
+      TxMessage msg;
+      txBegin(msg);
+      txAppend(msg, "z:LOADED age=");
+      txAppendUInt(msg, (now - cal.takenAtMs) / 1000);
+      txAppend(msg, "s");
+      notifyMessage(msg);
+      clearDataReadyFlag();
+      acq.discard = 1;
+      acq.state = ACQ_IDLE;
+      acq.wakeAt = now + nextSampleWaitMs();
+      break;
+    }
+    if (!calibrationHasExposure(acq.led))
+    {
+      exposeBegin(acq.led);
+      clearDataReadyFlag();
+      acq.state = ACQ_EXPOSE;
+      acq.wakeAt = now + nextSampleWaitMs();
+      break;
+    }
+    calibrationApply(acq.led);
+    // The integration in progress straddles the exposure change; drop it.
+    zeroBegin(now);
+    acq.state = ACQ_ZERO;
+    acq.wakeAt = now + nextSampleWaitMs();
+    break;
+
+  case ACQ_EXPOSE:
+  {
+    int8_t result = readFreshChannels(ch0_reading, ch1_reading);
+    if (result == 0)
+    {
+      acq.wakeAt = now + ALS_POLL_MS;
+      break;
+    }
+    if (exposeJob.discard > 0 || result < 0)
+    {
+      exposeJob.discard = 0;
+      acq.wakeAt = now + nextSampleWaitMs();
+      break;
+    }
+    if (optimizeSensorSettings(ch0_reading))
+    {
+      calibrationSetExposure(acq.led, exposeJob.periods, exposeJob.gain, exposeJob.duty);
+      TxMessage msg;
+      txBegin(msg);
+      txAppend(msg, "e:");
+      txAppend(msg, ledNames[acq.led]);
+      txAppend(msg, " periods=");
+      txAppendUInt(msg, exposeJob.periods);
+      txAppend(msg, " gain=");
+      txAppendUInt(msg, exposeJob.gain);
+      txAppend(msg, " duty=");
+      txAppendUInt(msg, exposeJob.duty);
+      notifyMessage(msg);
+      applyExposure(exposeJob.periods, exposeJob.gain);
+      zeroBegin(now);
+      acq.state = ACQ_ZERO;
+    }
+    acq.wakeAt = now + nextSampleWaitMs();
+    break;
+  }
+
+  case ACQ_ZERO:
+  {
+    int8_t result = readFreshChannels(ch0_reading, ch1_reading);
+    if (result == 0)
+    {
+      acq.wakeAt = now + ALS_POLL_MS;
+      break;
+    }
+    if (zeroStep(now, ch0_reading, result > 0))
+    {
+      if (zeroFinish(now))
+      {
+        // Dark counts at the same exposure, with every LED off
+        selectLED(LED_NONE);
+        multisampleBegin(DARK_SAMPLES, true);
+        acq.state = ACQ_DARK;
+      }
+      else
+      {
+        acq.state = ACQ_IDLE;
+      }
+    }
+    acq.wakeAt = now + nextSampleWaitMs();
+    break;
+  }
+
+  case ACQ_DARK:
+    sample = multisampleStep();
+    if (sample == SAMPLE_PENDING)
+    {
+      acq.wakeAt = now + ALS_POLL_MS;
+      break;
+    }
+    if (sample == SAMPLE_DONE)
+    {
+      darkReading = sampler.successful > 0 ? filterValue(sampler.ch0) : 0;
+      if (darkReading >= zeroReading)
+        darkReading = 0; // Blank indistinguishable from dark; don't divide by ~0
+      selectLED(acq.led);
+      calibrationSetBlank(acq.led, zeroReading, darkReading, now);
+      zeroReport();
+      clearDataReadyFlag();
+      acq.discard = 1;
+      acq.state = ACQ_IDLE;
+    }
+    acq.wakeAt = now + nextSampleWaitMs();
+    break;
+
+  case ACQ_STREAM:
+  {
+    if (bleSubscriberCount() == 0)
+    {
+      streamStop();
+      break;
+    }
+    int8_t result = readFreshChannels(ch0_reading, ch1_reading);
+    if (result == 0)
+    {
+      acq.wakeAt = now + ALS_POLL_MS;
+      break;
+    }
+    if (result > 0)
+      publishSample(SAMPLE_RAW, now, ch0_reading, ch1_reading, ABS_INVALID);
+    acq.wakeAt = now + nextSampleWaitMs();
+    break;
+  }
+
+  case ACQ_SCAN:
+    sample = multisampleStep();
+    if (sample == SAMPLE_PENDING)
+    {
+      acq.wakeAt = now + ALS_POLL_MS;
+      break;
+    }
+    if (sample == SAMPLE_DONE && !scanNext(now))
+      acq.state = ACQ_IDLE;
+    acq.wakeAt = now + nextSampleWaitMs();
+    break;
+
+  case ACQ_KINETICS:
+    acq.wakeAt = kineticsStep(now);
+    if (kineticsDone())
+      kineticsStop(now);
+    break;
+
+  case ACQ_READ:
+    sample = multisampleStep();
+    if (sample == SAMPLE_PENDING)
+    {
+      acq.wakeAt = now + ALS_POLL_MS;
+      break;
+    }
+    if (sample == SAMPLE_DONE)
+    {
+      publishReading(now, multisampleResult(), multisampleResultCh1());
+      acq.state = ACQ_IDLE;
+    }
+    acq.wakeAt = now + nextSampleWaitMs();
+    break;
+
+  case ACQ_READ_N:
+    if (sampler.remaining == 0)
+    {
+      readNBegin(now); // The next reading's slot has come
+      break;
+    }
+    sample = multisampleStep();
+    if (sample == SAMPLE_PENDING)
+    {
+      acq.wakeAt = now + ALS_POLL_MS;
+      break;
+    }
+    if (sample == SAMPLE_TAKEN)
+    {
+      acq.wakeAt = now + nextSampleWaitMs();
+      break;
+    }
+    readNRecord(now);
+    if (acq.readRemaining == 0)
+    {
+      readNReport();
+      acq.state = ACQ_IDLE;
+      acq.wakeAt = now + nextSampleWaitMs();
+    }
+    else if (acq.readInterval > 0 && (int32_t)(acq.readStartedAt + acq.readInterval - now) > 0)
+      acq.wakeAt = acq.readStartedAt + acq.readInterval;
+    else
+      acq.wakeAt = now; // Back to back, at the sensor's own pace
+    break;
+  }
+  return acq.wakeAt - now;
+}
+
+// A kinetics run samples into the buffer, so only its retrieval needs the
+// fast link; idle updates are slow enough for the idle profile.
+bool acqLinkBusy()
+{
+  return (acq.state != ACQ_IDLE && acq.state != ACQ_KINETICS) || kineticsSending;
+}
+
+void acquisitionTask(void *param)
+{
+  AcqCommand cmd;
+  for (;;)
+  {
+    uint32_t waitMs = acqStep(millis());
+    bleLinkUpdate(acqLinkBusy(), millis());
+    if (!acqAcceptsCommands())
+    {
+      // Commands queue up behind the running sequence.
+      vTaskDelay(pdMS_TO_TICKS(waitMs));
+      continue;
+    }
+    // A READ_N is timed to its last reading, or to the command that stops it
+    if (acq.command != CMD_UNKNOWN && acq.state != ACQ_READ_N)
+    {
+      PROBE_RECORD(PROBE_COMMAND + acq.command, PROBE_NOW_US() - acq.commandReceivedUs);
+      acq.command = CMD_UNKNOWN;
+    }
+    if (xQueueReceive(acqCommandQueue, &cmd, pdMS_TO_TICKS(waitMs)) == pdTRUE)
+    {
+      bleLinkActiveAt = millis();
+      bleLinkUpdate(true, bleLinkActiveAt);
+      if (acq.state == ACQ_READ_N && readNAllows(cmd.type))
+      {
+        acqHandleCommand(cmd, millis());
+        PROBE_RECORD(PROBE_COMMAND + cmd.type, PROBE_NOW_US() - cmd.receivedUs);
+        continue;
+      }
+      if (acq.command != CMD_UNKNOWN)
+        PROBE_RECORD(PROBE_COMMAND + acq.command, PROBE_NOW_US() - acq.commandReceivedUs);
+      acqHandleCommand(cmd, millis());
+      acq.command = cmd.type;
+      acq.commandReceivedUs = cmd.receivedUs;
+    }
+  }
+}
+
+// Upper bound of the bucket holding the p-th percentile, in us.
+uint32_t histogramPercentileUs(const Histogram &h, uint8_t percent)
+{
+  uint32_t rank = (h.n * percent + 99) / 100;
+  uint32_t seen = 0;
+  for (uint8_t b = 0; b < PROBE_BUCKETS; b++)
+  {
+    seen += h.buckets[b];
+    if (seen >= rank)
+      return b == PROBE_BUCKETS - 1 ? h.maxUs : (1UL << b) - 1;
+  }
+  return h.maxUs;
+}
+
+// Reply to STATS, sent from the transmit task: one "t:<probe> n= p50= p99=
+// max=" line (us) per probe that has fired, "t:COUNTERS ...", then the
+// transmit, per-client link and heap lines. Reads race benignly with the writers; a line
+// may be one sample out of date.
+void probesReport()
+{
+  TxMessage line;
+#if PROBES_ENABLED
+  static const char *const probeNames[PROBE_COMMAND] = {"i2c", "multisample", "absorbance", "notify"};
+  for (uint8_t id = 0; id < PROBE_COUNT; id++)
+  {
+    const Histogram &h = probeHistograms[id];
+    if (h.n == 0)
+      continue;
+    txBegin(line);
+    txAppend(line, "t:");
+    txAppend(line, id < PROBE_COMMAND ? probeNames[id] : commandTable[id - PROBE_COMMAND].name);
+    txAppend(line, " n=");
+    txAppendUInt(line, h.n);
+    txAppend(line, " p50=");
+    txAppendUInt(line, histogramPercentileUs(h, 50));
+    txAppend(line, " p99=");
+    txAppendUInt(line, histogramPercentileUs(h, 99));
+    txAppend(line, " max=");
+    txAppendUInt(line, h.maxUs);
+    transmitText(line);
+  }
+  txBegin(line);
+  txAppend(line, "t:COUNTERS i2cfail=");
+  txAppendUInt(line, probeCounters[COUNTER_I2C_FAIL]);
+  txAppend(line, " i2cretry=");
+  txAppendUInt(line, probeCounters[COUNTER_I2C_RETRY]);
+  transmitText(line);
+#endif
+  txBegin(line);
+  txAppend(line, "t:TX dropped=");
+  txAppendUInt(line, txMessagesDropped.load(std::memory_order_relaxed));
+  txAppend(line, " overflows=");
+  txAppendUInt(line, sampleRing.overflows());
+  transmitText(line);
+
+  for (uint8_t i = 0; i < BLE_MAX_CLIENTS; i++)
+  {
+    const BleClient &client = bleClients[i];
+    if (!client.active)
+      continue;
+    txBegin(line);
+    txAppend(line, "t:CLIENT conn=");
+    txAppendUInt(line, client.connId);
+    txAppend(line, " mtu=");
+    txAppendUInt(line, client.mtu);
+    txAppend(line, client.subscribed ? " sub=1" : " sub=0");
+    txAppend(line, " dropped=");
+    txAppendUInt(line, client.dropped);
+    txAppend(line, " oversized=");
+    txAppendUInt(line, client.oversized);
+    transmitText(line);
+
+    txBegin(line);
+    txAppend(line, "t:LINK conn=");
+    txAppendUInt(line, client.connId);
+    txAppend(line, client.linkMode == BLE_LINK_IDLE ? " mode=IDLE" : " mode=FAST");
+    txAppend(line, " interval=");
+    txAppendFixed(line, client.interval * 125, 2);
+    txAppend(line, " phy=");
+    txAppend(line, blePhyName(client.txPhy));
+    txAppend(line, " dle=");
+    txAppendUInt(line, client.txOctets);
+    transmitText(line);
+  }
+
+  // Free and largest-block figures now, and their low-water marks since boot
+  txBegin(line);
+  txAppend(line, "t:HEAP free=");
+  txAppendUInt(line, heap_caps_get_free_size(MALLOC_CAP_8BIT));
+  txAppend(line, " min=");
+  txAppendUInt(line, esp_get_minimum_free_heap_size());
+  txAppend(line, " largest=");
+  txAppendUInt(line, heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+  txAppend(line, " largestmin=");
+  txAppendUInt(line, heapLargestBlockMin);
+  transmitText(line);
+}
+
+
+// ============================================
+// Command dispatch
+// Commands are "NAME [arg ...]". The name is hashed (seeded FNV-1a) into
+// a perfect-hash index built from commandTable at compile time: the first
+// seed under which no two names share a slot is picked, so dispatch is one
+// hash, one slot and one compare however many commands there are. A table
+// no seed separates fails the build. Arguments are parsed in place from
+// AcqCommand::text, and nothing on this path touches the heap.
+// ============================================
+#define COMMAND_SLOTS 128 // Power of two, comfortably above CMD_COUNT
+#define COMMAND_MAX_SEEDS 256
+
+constexpr uint32_t commandHash(const char *name, size_t len, uint32_t seed)
+{
+  uint32_t hash = 2166136261UL ^ (seed * 0x9E3779B9UL);
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ (uint8_t)name[i]) * 16777619UL;
+  return hash;
+}
+
+constexpr size_t constexprStrlen(const char *s)
+{
+  size_t len = 0;
+  while (s[len] != '\0')
+    len++;
+  return len;
+}
+
+// Longest well-formed command: a name and its maxArgs arguments, each an
+// int32 or millionths of one at 11 characters or fewer, with a space before.
+constexpr size_t commandTextMax()
+{
+  size_t longest = 0;
+  for (uint8_t type = 0; type < CMD_COUNT; type++)
+  {
+    size_t len = constexprStrlen(commandTable[type].name) + commandTable[type].maxArgs * 12;
+    longest = len > longest ? len : longest;
+  }
+  return longest;
+}
+
+static_assert(ACQ_COMMAND_TEXT_LEN > commandTextMax(), "ACQ_COMMAND_TEXT_LEN cuts off valid commands");
+
+struct CommandIndex
+{
+  uint8_t slot[COMMAND_SLOTS]; // commandTable index, or CMD_UNKNOWN for an empty slot
+  uint32_t seed;
+  bool perfect;
+};
+
+constexpr CommandIndex makeCommandIndex()
+{
+  CommandIndex index{};
+  for (uint32_t seed = 0; seed < COMMAND_MAX_SEEDS; seed++)
+  {
+    index = CommandIndex{};
+    index.seed = seed;
+    index.perfect = true;
+    for (uint8_t type = CMD_UNKNOWN + 1; type < CMD_COUNT && index.perfect; type++)
+    {
+      const char *name = commandTable[type].name;
+      uint32_t slot = commandHash(name, constexprStrlen(name), seed) & (COMMAND_SLOTS - 1);
+      if (index.slot[slot] != CMD_UNKNOWN)
+        index.perfect = false;
+      index.slot[slot] = type;
+    }
+    if (index.perfect)
+      break;
+  }
+  return index;
+}
+
+constexpr CommandIndex commandIndex = makeCommandIndex();
+static_assert(commandIndex.perfect, "No seed separates the command names; grow COMMAND_SLOTS");
+static_assert(CMD_UNKNOWN == 0, "Empty index slots rely on CMD_UNKNOWN being 0");
+
+bool parseCommandArg(const char *token, uint8_t kind, int32_t &value)
+{
+  char *end;
+  if (kind == ARG_MICRO)
+  {
+    float v = strtof(token, &end);
+    value = lroundf(v * 1e6f);
+  }
+  else
+  {
+    value = strtol(token, &end, 10);
+  }
+  return end != token && (*end == ' ' || *end == '\0');
+}
+
+// Fills cmd from a raw BLE write. Anything that is not a known name with
+// at most maxArgs well-formed arguments becomes CMD_UNKNOWN, as does a
+// write too long for cmd.text, which no valid command is: parsing what fits
+// would run it with arguments cut short.
+void parseCommand(const uint8_t *data, size_t len, AcqCommand &cmd)
+{
+  cmd.type = CMD_UNKNOWN;
+  cmd.argc = 0;
+  bool tooLong = len > sizeof(cmd.text) - 1;
+  if (tooLong)
+    len = sizeof(cmd.text) - 1;
+  memcpy(cmd.text, data, len);
+  cmd.text[len] = '\0';
+  if (tooLong)
+    return;
+
+  size_t nameLen = 0;
+  while (nameLen < len && cmd.text[nameLen] != ' ')
+    nameLen++;
+  uint8_t type = commandIndex.slot[commandHash(cmd.text, nameLen, commandIndex.seed) & (COMMAND_SLOTS - 1)];
+  const CommandSpec &spec = commandTable[type];
+  if (type == CMD_UNKNOWN || constexprStrlen(spec.name) != nameLen || memcmp(spec.name, cmd.text, nameLen) != 0)
+    return;
+
+  const char *p = cmd.text + nameLen;
+  while (*p == ' ')
+  {
+    while (*p == ' ')
+      p++;
+    if (*p == '\0')
+      break;
+    if (cmd.argc == spec.maxArgs || !parseCommandArg(p, spec.argKind, cmd.args[cmd.argc]))
+    {
+      cmd.argc = 0;
+      return;
+    }
+    cmd.argc++;
+    while (*p != ' ' && *p != '\0')
+      p++;
+  }
+  cmd.type = type;
+}
+
+
+// ============================================
+// helper functions end
+// ============================================
+
+// --- BLE GAP events ---
+// Runs in the BLE task after the library's own handling. Reports what
+// the central granted; requests it refused leave the old values in place.
+void bleGapEvent(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param)
+{
+  BleClient *client;
+  TxMessage msg;
+  switch (event)
+  {
+  case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT:
+    if (param->update_conn_params.status != ESP_BT_STATUS_SUCCESS ||
+        (client = bleClientForBda(param->update_conn_params.bda)) == nullptr)
+      break;
+    client->interval = param->update_conn_params.conn_int;
+    client->latency = param->update_conn_params.latency;
+    client->timeout = param->update_conn_params.timeout;
+    txBegin(msg);
+    txAppend(msg, "c:CONN conn=");
+    txAppendUInt(msg, client->connId);
+    txAppend(msg, " interval=");
+    txAppendFixed(msg, client->interval * 125, 2);
+    txAppend(msg, " latency=");
+    txAppendUInt(msg, client->latency);
+    txAppend(msg, " timeout=");
+    txAppendUInt(msg, client->timeout * 10UL);
+    notifyMessage(msg);
+    break;
+#if CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+  case ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT:
+    if (param->phy_update.status != ESP_BT_STATUS_SUCCESS ||
+        (client = bleClientForBda(param->phy_update.remote_bda)) == nullptr)
+      break;
+    client->txPhy = param->phy_update.tx_phy;
+    client->rxPhy = param->phy_update.rx_phy;
+    txBegin(msg);
+    txAppend(msg, "c:PHY conn=");
+    txAppendUInt(msg, client->connId);
+    txAppend(msg, " tx=");
+    txAppend(msg, blePhyName(client->txPhy));
+    txAppend(msg, " rx=");
+    txAppend(msg, blePhyName(client->rxPhy));
+    notifyMessage(msg);
+    break;
+#endif
+  case ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT:
+    if (param->pkt_data_length_cmpl.status != ESP_BT_STATUS_SUCCESS ||
+        (client = bleClientForBda(param->pkt_data_length_cmpl.remote_bda)) == nullptr)
+      break;
+    client->txOctets = param->pkt_data_length_cmpl.params.tx_len;
+    txBegin(msg);
+    txAppend(msg, "c:DLE conn=");
+    txAppendUInt(msg, client->connId);
+    txAppend(msg, " tx=");
+    txAppendUInt(msg, client->txOctets);
+    txAppend(msg, " rx=");
+    txAppendUInt(msg, param->pkt_data_length_cmpl.params.rx_len);
+    notifyMessage(msg);
+    break;
+  default:
+    break;
+  }
+}
+
+// --- BLE Server Callbacks ---
+class MyServerCallbacks : public BLEServerCallbacks
+{
+  void onConnect(BLEServer *pServerInstance) // Renamed parameter
+  {
+    Serial.println("Client connected");
+    // Advertising stops on every connection; keep it up while there is room
+    // for another observer.
+    if (pServerInstance->getConnectedCount() + 1 < BLE_MAX_CLIENTS) {
+        BLEDevice::startAdvertising();
+        Serial.println("Advertising continues.");
+    } else {
+        Serial.println("Advertising stopped, all client slots in use.");
+    }
+  };
+
+  void onMtuChanged(BLEServer *pServerInstance, esp_ble_gatts_cb_param_t *param)
+  {
+    Serial.print("MTU: ");
+    Serial.println(param->mtu.mtu);
+  }
+
+  void onDisconnect(BLEServer *pServerInstance)
+  {
+    Serial.println("Client disconnected");
+     if (pAdvertising != nullptr) {
+        BLEDevice::startAdvertising(); // Use standard function to restart
+        Serial.println("Advertising restarted.");
+    } else {
+        Serial.println("Error: pAdvertising object is null on disconnect!");
+    }
+  }
+};
+
+// --- BLE Characteristic Callbacks ---
+class MyCallbacks : public BLECharacteristicCallbacks
+{
+  void onWrite(BLECharacteristic *pCharacteristic)
+  {
+    // Read straight from the attribute buffer; getValue() would copy it to the heap.
+    size_t len = pCharacteristic->getLength();
+
+    // Bulk acknowledgements go straight to the transmit task
+    if (len > 0 && !bulkOnWrite(pCharacteristic->getData(), len))
+    {
+      AcqCommand cmd;
+      parseCommand(pCharacteristic->getData(), len, cmd);
+      cmd.receivedUs = PROBE_NOW_US();
+      Serial.print("Received: ");
+      Serial.println(cmd.text);
+
+      // The acquisition task does the work and notifies the result.
+      if (!enqueueCommand(cmd))
+      {
+        Serial.println("Command queue full, command dropped.");
+      }
+    }
+  }
+};
+
+// --- Arduino Setup Function ---
+void setup()
+{
+  Serial.begin(115200);
+  Serial.println("Starting BLE server!");
+
+  ledAttach();
+  selectLED(LED_NONE);
+
+  calibrationLoad();
+  kineticsInit();
+  filterStreamReset();
+  logInit();
+
+  Wire.begin(); // Initialize I2C
+  Wire.setClock(I2C_CLOCK_HZ);
+
+  // ============================================
+  // setup apds start
+  // ============================================
+  if (!initAPD())
+  {
+    Serial.println("APDS-9930 Initialization Failed! Halting.");
+    while (1); // Stop execution if sensor fails
+  }
+  else
+  {
+    Serial.println("APDS-9930 Initialized Successfully.");
+  }
+  delay(120);
+  // ============================================
+  // setup apds end
+  // ============================================
+
+  // --- Initialize BLE ---
+  BLEDevice::init("ESP32_SP"); // Using shorter name from previous suggestion
+  BLEDevice::setMTU(LOCAL_MTU);
+  pServer = BLEDevice::createServer();
+  pServer->setCallbacks(new MyServerCallbacks());
+  BLEService *pService = pServer->createService(SERVICE_UUID);
+
+  // TX Characteristic
+  pTxCharacteristic = pService->createCharacteristic(
+      CHARACTERISTIC_TX_UUID,
+      BLECharacteristic::PROPERTY_NOTIFY
+  );
+  BLEDescriptor *txCccd = new BLEDescriptor(BLEUUID((uint16_t)0x2902)); // CCCD Descriptor
+  pTxCharacteristic->addDescriptor(txCccd);
+
+  // RX Characteristic
+  pRxCharacteristic = pService->createCharacteristic(
+      CHARACTERISTIC_RX_UUID,
+      BLECharacteristic::PROPERTY_WRITE | BLECharacteristic::PROPERTY_WRITE_NR // Allow write without response
+  );
+  pRxCharacteristic->setCallbacks(new MyCallbacks());
+
+  pService->start();
+  txCccdHandle = txCccd->getHandle();
+  BLEDevice::setCustomGattsHandler(bleGattsEvent);
+  BLEDevice::setCustomGapHandler(bleGapEvent);
+
+  // --- Advertising ---
+  pAdvertising = BLEDevice::getAdvertising();
+  pAdvertising->addServiceUUID(SERVICE_UUID);
+  pAdvertising->setScanResponse(true); // Set to true if name is short enough for UUID
+  pAdvertising->setMinPreferred(bleLinkProfiles[BLE_LINK_FAST].minInterval);
+  pAdvertising->setMaxPreferred(bleLinkProfiles[BLE_LINK_FAST].maxInterval);
+  BLEDevice::startAdvertising();
+
+  Serial.println("Waiting for a client connection to notify...");
+  zeroReading = 0;
+
+  // --- Acquisition (core 1) and transmit (core 0) tasks ---
+  txMessageQueue = xQueueCreate(TX_QUEUE_LENGTH, sizeof(TxMessage));
+  xTaskCreatePinnedToCore(transmitTask, "transmit", 4096, nullptr, 1, &txTaskHandle, 0);
+  logRequestQueue = xQueueCreate(LOG_REQUEST_QUEUE_LENGTH, sizeof(LogRequest));
+  logChunkQueue = xQueueCreate(LOG_CHUNK_QUEUE_LENGTH, sizeof(LogChunk));
+  bulkRequestQueue = xQueueCreate(BULK_REQUEST_QUEUE_LENGTH, sizeof(BulkRequest));
+  bulkAckQueue = xQueueCreate(BULK_ACK_QUEUE_LENGTH, sizeof(BulkAck));
+  xTaskCreatePinnedToCore(logTask, "log", 4096, nullptr, 1, &logTaskHandle, 0);
+  acqCommandQueue = xQueueCreate(ACQ_QUEUE_LENGTH, sizeof(AcqCommand));
+  xTaskCreatePinnedToCore(acquisitionTask, "acquisition", 4096, nullptr, 2, &acqTaskHandle, 1);
+}
+
+// --- Arduino Loop Function ---
+void loop()
+{
+  // Sensor work, including the periodic absorbance update, runs in acquisitionTask().
+  delay(1000);
 }
@@ -86,8 +86,8 @@ void setup() {
   BLEAdvertising *pAdvertising = pServer->getAdvertising(); // Use pServer, not BLEDevice
   pAdvertising->addServiceUUID(BLEUUID(SERVICE_UUID));
   pAdvertising->setScanResponse(false); // Keep advertising simple
-  pAdvertising->setMinPreferred(0x0);    // Allow any connection interval
-  pAdvertising->setMaxPreferred(0x0);
+  pAdvertising->setMinPreferred(0x06); // Preferred interval 7.5-30 ms (1.25 ms units)
+  pAdvertising->setMaxPreferred(0x18);
 
   BLEDevice::startAdvertising();
   advertising = true; // Set advertising flag
@@ -33,37 +33,52 @@ class MyServerCallbacks : public BLEServerCallbacks {
   }
 };
 
-String thingToDo(){
+const char *thingToDo(){
   return "lalala";
 }
 
+enum Command {
+  CMD_UNKNOWN,
+  CMD_LED_ON,
+  CMD_LED_OFF,
+  CMD_READ_SENSOR
+};
+
+// Matches straight from the characteristic buffer, so no String is made.
+bool commandIs(const char *data, size_t len, const char *name) {
+  return strlen(name) == len && memcmp(data, name, len) == 0;
+}
+
+Command parseCommand(const char *data, size_t len) {
+  if (commandIs(data, len, "LED_ON")) return CMD_LED_ON;
+  if (commandIs(data, len, "LED_OFF")) return CMD_LED_OFF;
+  if (commandIs(data, len, "READ_SENSOR")) return CMD_READ_SENSOR;
+  return CMD_UNKNOWN;
+}
+
 // Characteristic Callback: Handles writes to the RX characteristic
 class MyCallbacks: public BLECharacteristicCallbacks {
   void onWrite(BLECharacteristic *pCharacteristic) {
-    std::string rxValue = pCharacteristic->getValue();
-    if (rxValue.length() > 0) {
+    const char *data = (const char *)pCharacteristic->getData();
+    size_t len = pCharacteristic->getLength();
+    if (len > 0) {
       Serial.print("Received Value: ");
-      Serial.println(rxValue.c_str()); 
-
-      String command = String(rxValue.c_str()); 
-
-      if (command == "LED_ON") {
-        String sensorValue = thingToDo(); 
-        pCharacteristicTX->setValue(sensorValue.c_str());
-        pCharacteristicTX->notify();
-        Serial.println(sensorValue); 
-      } else if (command == "LED_OFF") {
-        String sensorValue = thingToDo(); 
-        pCharacteristicTX->setValue(sensorValue.c_str());
-        pCharacteristicTX->notify();
-        Serial.println(sensorValue);
-      } else if (command == "READ_SENSOR") {
-        String sensorValue = thingToDo(); 
-        pCharacteristicTX->setValue(sensorValue.c_str());
-        pCharacteristicTX->notify();
-        Serial.println(sensorValue);
-      } else {
-        Serial.println("Unknown command");
+      Serial.write((const uint8_t *)data, len);
+      Serial.println();
+
+      switch (parseCommand(data, len)) {
+        case CMD_LED_ON:
+        case CMD_LED_OFF:
+        case CMD_READ_SENSOR: {
+          const char *sensorValue = thingToDo();
+          pCharacteristicTX->setValue((uint8_t *)sensorValue, strlen(sensorValue));
+          pCharacteristicTX->notify();
+          Serial.println(sensorValue);
+          break;
+        }
+        default:
+          Serial.println("Unknown command");
+          break;
       }
     }
   }
@@ -103,8 +118,8 @@ void setup() {
   BLEAdvertising *pAdvertising = pServer->getAdvertising(); // Use pServer, not BLEDevice
   pAdvertising->addServiceUUID(BLEUUID(SERVICE_UUID));
   pAdvertising->setScanResponse(false); // Keep advertising simple
-  pAdvertising->setMinPreferred(0x0);    // Allow any connection interval
-  pAdvertising->setMaxPreferred(0x0);
+  pAdvertising->setMinPreferred(0x06); // Preferred interval 7.5-30 ms (1.25 ms units)
+  pAdvertising->setMaxPreferred(0x18);
 
   BLEDevice::startAdvertising();
   advertising = true; // Set advertising flag
@@ -117,15 +132,17 @@ void loop() {
     static unsigned long lastNotifyTime = 0; 
     if (millis() - lastNotifyTime > 5000) {
       
-      // Correctly create the notification message using c_str()
-      std::string notificationMessage = "Notification from ESP32 at ";
-      notificationMessage += String(millis()).c_str(); 
+      // Formatted into a static buffer; no String/std::string per notification
+      static char notificationMessage[48];
+      int len = snprintf(notificationMessage, sizeof(notificationMessage),
+                         "Notification from ESP32 at %lu", millis());
 
       // Set the characteristic value and notify
-      pCharacteristicTX->setValue(notificationMessage);
+      pCharacteristicTX->setValue((uint8_t *)notificationMessage, len);
       pCharacteristicTX->notify();
 
-      Serial.println("Notification sent: " + String(notificationMessage.c_str()));
+      Serial.print("Notification sent: ");
+      Serial.println(notificationMessage);
 
       lastNotifyTime = millis(); 
     }
@@ -16,78 +16,115 @@ BLECharacteristic *pCharacteristicTX = NULL;
 bool deviceConnected = false;
 bool advertising = false; // Add this flag
 
+// Responses are formatted into this static buffer and sent straight from it,
+// so no String temporaries are created per command.
+#define RESPONSE_LEN 32
+char response[RESPONSE_LEN];
+
 // Placeholder functions for spectrophotometer control
-String turnOnRed() {
+const char *turnOnRed() {
   // Replace with code to turn on red LED
   Serial.println("Turning on Red LED");
   return "Red LED ON";
 }
 
-String turnOnGreen() {
+const char *turnOnGreen() {
   // Replace with code to turn on green LED
   Serial.println("Turning on Green LED");
   return "Green LED ON";
 }
 
-String turnOnBlue() {
+const char *turnOnBlue() {
   // Replace with code to turn on blue LED
   Serial.println("Turning on Blue LED");
   return "Blue LED ON";
 }
 
-String setZero() {
+const char *setZero() {
   // Replace with code to set zero
   Serial.println("Setting Zero");
   return "Zero Set";
 }
 
-String takeReading() {
+const char *takeReading() {
   // Replace with code to take a reading
   float absorbance = 0.543; // Placeholder for absorbance value
   Serial.print("Taking Reading. Absorbance: ");
   Serial.println(absorbance);
-  return "d:" + String(absorbance); // Prefix with "d:" to identify data
+  // Two decimals in integer arithmetic; float printf can allocate in newlib
+  long hundredths = lroundf(absorbance * 100.0f);
+  snprintf(response, sizeof(response), "d:%s%ld.%02ld", hundredths < 0 ? "-" : "",
+           labs(hundredths) / 100, labs(hundredths) % 100); // Prefix with "d:" to identify data
+  return response;
+}
+
+enum Command {
+  CMD_UNKNOWN,
+  CMD_TURN_ON_RED,
+  CMD_TURN_ON_GREEN,
+  CMD_TURN_ON_BLUE,
+  CMD_SET_ZERO,
+  CMD_TAKE_READING
+};
+
+struct CommandName {
+  const char *name;
+  Command command;
+};
+
+const CommandName commandNames[] = {
+  {"TURN_ON_RED", CMD_TURN_ON_RED},
+  {"TURN_ON_GREEN", CMD_TURN_ON_GREEN},
+  {"TURN_ON_BLUE", CMD_TURN_ON_BLUE},
+  {"SET_ZERO", CMD_SET_ZERO},
+  {"TAKE_READING", CMD_TAKE_READING}
+};
+
+// Looks the written bytes up in place; getValue() would copy them to the heap.
+Command parseCommand(const char *data, size_t len) {
+  for (const CommandName &entry : commandNames) {
+    if (strlen(entry.name) == len && memcmp(data, entry.name, len) == 0) {
+      return entry.command;
+    }
+  }
+  return CMD_UNKNOWN;
 }
 
 
 // Characteristic Callback: Handles writes to the RX characteristic
 class MyCallbacks : public BLECharacteristicCallbacks {
   void onWrite(BLECharacteristic *pCharacteristic) {
-    std::string rxValue = pCharacteristic->getValue();
-    if (rxValue.length() > 0) {
+    const char *data = (const char *)pCharacteristic->getData();
+    size_t len = pCharacteristic->getLength();
+    if (len > 0) {
       Serial.print("Received Value: ");
-      Serial.println(rxValue.c_str());
-
-      String command = String(rxValue.c_str());
-
-      if (command == "TURN_ON_RED") {
-        String result = turnOnRed();
-        pCharacteristicTX->setValue(result.c_str());
-        pCharacteristicTX->notify();
-        Serial.println(result);
-      } else if (command == "TURN_ON_GREEN") {
-        String result = turnOnGreen();
-        pCharacteristicTX->setValue(result.c_str());
-        pCharacteristicTX->notify();
-        Serial.println(result);
-      } else if (command == "TURN_ON_BLUE") {
-        String result = turnOnBlue();
-        pCharacteristicTX->setValue(result.c_str());
-        pCharacteristicTX->notify();
-        Serial.println(result);
-      } else if (command == "SET_ZERO") {
-        String result = setZero();
-        pCharacteristicTX->setValue(result.c_str());
-        pCharacteristicTX->notify();
-        Serial.println(result);
-      } else if (command == "TAKE_READING") {
-        String result = takeReading();
-        pCharacteristicTX->setValue(result.c_str());
-        pCharacteristicTX->notify();
-        Serial.println(result);
-      } else {
-        Serial.println("Unknown command");
+      Serial.write((const uint8_t *)data, len);
+      Serial.println();
+
+      const char *result;
+      switch (parseCommand(data, len)) {
+        case CMD_TURN_ON_RED:
+          result = turnOnRed();
+          break;
+        case CMD_TURN_ON_GREEN:
+          result = turnOnGreen();
+          break;
+        case CMD_TURN_ON_BLUE:
+          result = turnOnBlue();
+          break;
+        case CMD_SET_ZERO:
+          result = setZero();
+          break;
+        case CMD_TAKE_READING:
+          result = takeReading();
+          break;
+        default:
+          Serial.println("Unknown command");
+          return;
       }
+      pCharacteristicTX->setValue((uint8_t *)result, strlen(result));
+      pCharacteristicTX->notify();
+      Serial.println(result);
     }
   }
 };
@@ -124,8 +161,8 @@ void setup() {
   BLEAdvertising *pAdvertising = pServer->getAdvertising(); // Use pServer, not BLEDevice
   pAdvertising->addServiceUUID(BLEUUID(SERVICE_UUID));
   pAdvertising->setScanResponse(false); // Keep advertising simple
-  pAdvertising->setMinPreferred(0x0);     // Allow any connection interval
-  pAdvertising->setMaxPreferred(0x0);
+  pAdvertising->setMinPreferred(0x06); // Preferred interval 7.5-30 ms (1.25 ms units)
+  pAdvertising->setMaxPreferred(0x18);
 
   BLEDevice::startAdvertising();
   advertising = true; // Set advertising flag
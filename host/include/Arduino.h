@@ -0,0 +1,108 @@
+// Host stand-in for the ESP32 Arduino core: the subset ESPectro32.cpp uses.
+// Time is the simulator's virtual clock (sim/freertos.cpp), LED pins are
+// recorded for the simulated sensor, and Serial goes to stdout when
+// sim::serialEcho is set.
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+typedef uint8_t byte;
+
+#define DEC 10
+#define HEX 16
+#define BIN 2
+#define LOW 0
+#define HIGH 1
+#define INPUT 0x01
+#define OUTPUT 0x03
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+bool ledcAttach(uint8_t pin, uint32_t freq, uint8_t resolution);
+bool ledcWrite(uint8_t pin, uint32_t duty);
+
+uint32_t esp_get_free_heap_size();
+uint32_t esp_get_minimum_free_heap_size();
+
+class String
+{
+public:
+  String(const char *text = "") : s_(text != nullptr ? text : "") {}
+  String(const std::string &text) : s_(text) {}
+  const char *c_str() const { return s_.c_str(); }
+  unsigned int length() const { return s_.length(); }
+  bool operator==(const char *text) const { return s_ == text; }
+  String &operator+=(const char *text)
+  {
+    s_ += text;
+    return *this;
+  }
+
+private:
+  std::string s_;
+};
+
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) { return write(&c, 1); }
+  virtual size_t write(const uint8_t *buffer, size_t size) = 0;
+
+  size_t print(const char *text) { return write((const uint8_t *)text, strlen(text)); }
+  size_t print(const String &text) { return print(text.c_str()); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned char value, int base = DEC) { return printNumber(value, base); }
+  size_t print(int value, int base = DEC) { return printSigned(value, base); }
+  size_t print(unsigned int value, int base = DEC) { return printNumber(value, base); }
+  size_t print(long value, int base = DEC) { return printSigned(value, base); }
+  size_t print(unsigned long value, int base = DEC) { return printNumber(value, base); }
+  size_t print(long long value, int base = DEC) { return printSigned(value, base); }
+  size_t print(unsigned long long value, int base = DEC) { return printNumber(value, base); }
+  size_t print(double value, int digits = 2);
+
+  template <typename T>
+  size_t println(T value)
+  {
+    size_t n = print(value);
+    return n + println();
+  }
+  template <typename T>
+  size_t println(T value, int format)
+  {
+    size_t n = print(value, format);
+    return n + println();
+  }
+  size_t println() { return print("\r\n"); }
+
+private:
+  size_t printNumber(unsigned long long value, int base);
+  size_t printSigned(long long value, int base);
+};
+
+class HardwareSerial : public Print
+{
+public:
+  void begin(unsigned long baud) { (void)baud; }
+  using Print::write;
+  size_t write(const uint8_t *buffer, size_t size) override;
+};
+
+extern HardwareSerial Serial;
@@ -0,0 +1,3 @@
+// Host stand-in: the library splits these declarations across headers; BLEDevice.h has them all.
+#pragma once
+#include <BLEDevice.h>
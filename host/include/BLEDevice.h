@@ -0,0 +1,152 @@
+// Host stand-in for the Arduino BLE (Bluedroid) library: one server, its
+// services, characteristics and descriptors, plus the custom GAP/GATTS
+// handler hooks. Simulated centrals (sim::BleClient) drive it through the
+// same event order as the library: its own handling first, then the
+// custom handler.
+#pragma once
+#include <Arduino.h>
+#include <esp_gap_ble_api.h>
+#include <esp_gatts_api.h>
+#include <vector>
+
+class BLEServer;
+class BLECharacteristic;
+
+class BLEUUID
+{
+public:
+  BLEUUID() {}
+  BLEUUID(const char *uuid) : text_(uuid) {}
+  BLEUUID(uint16_t uuid16);
+  const std::string &toString() const { return text_; }
+  bool operator==(const BLEUUID &other) const { return text_ == other.text_; }
+
+private:
+  std::string text_;
+};
+
+class BLEDescriptor
+{
+public:
+  explicit BLEDescriptor(BLEUUID uuid);
+  BLEUUID getUUID() const { return uuid_; }
+  uint16_t getHandle() const { return handle_; }
+
+private:
+  friend class BLECharacteristic;
+  BLEUUID uuid_;
+  uint16_t handle_ = 0;
+};
+
+class BLECharacteristicCallbacks
+{
+public:
+  virtual ~BLECharacteristicCallbacks() {}
+  virtual void onWrite(BLECharacteristic *characteristic) { (void)characteristic; }
+};
+
+class BLECharacteristic
+{
+public:
+  static const uint32_t PROPERTY_READ = 1 << 0;
+  static const uint32_t PROPERTY_WRITE = 1 << 1;
+  static const uint32_t PROPERTY_NOTIFY = 1 << 2;
+  static const uint32_t PROPERTY_BROADCAST = 1 << 3;
+  static const uint32_t PROPERTY_INDICATE = 1 << 4;
+  static const uint32_t PROPERTY_WRITE_NR = 1 << 5;
+
+  BLECharacteristic(BLEUUID uuid, uint32_t properties);
+  void addDescriptor(BLEDescriptor *descriptor);
+  void setCallbacks(BLECharacteristicCallbacks *callbacks) { callbacks_ = callbacks; }
+  BLECharacteristicCallbacks *getCallbacks() const { return callbacks_; }
+  BLEUUID getUUID() const { return uuid_; }
+  uint32_t getProperties() const { return properties_; }
+  uint16_t getHandle() const { return handle_; }
+  uint8_t *getData() { return (uint8_t *)value_.data(); }
+  size_t getLength() const { return value_.size(); }
+  String getValue() const { return String(value_); }
+  void setValue(const uint8_t *data, size_t len) { value_.assign((const char *)data, len); }
+  void setValue(const String &value) { value_ = value.c_str(); }
+  const std::vector<BLEDescriptor *> &descriptors() const { return descriptors_; }
+
+private:
+  BLEUUID uuid_;
+  uint32_t properties_;
+  uint16_t handle_;
+  std::string value_;
+  BLECharacteristicCallbacks *callbacks_ = nullptr;
+  std::vector<BLEDescriptor *> descriptors_;
+};
+
+class BLEService
+{
+public:
+  explicit BLEService(BLEUUID uuid) : uuid_(uuid) {}
+  BLECharacteristic *createCharacteristic(const char *uuid, uint32_t properties);
+  void start() { started_ = true; }
+  bool started() const { return started_; }
+  const std::vector<BLECharacteristic *> &characteristics() const { return characteristics_; }
+
+private:
+  BLEUUID uuid_;
+  bool started_ = false;
+  std::vector<BLECharacteristic *> characteristics_;
+};
+
+class BLEServerCallbacks
+{
+public:
+  virtual ~BLEServerCallbacks() {}
+  virtual void onConnect(BLEServer *server) { (void)server; }
+  virtual void onDisconnect(BLEServer *server) { (void)server; }
+  virtual void onMtuChanged(BLEServer *server, esp_ble_gatts_cb_param_t *param)
+  {
+    (void)server;
+    (void)param;
+  }
+};
+
+class BLEServer
+{
+public:
+  BLEService *createService(const char *uuid);
+  void setCallbacks(BLEServerCallbacks *callbacks) { callbacks_ = callbacks; }
+  BLEServerCallbacks *getCallbacks() const { return callbacks_; }
+  uint32_t getConnectedCount() const { return connectedCount_; }
+  void startAdvertising();
+  const std::vector<BLEService *> &services() const { return services_; }
+
+private:
+  friend struct SimBle;
+  BLEServerCallbacks *callbacks_ = nullptr;
+  uint32_t connectedCount_ = 0;
+  std::vector<BLEService *> services_;
+};
+
+class BLEAdvertising
+{
+public:
+  void addServiceUUID(const char *uuid) { (void)uuid; }
+  void setScanResponse(bool enable) { (void)enable; }
+  void setMinPreferred(uint16_t interval) { (void)interval; }
+  void setMaxPreferred(uint16_t interval) { (void)interval; }
+  void start();
+  void stop();
+};
+
+typedef void (*gatts_event_handler)(esp_gatts_cb_event_t event, esp_gatt_if_t gattsIf, esp_ble_gatts_cb_param_t *param);
+typedef void (*gap_event_handler)(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param);
+
+class BLEDevice
+{
+public:
+  static void init(String deviceName);
+  static esp_err_t setMTU(uint16_t mtu);
+  static uint16_t getMTU();
+  static BLEServer *createServer();
+  static BLEAdvertising *getAdvertising();
+  static void startAdvertising();
+  static void stopAdvertising();
+  static void setCustomGattsHandler(gatts_event_handler handler);
+  static void setCustomGapHandler(gap_event_handler handler);
+};
@@ -0,0 +1,61 @@
+// Host stand-in for the Arduino FS layer: paths map onto a directory on
+// the host (sim::fsRoot()), one file per flash file.
+#pragma once
+#include <Arduino.h>
+#include <memory>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+namespace fs
+{
+
+enum SeekMode
+{
+  SeekSet = 0,
+  SeekCur = 1,
+  SeekEnd = 2
+};
+
+struct FileImpl;
+
+class File
+{
+public:
+  File() {}
+  explicit File(std::shared_ptr<FileImpl> impl) : impl_(impl) {}
+  explicit operator bool() const;
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t write(const uint8_t *buf, size_t size);
+  size_t read(uint8_t *buf, size_t size);
+  int read();
+  bool seek(uint32_t pos, SeekMode mode = SeekSet);
+  size_t position() const;
+  size_t size() const;
+  void flush();
+  void close();
+  const char *name() const;
+  const char *path() const;
+  bool isDirectory() const;
+  File openNextFile(const char *mode = FILE_READ);
+
+private:
+  std::shared_ptr<FileImpl> impl_;
+};
+
+class FS
+{
+public:
+  File open(const char *path, const char *mode = FILE_READ, bool create = false);
+  bool exists(const char *path);
+  bool remove(const char *path);
+  bool rename(const char *from, const char *to);
+  bool mkdir(const char *path);
+  bool rmdir(const char *path);
+};
+
+} // namespace fs
+
+using fs::File;
+using fs::FS;
@@ -0,0 +1,23 @@
+// Host stand-in for the LittleFS partition, mounted at /littlefs. Its size
+// matches the default 1.4 MB partition, so the log's space checks behave
+// as on the device.
+#pragma once
+#include <FS.h>
+
+namespace fs
+{
+
+class LittleFSFS : public FS
+{
+public:
+  bool begin(bool formatOnFail = false, const char *basePath = "/littlefs", uint8_t maxOpenFiles = 10,
+             const char *partitionLabel = "spiffs");
+  void end();
+  bool format();
+  size_t totalBytes();
+  size_t usedBytes();
+};
+
+} // namespace fs
+
+extern fs::LittleFSFS LittleFS;
@@ -0,0 +1,25 @@
+// Host stand-in for NVS-backed Preferences. Namespaces live in process
+// memory, so they survive a simulated reboot (sim::reboot) but not the
+// process; sim::nvsErase() starts from blank flash.
+#pragma once
+#include <Arduino.h>
+
+class Preferences
+{
+public:
+  bool begin(const char *name, bool readOnly = false);
+  void end();
+  bool clear();
+  bool remove(const char *key);
+  bool isKey(const char *key);
+  uint32_t getUInt(const char *key, uint32_t defaultValue = 0);
+  size_t putUInt(const char *key, uint32_t value);
+  size_t getBytesLength(const char *key);
+  size_t getBytes(const char *key, void *buf, size_t maxLen);
+  size_t putBytes(const char *key, const void *value, size_t len);
+
+private:
+  std::string namespace_;
+  bool open_ = false;
+  bool readOnly_ = false;
+};
@@ -0,0 +1,35 @@
+// Host stand-in for the Arduino I2C master. Transactions go to the device
+// attached at the address (sim::i2cAttach); an empty address NAKs.
+#pragma once
+#include <Arduino.h>
+
+#define I2C_BUFFER_LENGTH 128
+
+class TwoWire
+{
+public:
+  bool begin() { return true; }
+  bool setClock(uint32_t hz);
+  uint32_t getClock() const { return clockHz_; }
+  void beginTransmission(uint8_t address);
+  size_t write(uint8_t data);
+  size_t write(const uint8_t *data, size_t len);
+  uint8_t endTransmission(bool sendStop = true);
+  uint8_t requestFrom(uint8_t address, uint8_t len) { return requestFrom(address, (size_t)len, true); }
+  uint8_t requestFrom(int address, int len) { return requestFrom((uint8_t)address, (size_t)len, true); }
+  uint8_t requestFrom(uint8_t address, size_t len, bool sendStop);
+  int available() { return rxLen_ - rxPos_; }
+  int read() { return rxPos_ < rxLen_ ? rxBuf_[rxPos_++] : -1; }
+  int peek() { return rxPos_ < rxLen_ ? rxBuf_[rxPos_] : -1; }
+
+private:
+  uint32_t clockHz_ = 100000;
+  uint8_t address_ = 0;
+  uint8_t txBuf_[I2C_BUFFER_LENGTH];
+  size_t txLen_ = 0;
+  uint8_t rxBuf_[I2C_BUFFER_LENGTH];
+  int rxLen_ = 0;
+  int rxPos_ = 0;
+};
+
+extern TwoWire Wire;
@@ -0,0 +1,17 @@
+// Host stand-in: Bluedroid's shared Bluetooth types.
+#pragma once
+#include <stdint.h>
+#include <sdkconfig.h>
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+#define ESP_BD_ADDR_LEN 6
+typedef uint8_t esp_bd_addr_t[ESP_BD_ADDR_LEN];
+
+typedef enum
+{
+  ESP_BT_STATUS_SUCCESS = 0,
+  ESP_BT_STATUS_FAIL,
+} esp_bt_status_t;
@@ -0,0 +1,77 @@
+// Host stand-in: the GAP calls and events ESPectro32.cpp uses. As in
+// ESP-IDF, the PHY API only exists on BLE 5 controllers.
+#pragma once
+#include <esp_bt_defs.h>
+
+typedef enum
+{
+  ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT = 20,
+  ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT = 21,
+#if CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+  ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT = 56,
+#endif
+} esp_gap_ble_cb_event_t;
+
+typedef struct
+{
+  esp_bd_addr_t bda;
+  uint16_t min_int;
+  uint16_t max_int;
+  uint16_t latency;
+  uint16_t timeout;
+} esp_ble_conn_update_params_t;
+
+typedef struct
+{
+  uint16_t rx_len;
+  uint16_t tx_len;
+} esp_ble_pkt_data_length_params_t;
+
+typedef union
+{
+  struct
+  {
+    esp_bt_status_t status;
+    esp_bd_addr_t bda;
+    uint16_t min_int;
+    uint16_t max_int;
+    uint16_t latency;
+    uint16_t conn_int;
+    uint16_t timeout;
+  } update_conn_params;
+  struct
+  {
+    esp_bt_status_t status;
+    esp_ble_pkt_data_length_params_t params;
+    esp_bd_addr_t remote_bda;
+  } pkt_data_length_cmpl;
+#if CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+  struct
+  {
+    esp_bt_status_t status;
+    esp_bd_addr_t remote_bda;
+    uint8_t tx_phy;
+    uint8_t rx_phy;
+  } phy_update;
+#endif
+} esp_ble_gap_cb_param_t;
+
+esp_err_t esp_ble_gap_update_conn_params(esp_ble_conn_update_params_t *params);
+esp_err_t esp_ble_gap_set_pkt_data_len(esp_bd_addr_t remoteDevice, uint16_t txDataLength);
+
+#if CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+typedef uint8_t esp_ble_gap_phy_t;
+#define ESP_BLE_GAP_PHY_1M 1
+#define ESP_BLE_GAP_PHY_2M 2
+#define ESP_BLE_GAP_PHY_CODED 3
+typedef uint8_t esp_ble_gap_phy_mask_t;
+#define ESP_BLE_GAP_PHY_1M_PREF_MASK (1 << 0)
+#define ESP_BLE_GAP_PHY_2M_PREF_MASK (1 << 1)
+#define ESP_BLE_GAP_PHY_CODED_PREF_MASK (1 << 2)
+typedef uint16_t esp_ble_gap_prefer_phy_options_t;
+#define ESP_BLE_GAP_PHY_OPTIONS_NO_PREF 0
+
+esp_err_t esp_ble_gap_set_preferred_phy(esp_bd_addr_t bdAddr, esp_ble_gap_phy_mask_t allPhysMask,
+                                        esp_ble_gap_phy_mask_t txPhyMask, esp_ble_gap_phy_mask_t rxPhyMask,
+                                        esp_ble_gap_prefer_phy_options_t phyOptions);
+#endif
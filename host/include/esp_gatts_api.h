@@ -0,0 +1,64 @@
+// Host stand-in: the GATT server events ESPectro32.cpp handles and the
+// notification call. Notifications are delivered to the simulated clients.
+#pragma once
+#include <esp_bt_defs.h>
+
+typedef uint8_t esp_gatt_if_t;
+
+typedef enum
+{
+  ESP_GATTS_WRITE_EVT = 2,
+  ESP_GATTS_MTU_EVT = 4,
+  ESP_GATTS_CONNECT_EVT = 14,
+  ESP_GATTS_DISCONNECT_EVT = 15,
+  ESP_GATTS_CONGEST_EVT = 24,
+} esp_gatts_cb_event_t;
+
+typedef struct
+{
+  uint16_t interval;
+  uint16_t latency;
+  uint16_t timeout;
+} esp_gatt_conn_params_t;
+
+typedef union
+{
+  struct
+  {
+    uint16_t conn_id;
+    uint32_t trans_id;
+    esp_bd_addr_t bda;
+    uint16_t handle;
+    uint16_t offset;
+    bool need_rsp;
+    bool is_prep;
+    uint16_t len;
+    uint8_t *value;
+  } write;
+  struct
+  {
+    uint16_t conn_id;
+    uint16_t mtu;
+  } mtu;
+  struct
+  {
+    uint16_t conn_id;
+    uint8_t link_role;
+    esp_bd_addr_t remote_bda;
+    esp_gatt_conn_params_t conn_params;
+  } connect;
+  struct
+  {
+    uint16_t conn_id;
+    esp_bd_addr_t remote_bda;
+    int reason;
+  } disconnect;
+  struct
+  {
+    uint16_t conn_id;
+    bool congested;
+  } congest;
+} esp_ble_gatts_cb_param_t;
+
+esp_err_t esp_ble_gatts_send_indicate(esp_gatt_if_t gattsIf, uint16_t connId, uint16_t attrHandle,
+                                      uint16_t valueLen, uint8_t *value, bool needConfirm);
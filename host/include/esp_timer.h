@@ -0,0 +1,5 @@
+// Host stand-in: microseconds on the simulator's virtual clock.
+#pragma once
+#include <stdint.h>
+
+int64_t esp_timer_get_time();
@@ -0,0 +1,10 @@
+// Host stand-in: mutexes (sim/freertos.cpp).
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+typedef struct SimMutex *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex();
+void vSemaphoreDelete(SemaphoreHandle_t mutex);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t mutex, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t mutex);
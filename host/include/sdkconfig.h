@@ -0,0 +1,9 @@
+// Host stand-in for the ESP-IDF build configuration of the target board,
+// an original ESP32 (Bluetooth 4.2 controller). Build with
+// -DCONFIG_BT_BLE_50_FEATURES_SUPPORTED=1 to model a BLE 5 chip instead.
+#pragma once
+
+#define CONFIG_BT_ENABLED 1
+#define CONFIG_BT_BLUEDROID_ENABLED 1
+#define CONFIG_BT_ACL_CONNECTIONS 4
+// CONFIG_BT_BLE_50_FEATURES_SUPPORTED is left undefined, as for the ESP32
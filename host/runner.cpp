@@ -0,0 +1,92 @@
+// Runs the firmware on the simulator with one client connected. Each line
+// on stdin is written to the RX characteristic and the simulation then
+// runs for the settle time; "wait <ms>" only lets time pass. Text
+// notifications are printed as they arrive, frames as type, count and
+// length, all stamped with the virtual time in ms.
+//
+//   build/espectro32-sim [-a absorbance] [-m mtu] [-s settle_ms] [-v] < commands
+#include <Arduino.h>
+#include "sim.h"
+#include <unistd.h>
+
+void setup();
+
+namespace
+{
+
+void printReceived(sim::BleClient &client)
+{
+  sim::Notification notification;
+  while (client.taken < client.received.size())
+  {
+    notification = client.received[client.taken++];
+    printf("%10.3f  ", notification.atUs / 1000.0);
+    if (notification.isFrame() && notification.data.size() >= 4)
+      printf("frame type=%u count=%u len=%zu\n", notification.data[2], notification.data[3], notification.data.size());
+    else
+      printf("%s\n", notification.text().c_str());
+  }
+}
+
+// Runs for ms, printing what arrives as it arrives.
+void runFor(sim::BleClient &client, uint32_t ms)
+{
+  for (uint32_t waited = 0; waited < ms; waited += 10)
+  {
+    sim::run(10);
+    printReceived(client);
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+  uint16_t mtu = 247;
+  uint32_t settleMs = 2000;
+  int opt;
+  while ((opt = getopt(argc, argv, "a:m:s:v")) != -1)
+  {
+    switch (opt)
+    {
+    case 'a':
+      for (float &absorbance : sim::apds9930().absorbance)
+        absorbance = strtof(optarg, nullptr);
+      break;
+    case 'm':
+      mtu = (uint16_t)atoi(optarg);
+      break;
+    case 's':
+      settleMs = (uint32_t)atoi(optarg);
+      break;
+    case 'v':
+      sim::serialEcho = true;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-a absorbance] [-m mtu] [-s settle_ms] [-v] < commands\n", argv[0]);
+      return 2;
+    }
+  }
+
+  setup();
+  sim::BleClient client(mtu);
+  client.connect();
+  runFor(client, 500);
+
+  char line[256];
+  while (fgets(line, sizeof(line), stdin) != nullptr)
+  {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#')
+      continue;
+    if (strncmp(line, "wait ", 5) == 0)
+    {
+      runFor(client, (uint32_t)atoi(line + 5));
+      continue;
+    }
+    printf("%10.3f> %s\n", sim::nowUs() / 1000.0, line);
+    client.write(line);
+    runFor(client, settleMs);
+  }
+  sim::exit(0);
+}
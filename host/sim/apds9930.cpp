@@ -0,0 +1,184 @@
+// The simulated APDS-9930 (see sim.h for what it models).
+#include "sim.h"
+
+#define APDS_ENABLE 0x00
+#define APDS_ATIME 0x01
+#define APDS_PTIME 0x02
+#define APDS_WTIME 0x03
+#define APDS_PERS 0x0C
+#define APDS_CONTROL 0x0F
+#define APDS_ID 0x12
+#define APDS_STATUS 0x13
+#define APDS_CH0DATAL 0x14
+#define APDS_PDATAH 0x19
+#define APDS_PON 0x01
+#define APDS_AEN 0x02
+#define APDS_AIEN 0x10
+#define APDS_AVALID 0x01
+#define APDS_AINT 0x10
+#define APDS_PINT 0x20
+#define APDS_CMD 0x80
+#define APDS_TYPE_REPEATED 0
+#define APDS_TYPE_AUTO_INCREMENT 1
+#define APDS_TYPE_SPECIAL 3
+#define APDS_CLEAR_PINT 0x05
+#define APDS_CLEAR_AINT 0x06
+#define APDS_CLEAR_BOTH 0x07
+#define APDS_PERIOD_US 2730
+
+namespace
+{
+
+const uint8_t gainFactor[4] = {1, 8, 16, 120};
+
+struct Attach
+{
+  Attach()
+  {
+    sim::i2cAttach(0x39, &sim::apds9930());
+    sim::ledChanging = [] { sim::apds9930().update(); };
+  }
+} attach;
+
+} // namespace
+
+namespace sim
+{
+
+Apds9930 &apds9930()
+{
+  static Apds9930 sensor;
+  return sensor;
+}
+
+Apds9930::Apds9930() : rng_(1)
+{
+  memset(regs_, 0, sizeof(regs_));
+  regs_[APDS_ATIME] = 0xFF;
+  regs_[APDS_PTIME] = 0xFF;
+  regs_[APDS_WTIME] = 0xFF;
+}
+
+// Counts per period at 1x gain on each channel, from what is lit now.
+void Apds9930::lightRate(float &ch0, float &ch1) const
+{
+  ch0 = ambientPerPeriod;
+  ch1 = ambientPerPeriod * 0.5f;
+  for (const Led &led : leds)
+  {
+    float duty = (float)ledDuty(led.pin) / ledDutyMax(led.pin);
+    float flux = led.countsPerPeriod * duty * powf(10.0f, -absorbance[&led - leds]);
+    ch0 += flux;
+    ch1 += flux * led.ch1Fraction;
+  }
+}
+
+void Apds9930::update()
+{
+  uint64_t now = nowUs();
+  while (integrating_)
+  {
+    uint64_t end = cycleStartUs_ + (uint64_t)cyclePeriods_ * APDS_PERIOD_US;
+    uint64_t until = now < end ? now : end;
+    if (until > lastUs_)
+    {
+      float rate0, rate1;
+      lightRate(rate0, rate1);
+      double periods = (double)(until - lastUs_) / APDS_PERIOD_US;
+      ch0Periods_ += rate0 * periods;
+      ch1Periods_ += rate1 * periods;
+      lastUs_ = until;
+    }
+    if (now < end)
+      break;
+    finishCycle();
+    cycleStartUs_ = end;
+    cyclePeriods_ = 256 - regs_[APDS_ATIME];
+  }
+}
+
+void Apds9930::finishCycle()
+{
+  float gain = gainFactor[regs_[APDS_CONTROL] & 0x03];
+  float fullScale = 1024.0f * cyclePeriods_ < 65535.0f ? 1024.0f * cyclePeriods_ : 65535.0f;
+  double mean[2] = {(ch0Periods_ + darkPerPeriod * cyclePeriods_) * gain,
+                    (ch1Periods_ + darkPerPeriod * cyclePeriods_) * gain};
+  for (uint8_t ch = 0; ch < 2; ch++)
+  {
+    std::normal_distribution<double> shot(0.0, sqrt(mean[ch]) * noise);
+    double counts = mean[ch] + (noise > 0.0f ? shot(rng_) : 0.0);
+    counts = counts < 0.0 ? 0.0 : counts > fullScale ? fullScale : counts;
+    uint16_t value = (uint16_t)lround(counts);
+    regs_[APDS_CH0DATAL + 2 * ch] = value & 0xFF;
+    regs_[APDS_CH0DATAL + 2 * ch + 1] = value >> 8;
+  }
+  regs_[APDS_STATUS] |= APDS_AVALID;
+  if ((regs_[APDS_ENABLE] & APDS_AIEN) && (regs_[APDS_PERS] & 0x0F) == 0)
+    regs_[APDS_STATUS] |= APDS_AINT;
+  ch0Periods_ = 0;
+  ch1Periods_ = 0;
+  cycles++;
+}
+
+bool Apds9930::write(const uint8_t *data, size_t len)
+{
+  if (len == 0)
+    return true; // Address probe
+  uint8_t command = data[0];
+  if (!(command & APDS_CMD))
+    return false;
+  update();
+  uint8_t type = (command >> 5) & 0x03;
+  uint8_t address = command & 0x1F;
+  if (type == APDS_TYPE_SPECIAL)
+  {
+    if (address == APDS_CLEAR_PINT || address == APDS_CLEAR_BOTH)
+      regs_[APDS_STATUS] &= ~APDS_PINT;
+    if (address == APDS_CLEAR_AINT || address == APDS_CLEAR_BOTH)
+      regs_[APDS_STATUS] &= ~APDS_AINT;
+    return len == 1;
+  }
+  if (type != APDS_TYPE_REPEATED && type != APDS_TYPE_AUTO_INCREMENT)
+    return false;
+  pointer_ = address;
+  autoIncrement_ = type == APDS_TYPE_AUTO_INCREMENT;
+  for (size_t i = 1; i < len; i++)
+  {
+    if (pointer_ < APDS_ID || pointer_ > APDS_PDATAH)
+    {
+      regs_[pointer_] = data[i];
+      if (pointer_ == APDS_ENABLE)
+      {
+        bool on = (data[i] & APDS_PON) && (data[i] & APDS_AEN);
+        if (on && !integrating_)
+        {
+          cycleStartUs_ = nowUs();
+          lastUs_ = cycleStartUs_;
+          cyclePeriods_ = 256 - regs_[APDS_ATIME];
+          ch0Periods_ = 0;
+          ch1Periods_ = 0;
+        }
+        integrating_ = on;
+      }
+    }
+    if (autoIncrement_)
+      pointer_ = (pointer_ + 1) & 0x1F;
+  }
+  return true;
+}
+
+size_t Apds9930::read(uint8_t *data, size_t len)
+{
+  update();
+  if (pointer_ == APDS_CH0DATAL)
+    channelReads++;
+  for (size_t i = 0; i < len; i++)
+  {
+    data[i] = pointer_ == APDS_ID ? id : regs_[pointer_];
+    if (autoIncrement_)
+      pointer_ = (pointer_ + 1) & 0x1F;
+  }
+  return len;
+}
+
+} // namespace sim
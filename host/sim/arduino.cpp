@@ -0,0 +1,160 @@
+// Serial, GPIO, LEDC and heap figures of the Arduino core.
+#include <Arduino.h>
+#include <esp_heap_caps.h>
+#include "sim.h"
+
+#define SIM_PIN_COUNT 40
+
+HardwareSerial Serial;
+
+namespace
+{
+
+struct Pin
+{
+  uint8_t level;
+  bool pwm;
+  uint8_t resolution;
+  uint32_t duty;
+};
+
+Pin pins[SIM_PIN_COUNT];
+
+} // namespace
+
+namespace sim
+{
+
+bool serialEcho = false;
+void (*ledChanging)() = nullptr;
+// A fresh ESP32 running a BLE server
+size_t heapFree = 180000;
+size_t heapMinFree = 170000;
+size_t heapLargestBlock = 110000;
+
+uint32_t ledDuty(uint8_t pin)
+{
+  if (pin >= SIM_PIN_COUNT)
+    return 0;
+  if (!pins[pin].pwm)
+    return pins[pin].level ? 1 : 0;
+  return pins[pin].duty;
+}
+
+uint32_t ledDutyMax(uint8_t pin)
+{
+  if (pin >= SIM_PIN_COUNT || !pins[pin].pwm)
+    return 1;
+  return (1UL << pins[pin].resolution) - 1;
+}
+
+} // namespace sim
+
+size_t Print::print(double value, int digits)
+{
+  char text[48];
+  int n = snprintf(text, sizeof(text), "%.*f", digits, value);
+  return write((const uint8_t *)text, n < (int)sizeof(text) ? n : sizeof(text) - 1);
+}
+
+size_t Print::printNumber(unsigned long long value, int base)
+{
+  char text[65];
+  char *p = text + sizeof(text);
+  if (base < 2)
+    base = DEC;
+  do
+  {
+    int digit = value % base;
+    *--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    value /= base;
+  } while (value > 0);
+  return write((const uint8_t *)p, text + sizeof(text) - p);
+}
+
+size_t Print::printSigned(long long value, int base)
+{
+  if (base != DEC || value >= 0)
+    return printNumber((unsigned long long)value, base);
+  return print('-') + printNumber(0ULL - (unsigned long long)value, base);
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+  if (sim::serialEcho)
+    fwrite(buffer, 1, size, stdout);
+  return size;
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+  (void)pin;
+  (void)mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+  if (pin >= SIM_PIN_COUNT)
+    return;
+  if (sim::ledChanging != nullptr)
+    sim::ledChanging();
+  pins[pin].level = value ? HIGH : LOW;
+}
+
+int digitalRead(uint8_t pin)
+{
+  return pin < SIM_PIN_COUNT ? pins[pin].level : LOW;
+}
+
+bool ledcAttach(uint8_t pin, uint32_t freq, uint8_t resolution)
+{
+  (void)freq;
+  if (pin >= SIM_PIN_COUNT || resolution == 0 || resolution > 20)
+    return false;
+  pins[pin].pwm = true;
+  pins[pin].resolution = resolution;
+  pins[pin].duty = 0;
+  return true;
+}
+
+bool ledcWrite(uint8_t pin, uint32_t duty)
+{
+  if (pin >= SIM_PIN_COUNT || !pins[pin].pwm)
+    return false;
+  if (sim::ledChanging != nullptr)
+    sim::ledChanging();
+  pins[pin].duty = duty;
+  return true;
+}
+
+uint32_t esp_get_free_heap_size()
+{
+  return sim::heapFree;
+}
+
+uint32_t esp_get_minimum_free_heap_size()
+{
+  return sim::heapMinFree;
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+  if (caps & MALLOC_CAP_SPIRAM)
+    return nullptr;
+  return malloc(size);
+}
+
+void heap_caps_free(void *ptr)
+{
+  free(ptr);
+}
+
+size_t heap_caps_get_free_size(uint32_t caps)
+{
+  return caps & MALLOC_CAP_SPIRAM ? 0 : sim::heapFree;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps)
+{
+  return caps & MALLOC_CAP_SPIRAM ? 0 : sim::heapLargestBlock;
+}
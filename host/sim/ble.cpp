@@ -0,0 +1,487 @@
+// The BLE library and Bluedroid, as far as the instrument uses them, and
+// the simulated centrals. Client actions and link events are queued to a
+// "btc" task, which, like the library, runs the server and characteristic
+// callbacks first and the custom GATTS/GAP handler after them.
+#include <BLEDevice.h>
+#include "sim.h"
+
+#define SIM_BLE_QUEUE_LENGTH 16
+#define SIM_BLE_VALUE_MAX 512
+#define SIM_BLE_GATTS_IF 3
+#define SIM_BLE_PREFERRED_INTERVAL 12 // 15 ms, what phones tend to grant
+
+namespace
+{
+
+enum SimBleOp : uint8_t
+{
+  OP_CONNECT,
+  OP_MTU,
+  OP_CCCD,
+  OP_WRITE,
+  OP_CONGEST,
+  OP_DISCONNECT,
+  OP_GRANT_CONN_PARAMS,
+  OP_GRANT_DATA_LEN,
+  OP_GRANT_PHY
+};
+
+struct SimBleEvent
+{
+  sim::BleClient *client;
+  uint8_t op;
+  uint16_t a;
+  uint16_t b;
+  uint16_t c;
+  uint16_t len;
+  uint8_t value[SIM_BLE_VALUE_MAX];
+};
+
+} // namespace
+
+struct SimBle
+{
+  BLEServer *server = nullptr;
+  BLEAdvertising advertising;
+  bool advertisingOn = false;
+  uint16_t localMtu = 23;
+  uint16_t nextHandle = 40;
+  gatts_event_handler gattsHandler = nullptr;
+  gap_event_handler gapHandler = nullptr;
+  QueueHandle_t queue = nullptr;
+  std::vector<sim::BleClient *> clients;
+
+  void post(sim::BleClient *client, uint8_t op, uint16_t a = 0, uint16_t b = 0, uint16_t c = 0,
+            const uint8_t *value = nullptr, size_t len = 0)
+  {
+    if (queue == nullptr)
+    {
+      fprintf(stderr, "sim: BLE used before BLEDevice::init()\n");
+      abort();
+    }
+    static SimBleEvent event; // Only the running task posts
+    event.client = client;
+    event.op = op;
+    event.a = a;
+    event.b = b;
+    event.c = c;
+    event.len = len < SIM_BLE_VALUE_MAX ? len : SIM_BLE_VALUE_MAX;
+    if (value != nullptr)
+      memcpy(event.value, value, event.len);
+    xQueueSend(queue, &event, portMAX_DELAY);
+  }
+
+  sim::BleClient *clientFor(const uint8_t *bda)
+  {
+    for (sim::BleClient *client : clients)
+      if (client->connected && memcmp(client->bda, bda, ESP_BD_ADDR_LEN) == 0)
+        return client;
+    return nullptr;
+  }
+
+  BLECharacteristic *findCharacteristic(uint32_t properties)
+  {
+    if (server == nullptr)
+      return nullptr;
+    for (BLEService *service : server->services())
+      for (BLECharacteristic *characteristic : service->characteristics())
+        if (characteristic->getProperties() & properties)
+          return characteristic;
+    return nullptr;
+  }
+
+  uint16_t cccdHandle()
+  {
+    BLECharacteristic *characteristic = findCharacteristic(BLECharacteristic::PROPERTY_NOTIFY |
+                                                           BLECharacteristic::PROPERTY_INDICATE);
+    if (characteristic == nullptr)
+      return 0;
+    for (BLEDescriptor *descriptor : characteristic->descriptors())
+      if (descriptor->getUUID() == BLEUUID((uint16_t)0x2902))
+        return descriptor->getHandle();
+    return 0;
+  }
+
+  void gatts(esp_gatts_cb_event_t event, esp_ble_gatts_cb_param_t &param)
+  {
+    if (gattsHandler != nullptr)
+      gattsHandler(event, SIM_BLE_GATTS_IF, &param);
+  }
+
+  void gap(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t &param)
+  {
+    if (gapHandler != nullptr)
+      gapHandler(event, &param);
+  }
+
+  void handle(SimBleEvent &event);
+};
+
+namespace
+{
+
+SimBle ble;
+
+void btcTask(void *param)
+{
+  (void)param;
+  static SimBleEvent event;
+  for (;;)
+  {
+    if (xQueueReceive(ble.queue, &event, portMAX_DELAY) == pdTRUE)
+      ble.handle(event);
+  }
+}
+
+} // namespace
+
+void SimBle::handle(SimBleEvent &event)
+{
+  sim::BleClient &client = *event.client;
+  BLEServerCallbacks *callbacks = server != nullptr ? server->getCallbacks() : nullptr;
+  esp_ble_gatts_cb_param_t param;
+  esp_ble_gap_cb_param_t gapParam;
+  memset(&param, 0, sizeof(param));
+  memset(&gapParam, 0, sizeof(gapParam));
+  switch (event.op)
+  {
+  case OP_CONNECT:
+    client.connected = true;
+    advertisingOn = false;
+    param.connect.conn_id = client.connId;
+    memcpy(param.connect.remote_bda, client.bda, ESP_BD_ADDR_LEN);
+    param.connect.conn_params.interval = client.interval;
+    param.connect.conn_params.latency = 0;
+    param.connect.conn_params.timeout = 400;
+    if (callbacks != nullptr)
+      callbacks->onConnect(server);
+    if (server != nullptr)
+      server->connectedCount_++;
+    gatts(ESP_GATTS_CONNECT_EVT, param);
+    break;
+  case OP_MTU:
+    client.mtu = event.a < localMtu ? event.a : localMtu;
+    param.mtu.conn_id = client.connId;
+    param.mtu.mtu = client.mtu;
+    if (callbacks != nullptr)
+      callbacks->onMtuChanged(server, &param);
+    gatts(ESP_GATTS_MTU_EVT, param);
+    break;
+  case OP_CCCD:
+  case OP_WRITE:
+  {
+    BLECharacteristic *rx = findCharacteristic(BLECharacteristic::PROPERTY_WRITE | BLECharacteristic::PROPERTY_WRITE_NR);
+    param.write.conn_id = client.connId;
+    memcpy(param.write.bda, client.bda, ESP_BD_ADDR_LEN);
+    param.write.len = event.len;
+    param.write.value = event.value;
+    if (event.op == OP_CCCD)
+    {
+      param.write.handle = cccdHandle();
+    }
+    else if (rx != nullptr)
+    {
+      param.write.handle = rx->getHandle();
+      rx->setValue(event.value, event.len);
+      if (rx->getCallbacks() != nullptr)
+        rx->getCallbacks()->onWrite(rx);
+    }
+    gatts(ESP_GATTS_WRITE_EVT, param);
+    break;
+  }
+  case OP_CONGEST:
+    param.congest.conn_id = client.connId;
+    param.congest.congested = event.a != 0;
+    gatts(ESP_GATTS_CONGEST_EVT, param);
+    break;
+  case OP_DISCONNECT:
+    client.connected = false;
+    param.disconnect.conn_id = client.connId;
+    memcpy(param.disconnect.remote_bda, client.bda, ESP_BD_ADDR_LEN);
+    param.disconnect.reason = 0x13; // Remote user terminated the connection
+    if (callbacks != nullptr)
+      callbacks->onDisconnect(server);
+    if (server != nullptr && server->connectedCount_ > 0)
+      server->connectedCount_--;
+    gatts(ESP_GATTS_DISCONNECT_EVT, param);
+    break;
+  case OP_GRANT_CONN_PARAMS:
+    client.interval = event.a;
+    gapParam.update_conn_params.status = ESP_BT_STATUS_SUCCESS;
+    memcpy(gapParam.update_conn_params.bda, client.bda, ESP_BD_ADDR_LEN);
+    gapParam.update_conn_params.conn_int = event.a;
+    gapParam.update_conn_params.latency = event.b;
+    gapParam.update_conn_params.timeout = event.c;
+    gap(ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT, gapParam);
+    break;
+  case OP_GRANT_DATA_LEN:
+    client.txOctets = event.a;
+    gapParam.pkt_data_length_cmpl.status = ESP_BT_STATUS_SUCCESS;
+    gapParam.pkt_data_length_cmpl.params.tx_len = event.a;
+    gapParam.pkt_data_length_cmpl.params.rx_len = event.a;
+    memcpy(gapParam.pkt_data_length_cmpl.remote_bda, client.bda, ESP_BD_ADDR_LEN);
+    gap(ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT, gapParam);
+    break;
+#if CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+  case OP_GRANT_PHY:
+    client.phy = (uint8_t)event.a;
+    gapParam.phy_update.status = ESP_BT_STATUS_SUCCESS;
+    memcpy(gapParam.phy_update.remote_bda, client.bda, ESP_BD_ADDR_LEN);
+    gapParam.phy_update.tx_phy = client.phy;
+    gapParam.phy_update.rx_phy = client.phy;
+    gap(ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT, gapParam);
+    break;
+#endif
+  }
+}
+
+// ---- Library classes
+
+BLEUUID::BLEUUID(uint16_t uuid16)
+{
+  char text[37];
+  snprintf(text, sizeof(text), "0000%04x-0000-1000-8000-00805f9b34fb", uuid16);
+  text_ = text;
+}
+
+BLEDescriptor::BLEDescriptor(BLEUUID uuid) : uuid_(uuid)
+{
+}
+
+BLECharacteristic::BLECharacteristic(BLEUUID uuid, uint32_t properties)
+    : uuid_(uuid), properties_(properties), handle_(ble.nextHandle)
+{
+  ble.nextHandle += 2; // Declaration and value
+}
+
+void BLECharacteristic::addDescriptor(BLEDescriptor *descriptor)
+{
+  descriptor->handle_ = ble.nextHandle++;
+  descriptors_.push_back(descriptor);
+}
+
+BLECharacteristic *BLEService::createCharacteristic(const char *uuid, uint32_t properties)
+{
+  BLECharacteristic *characteristic = new BLECharacteristic(BLEUUID(uuid), properties);
+  characteristics_.push_back(characteristic);
+  return characteristic;
+}
+
+BLEService *BLEServer::createService(const char *uuid)
+{
+  BLEService *service = new BLEService(BLEUUID(uuid));
+  ble.nextHandle++;
+  services_.push_back(service);
+  return service;
+}
+
+void BLEServer::startAdvertising()
+{
+  ble.advertisingOn = true;
+}
+
+void BLEAdvertising::start()
+{
+  ble.advertisingOn = true;
+}
+
+void BLEAdvertising::stop()
+{
+  ble.advertisingOn = false;
+}
+
+void BLEDevice::init(String deviceName)
+{
+  (void)deviceName;
+  if (ble.queue != nullptr)
+    return;
+  ble.queue = xQueueCreate(SIM_BLE_QUEUE_LENGTH, sizeof(SimBleEvent));
+  xTaskCreatePinnedToCore(btcTask, "btc", 8192, nullptr, 19, nullptr, 0);
+}
+
+esp_err_t BLEDevice::setMTU(uint16_t mtu)
+{
+  ble.localMtu = mtu;
+  return ESP_OK;
+}
+
+uint16_t BLEDevice::getMTU()
+{
+  return ble.localMtu;
+}
+
+BLEServer *BLEDevice::createServer()
+{
+  if (ble.server == nullptr)
+    ble.server = new BLEServer();
+  return ble.server;
+}
+
+BLEAdvertising *BLEDevice::getAdvertising()
+{
+  return &ble.advertising;
+}
+
+void BLEDevice::startAdvertising()
+{
+  ble.advertisingOn = true;
+}
+
+void BLEDevice::stopAdvertising()
+{
+  ble.advertisingOn = false;
+}
+
+void BLEDevice::setCustomGattsHandler(gatts_event_handler handler)
+{
+  ble.gattsHandler = handler;
+}
+
+void BLEDevice::setCustomGapHandler(gap_event_handler handler)
+{
+  ble.gapHandler = handler;
+}
+
+// ---- Bluedroid calls
+
+esp_err_t esp_ble_gatts_send_indicate(esp_gatt_if_t gattsIf, uint16_t connId, uint16_t attrHandle,
+                                      uint16_t valueLen, uint8_t *value, bool needConfirm)
+{
+  (void)attrHandle;
+  (void)needConfirm;
+  if (gattsIf != SIM_BLE_GATTS_IF)
+    return ESP_FAIL;
+  for (sim::BleClient *client : ble.clients)
+  {
+    if (!client->connected || client->connId != connId)
+      continue;
+    if (valueLen > client->mtu - 3)
+      return ESP_FAIL;
+    client->notifications++;
+    if (client->record)
+      client->received.push_back({sim::nowUs(), std::vector<uint8_t>(value, value + valueLen)});
+    return ESP_OK;
+  }
+  return ESP_FAIL;
+}
+
+esp_err_t esp_ble_gap_update_conn_params(esp_ble_conn_update_params_t *params)
+{
+  sim::BleClient *client = ble.clientFor(params->bda);
+  if (client == nullptr || params->min_int > params->max_int)
+    return ESP_FAIL;
+  uint16_t interval = SIM_BLE_PREFERRED_INTERVAL;
+  interval = interval < params->min_int ? params->min_int : interval > params->max_int ? params->max_int : interval;
+  ble.post(client, OP_GRANT_CONN_PARAMS, interval, params->latency, params->timeout);
+  return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_set_pkt_data_len(esp_bd_addr_t remoteDevice, uint16_t txDataLength)
+{
+  sim::BleClient *client = ble.clientFor(remoteDevice);
+  if (client == nullptr || txDataLength < 27 || txDataLength > 251)
+    return ESP_FAIL;
+  ble.post(client, OP_GRANT_DATA_LEN, txDataLength);
+  return ESP_OK;
+}
+
+#if CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+esp_err_t esp_ble_gap_set_preferred_phy(esp_bd_addr_t bdAddr, esp_ble_gap_phy_mask_t allPhysMask,
+                                        esp_ble_gap_phy_mask_t txPhyMask, esp_ble_gap_phy_mask_t rxPhyMask,
+                                        esp_ble_gap_prefer_phy_options_t phyOptions)
+{
+  (void)allPhysMask;
+  (void)rxPhyMask;
+  (void)phyOptions;
+  sim::BleClient *client = ble.clientFor(bdAddr);
+  if (client == nullptr)
+    return ESP_FAIL;
+  if (txPhyMask & ESP_BLE_GAP_PHY_2M_PREF_MASK)
+    ble.post(client, OP_GRANT_PHY, ESP_BLE_GAP_PHY_2M);
+  return ESP_OK;
+}
+#endif
+
+// ---- Simulated centrals
+
+namespace sim
+{
+
+BleClient::BleClient(uint16_t mtu) : connId((uint16_t)ble.clients.size()), mtu(mtu)
+{
+  const uint8_t address[6] = {0x24, 0x0A, 0xC4, 0x00, 0x00, (uint8_t)(connId + 1)};
+  memcpy(bda, address, sizeof(bda));
+  ble.clients.push_back(this);
+}
+
+void BleClient::connect(bool subscribe)
+{
+  uint16_t requested = mtu;
+  ble.post(this, OP_CONNECT);
+  ble.post(this, OP_MTU, requested);
+  if (subscribe)
+    this->subscribe(true);
+}
+
+void BleClient::subscribe(bool enable)
+{
+  const uint8_t value[2] = {(uint8_t)(enable ? 0x01 : 0x00), 0x00};
+  ble.post(this, OP_CCCD, 0, 0, 0, value, sizeof(value));
+}
+
+void BleClient::write(const char *text)
+{
+  write((const uint8_t *)text, strlen(text));
+}
+
+void BleClient::write(const uint8_t *data, size_t len)
+{
+  ble.post(this, OP_WRITE, 0, 0, 0, data, len);
+}
+
+void BleClient::setCongested(bool congested)
+{
+  this->congested = congested;
+  ble.post(this, OP_CONGEST, congested);
+}
+
+void BleClient::disconnect()
+{
+  ble.post(this, OP_DISCONNECT);
+}
+
+bool BleClient::next(Notification &notification, uint32_t timeoutMs)
+{
+  if (!runUntil([this] { return taken < received.size(); }, timeoutMs))
+    return false;
+  notification = received[taken++];
+  return true;
+}
+
+bool BleClient::waitForText(const char *prefix, uint32_t timeoutMs, std::string *text)
+{
+  uint64_t deadline = nowUs() + (uint64_t)timeoutMs * 1000;
+  Notification notification;
+  while (nowUs() <= deadline)
+  {
+    if (!next(notification, (uint32_t)((deadline - nowUs()) / 1000)))
+      return false;
+    if (notification.isFrame() || notification.text().compare(0, strlen(prefix), prefix) != 0)
+      continue;
+    if (text != nullptr)
+      *text = notification.text();
+    return true;
+  }
+  return false;
+}
+
+std::vector<std::string> BleClient::texts() const
+{
+  std::vector<std::string> result;
+  for (const Notification &notification : received)
+    if (!notification.isFrame())
+      result.push_back(notification.text());
+  return result;
+}
+
+} // namespace sim
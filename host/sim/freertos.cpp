@@ -0,0 +1,381 @@
+// FreeRTOS tasks, queues, notifications and mutexes on one virtual clock.
+// Every task is a host thread parked on its own condition variable; the
+// scheduler lock hands the CPU from one to the next (see sim.h).
+#include <Arduino.h>
+#include <esp_timer.h>
+#include "sim.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+struct SimTask
+{
+  std::string name;
+  std::condition_variable cv;
+  bool blocked = false; // Waiting for an object or a deadline
+  bool woken = false;   // The last wait ended by a wake(), not the deadline
+  const void *waitingOn = nullptr;
+  uint64_t wakeAt = 0;
+  uint32_t notifyValue = 0;
+};
+
+struct SimQueue
+{
+  std::vector<uint8_t> storage;
+  UBaseType_t itemSize;
+  UBaseType_t length;
+  UBaseType_t head;
+  UBaseType_t count;
+};
+
+struct SimMutex
+{
+  SimTask *holder;
+};
+
+namespace
+{
+
+const uint64_t FOREVER = UINT64_MAX;
+
+std::mutex schedLock;
+std::vector<SimTask *> tasks; // Creation order, which round robin follows
+SimTask *running = nullptr;
+thread_local SimTask *current = nullptr;
+std::atomic<uint64_t> clockUs{0};
+
+// The calling thread's task. The first thread to ask, the one running
+// main(), becomes the Arduino loop task.
+SimTask *self()
+{
+  if (current != nullptr)
+    return current;
+  if (running != nullptr)
+  {
+    fprintf(stderr, "sim: a thread outside the scheduler called into FreeRTOS\n");
+    abort();
+  }
+  current = new SimTask;
+  current->name = "loopTask";
+  tasks.push_back(current);
+  running = current;
+  return current;
+}
+
+uint64_t deadlineAfter(TickType_t ticks)
+{
+  return ticks == portMAX_DELAY ? FOREVER : clockUs + (uint64_t)ticks * 1000;
+}
+
+// Next task to run after from: a ready one in round-robin order, else the
+// one with the earliest deadline.
+SimTask *pickNext(SimTask *from)
+{
+  size_t n = tasks.size();
+  size_t start = 0;
+  while (tasks[start] != from)
+    start++;
+  for (size_t i = 1; i <= n; i++)
+  {
+    SimTask *task = tasks[(start + i) % n];
+    if (!task->blocked)
+      return task;
+  }
+  SimTask *next = nullptr;
+  for (size_t i = 1; i <= n; i++)
+  {
+    SimTask *task = tasks[(start + i) % n];
+    if (task->wakeAt != FOREVER && (next == nullptr || task->wakeAt < next->wakeAt))
+      next = task;
+  }
+  return next;
+}
+
+// Parks the calling task until wake(object) or the deadline, running the
+// others meanwhile. Returns true if it was woken.
+bool block(std::unique_lock<std::mutex> &lock, const void *object, uint64_t deadline)
+{
+  SimTask *me = self();
+  me->blocked = true;
+  me->woken = false;
+  me->waitingOn = object;
+  me->wakeAt = deadline;
+  SimTask *next = pickNext(me);
+  if (next == nullptr)
+  {
+    fprintf(stderr, "sim: deadlock at %llu us, every task waits forever:", (unsigned long long)clockUs.load());
+    for (SimTask *task : tasks)
+      fprintf(stderr, " %s", task->name.c_str());
+    fprintf(stderr, "\n");
+    _exit(2);
+  }
+  if (next->blocked)
+  {
+    // Nothing is ready: time moves on to the earliest deadline
+    if (next->wakeAt > clockUs)
+      clockUs = next->wakeAt;
+    next->blocked = false;
+    next->waitingOn = nullptr;
+  }
+  running = next;
+  if (next != me)
+  {
+    next->cv.notify_one();
+    while (running != me)
+      me->cv.wait(lock);
+  }
+  return me->woken;
+}
+
+// Makes every task waiting on object ready. They run once the caller blocks.
+void wake(const void *object)
+{
+  for (SimTask *task : tasks)
+  {
+    if (task->blocked && task->waitingOn == object)
+    {
+      task->blocked = false;
+      task->woken = true;
+      task->waitingOn = nullptr;
+    }
+  }
+}
+
+bool expired(uint64_t deadline)
+{
+  return deadline != FOREVER && clockUs >= deadline;
+}
+
+} // namespace
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char *name, uint32_t stackDepth, void *param,
+                                   UBaseType_t priority, TaskHandle_t *created, BaseType_t core)
+{
+  (void)stackDepth;
+  (void)priority;
+  (void)core;
+  std::unique_lock<std::mutex> lock(schedLock);
+  self();
+  SimTask *task = new SimTask;
+  task->name = name;
+  tasks.push_back(task);
+  std::thread([task, code, param] {
+    std::unique_lock<std::mutex> lock(schedLock);
+    current = task;
+    while (running != task)
+      task->cv.wait(lock);
+    lock.unlock();
+    code(param);
+    fprintf(stderr, "sim: task %s returned\n", task->name.c_str());
+    abort();
+  }).detach();
+  if (created != nullptr)
+    *created = task;
+  return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char *name, uint32_t stackDepth, void *param,
+                       UBaseType_t priority, TaskHandle_t *created)
+{
+  return xTaskCreatePinnedToCore(code, name, stackDepth, param, priority, created, 0);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+  std::unique_lock<std::mutex> lock(schedLock);
+  return self();
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+  std::unique_lock<std::mutex> lock(schedLock);
+  block(lock, nullptr, deadlineAfter(ticks));
+}
+
+TickType_t xTaskGetTickCount()
+{
+  return (TickType_t)(clockUs / 1000);
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+  std::unique_lock<std::mutex> lock(schedLock);
+  task->notifyValue++;
+  wake(task);
+  return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks)
+{
+  std::unique_lock<std::mutex> lock(schedLock);
+  SimTask *me = self();
+  uint64_t deadline = deadlineAfter(ticks);
+  while (me->notifyValue == 0 && ticks > 0 && !expired(deadline))
+    block(lock, me, deadline);
+  uint32_t value = me->notifyValue;
+  if (value > 0)
+    me->notifyValue = clearOnExit ? 0 : value - 1;
+  return value;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize)
+{
+  SimQueue *queue = new SimQueue;
+  queue->storage.resize((size_t)length * itemSize);
+  queue->itemSize = itemSize;
+  queue->length = length;
+  queue->head = 0;
+  queue->count = 0;
+  return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+  delete queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+  std::unique_lock<std::mutex> lock(schedLock);
+  uint64_t deadline = deadlineAfter(ticks);
+  while (queue->count == queue->length)
+  {
+    if (ticks == 0 || expired(deadline))
+      return pdFALSE;
+    block(lock, queue, deadline);
+  }
+  UBaseType_t slot = (queue->head + queue->count) % queue->length;
+  memcpy(&queue->storage[(size_t)slot * queue->itemSize], item, queue->itemSize);
+  queue->count++;
+  wake(queue);
+  return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+  std::unique_lock<std::mutex> lock(schedLock);
+  uint64_t deadline = deadlineAfter(ticks);
+  while (queue->count == 0)
+  {
+    if (ticks == 0 || expired(deadline))
+      return pdFALSE;
+    block(lock, queue, deadline);
+  }
+  memcpy(item, &queue->storage[(size_t)queue->head * queue->itemSize], queue->itemSize);
+  queue->head = (queue->head + 1) % queue->length;
+  queue->count--;
+  wake(queue);
+  return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+  std::unique_lock<std::mutex> lock(schedLock);
+  return queue->count;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+  return new SimMutex{nullptr};
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t mutex)
+{
+  delete mutex;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t mutex, TickType_t ticks)
+{
+  std::unique_lock<std::mutex> lock(schedLock);
+  SimTask *me = self();
+  uint64_t deadline = deadlineAfter(ticks);
+  while (mutex->holder != nullptr)
+  {
+    if (ticks == 0 || expired(deadline))
+      return pdFALSE;
+    block(lock, mutex, deadline);
+  }
+  mutex->holder = me;
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t mutex)
+{
+  std::unique_lock<std::mutex> lock(schedLock);
+  if (mutex->holder != self())
+    return pdFALSE;
+  mutex->holder = nullptr;
+  wake(mutex);
+  return pdTRUE;
+}
+
+unsigned long millis()
+{
+  return (unsigned long)(clockUs / 1000);
+}
+
+unsigned long micros()
+{
+  return (unsigned long)clockUs;
+}
+
+int64_t esp_timer_get_time()
+{
+  return (int64_t)clockUs;
+}
+
+void delay(uint32_t ms)
+{
+  vTaskDelay(pdMS_TO_TICKS(ms));
+}
+
+void delayMicroseconds(uint32_t us)
+{
+  sim::advanceUs(us);
+}
+
+namespace sim
+{
+
+uint64_t nowUs()
+{
+  return clockUs;
+}
+
+void advanceUs(uint64_t us)
+{
+  clockUs += us;
+}
+
+void run(uint32_t ms)
+{
+  vTaskDelay(pdMS_TO_TICKS(ms));
+}
+
+bool runUntil(const std::function<bool()> &done, uint32_t timeoutMs)
+{
+  for (uint32_t waited = 0; !done(); waited++)
+  {
+    if (waited >= timeoutMs)
+      return false;
+    vTaskDelay(1);
+  }
+  return true;
+}
+
+TaskHandle_t currentTask()
+{
+  return current;
+}
+
+void exit(int status)
+{
+  fflush(stdout);
+  fflush(stderr);
+  fsErase();
+  _exit(status);
+}
+
+} // namespace sim
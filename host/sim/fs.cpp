@@ -0,0 +1,272 @@
+// LittleFS on a host directory. Flash paths map onto sim::fsRoot(); the
+// VFS path (/littlefs/...) is mapped as well, for the POSIX calls the
+// firmware makes through it.
+#include <LittleFS.h>
+#include "sim.h"
+#include <dirent.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define SIM_FS_TOTAL_BYTES 0x160000 // Default partition table, 4 MB flash
+#define SIM_FS_BLOCK 4096
+#define SIM_FS_MOUNT "/littlefs"
+
+fs::LittleFSFS LittleFS;
+
+namespace fs
+{
+
+struct FileImpl
+{
+  FILE *file = nullptr;
+  DIR *dir = nullptr;
+  std::string path; // On flash
+  std::string name;
+
+  ~FileImpl()
+  {
+    if (file != nullptr)
+      fclose(file);
+    if (dir != nullptr)
+      closedir(dir);
+  }
+};
+
+} // namespace fs
+
+namespace
+{
+
+bool mounted = false;
+size_t usage = 0; // Summed by usedBytes()
+
+std::string hostPath(const char *path)
+{
+  return sim::fsRoot() + (path[0] == '/' ? "" : "/") + path;
+}
+
+// Whole blocks per file, one per directory
+int addUsage(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+  (void)path;
+  (void)ftw;
+  if (type == FTW_F)
+    usage += (st->st_size + SIM_FS_BLOCK - 1) / SIM_FS_BLOCK * SIM_FS_BLOCK;
+  else
+    usage += SIM_FS_BLOCK;
+  return 0;
+}
+
+int removeEntry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+  (void)st;
+  (void)type;
+  (void)ftw;
+  return ::remove(path);
+}
+
+} // namespace
+
+namespace sim
+{
+
+const std::string &fsRoot()
+{
+  static std::string root;
+  if (root.empty())
+  {
+    char path[] = "/tmp/espectro32-fs-XXXXXX";
+    if (mkdtemp(path) == nullptr)
+    {
+      perror("sim: mkdtemp");
+      abort();
+    }
+    root = path;
+  }
+  return root;
+}
+
+void fsErase()
+{
+  nftw(fsRoot().c_str(), removeEntry, 8, FTW_DEPTH | FTW_PHYS);
+}
+
+} // namespace sim
+
+// Through the VFS the firmware reaches the partition at /littlefs.
+extern "C" int truncate(const char *path, off_t length) noexcept
+{
+  std::string mapped = path;
+  if (mapped.compare(0, strlen(SIM_FS_MOUNT "/"), SIM_FS_MOUNT "/") == 0)
+    mapped = hostPath(path + strlen(SIM_FS_MOUNT));
+  return (int)syscall(SYS_truncate, mapped.c_str(), length);
+}
+
+namespace fs
+{
+
+File::operator bool() const
+{
+  return impl_ && (impl_->file != nullptr || impl_->dir != nullptr);
+}
+
+size_t File::write(const uint8_t *buf, size_t size)
+{
+  if (!impl_ || impl_->file == nullptr)
+    return 0;
+  size_t written = fwrite(buf, 1, size, impl_->file);
+  fflush(impl_->file);
+  return written;
+}
+
+size_t File::read(uint8_t *buf, size_t size)
+{
+  if (!impl_ || impl_->file == nullptr)
+    return 0;
+  return fread(buf, 1, size, impl_->file);
+}
+
+int File::read()
+{
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+bool File::seek(uint32_t pos, SeekMode mode)
+{
+  return impl_ && impl_->file != nullptr && fseek(impl_->file, pos, mode) == 0;
+}
+
+size_t File::position() const
+{
+  return impl_ && impl_->file != nullptr ? ftell(impl_->file) : 0;
+}
+
+size_t File::size() const
+{
+  struct stat st;
+  if (!impl_ || impl_->file == nullptr || fstat(fileno(impl_->file), &st) != 0)
+    return 0;
+  return st.st_size;
+}
+
+void File::flush()
+{
+  if (impl_ && impl_->file != nullptr)
+    fflush(impl_->file);
+}
+
+void File::close()
+{
+  impl_.reset();
+}
+
+const char *File::name() const
+{
+  return impl_ ? impl_->name.c_str() : "";
+}
+
+const char *File::path() const
+{
+  return impl_ ? impl_->path.c_str() : "";
+}
+
+bool File::isDirectory() const
+{
+  return impl_ && impl_->dir != nullptr;
+}
+
+File File::openNextFile(const char *mode)
+{
+  if (!impl_ || impl_->dir == nullptr)
+    return File();
+  struct dirent *entry;
+  while ((entry = readdir(impl_->dir)) != nullptr)
+  {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+      return LittleFS.open((impl_->path + "/" + entry->d_name).c_str(), mode);
+  }
+  return File();
+}
+
+File FS::open(const char *path, const char *mode, bool create)
+{
+  (void)create;
+  if (!mounted || path == nullptr || path[0] != '/')
+    return File();
+  std::shared_ptr<FileImpl> impl = std::make_shared<FileImpl>();
+  impl->path = path;
+  const char *slash = strrchr(path, '/');
+  impl->name = slash + 1;
+  std::string host = hostPath(path);
+  struct stat st;
+  if (stat(host.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+    impl->dir = opendir(host.c_str());
+  else
+    impl->file = fopen(host.c_str(), (std::string(mode) + "b").c_str());
+  return File(impl);
+}
+
+bool FS::exists(const char *path)
+{
+  struct stat st;
+  return mounted && stat(hostPath(path).c_str(), &st) == 0;
+}
+
+bool FS::remove(const char *path)
+{
+  return mounted && ::unlink(hostPath(path).c_str()) == 0;
+}
+
+bool FS::rename(const char *from, const char *to)
+{
+  return mounted && ::rename(hostPath(from).c_str(), hostPath(to).c_str()) == 0;
+}
+
+bool FS::mkdir(const char *path)
+{
+  return mounted && ::mkdir(hostPath(path).c_str(), 0755) == 0;
+}
+
+bool FS::rmdir(const char *path)
+{
+  return mounted && ::rmdir(hostPath(path).c_str()) == 0;
+}
+
+bool LittleFSFS::begin(bool formatOnFail, const char *basePath, uint8_t maxOpenFiles, const char *partitionLabel)
+{
+  (void)formatOnFail;
+  (void)basePath;
+  (void)maxOpenFiles;
+  (void)partitionLabel;
+  struct stat st;
+  mounted = stat(sim::fsRoot().c_str(), &st) == 0 || ::mkdir(sim::fsRoot().c_str(), 0755) == 0;
+  return mounted;
+}
+
+void LittleFSFS::end()
+{
+  mounted = false;
+}
+
+bool LittleFSFS::format()
+{
+  sim::fsErase();
+  return ::mkdir(sim::fsRoot().c_str(), 0755) == 0;
+}
+
+size_t LittleFSFS::totalBytes()
+{
+  return SIM_FS_TOTAL_BYTES;
+}
+
+size_t LittleFSFS::usedBytes()
+{
+  usage = 0;
+  nftw(sim::fsRoot().c_str(), addUsage, 8, FTW_PHYS);
+  return usage;
+}
+
+} // namespace fs
@@ -0,0 +1,103 @@
+// NVS namespaces in process memory.
+#include <Preferences.h>
+#include "sim.h"
+#include <map>
+
+namespace
+{
+
+typedef std::map<std::string, std::vector<uint8_t>> Namespace;
+
+std::map<std::string, Namespace> &flash()
+{
+  static std::map<std::string, Namespace> namespaces;
+  return namespaces;
+}
+
+} // namespace
+
+namespace sim
+{
+
+void nvsErase()
+{
+  flash().clear();
+}
+
+} // namespace sim
+
+bool Preferences::begin(const char *name, bool readOnly)
+{
+  if (open_ || name == nullptr || strlen(name) > 15)
+    return false;
+  namespace_ = name;
+  readOnly_ = readOnly;
+  open_ = true;
+  flash()[namespace_];
+  return true;
+}
+
+void Preferences::end()
+{
+  open_ = false;
+}
+
+bool Preferences::clear()
+{
+  if (!open_ || readOnly_)
+    return false;
+  flash()[namespace_].clear();
+  return true;
+}
+
+bool Preferences::remove(const char *key)
+{
+  if (!open_ || readOnly_)
+    return false;
+  return flash()[namespace_].erase(key) > 0;
+}
+
+bool Preferences::isKey(const char *key)
+{
+  return open_ && flash()[namespace_].count(key) > 0;
+}
+
+uint32_t Preferences::getUInt(const char *key, uint32_t defaultValue)
+{
+  uint32_t value;
+  return getBytesLength(key) == sizeof(value) && getBytes(key, &value, sizeof(value)) == sizeof(value)
+             ? value
+             : defaultValue;
+}
+
+size_t Preferences::putUInt(const char *key, uint32_t value)
+{
+  return putBytes(key, &value, sizeof(value));
+}
+
+size_t Preferences::getBytesLength(const char *key)
+{
+  if (!open_)
+    return 0;
+  Namespace &entries = flash()[namespace_];
+  auto entry = entries.find(key);
+  return entry == entries.end() ? 0 : entry->second.size();
+}
+
+size_t Preferences::getBytes(const char *key, void *buf, size_t maxLen)
+{
+  size_t len = getBytesLength(key);
+  if (len == 0 || len > maxLen)
+    return 0;
+  memcpy(buf, flash()[namespace_][key].data(), len);
+  return len;
+}
+
+size_t Preferences::putBytes(const char *key, const void *value, size_t len)
+{
+  if (!open_ || readOnly_ || key == nullptr || strlen(key) > 15)
+    return 0;
+  const uint8_t *bytes = (const uint8_t *)value;
+  flash()[namespace_][key].assign(bytes, bytes + len);
+  return len;
+}
@@ -0,0 +1,163 @@
+// Controls for the host simulator, used by the tests and espectro32-sim.
+//
+// Tasks are host threads, but only one runs at a time: a task runs until
+// it blocks in a FreeRTOS call or delay(), and the next ready task takes
+// over. When none is ready, virtual time jumps to the earliest deadline.
+// A run is therefore deterministic, takes no wall-clock time to wait, and
+// a task that never blocks starves the others, as it would at equal
+// priority on one core.
+#pragma once
+#include <Arduino.h>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace sim
+{
+
+// ---- Clock and scheduler (freertos.cpp)
+uint64_t nowUs();
+// Busy time of the running task, e.g. a bus transfer; nothing else runs.
+void advanceUs(uint64_t us);
+// Blocks the calling task for ms of virtual time while the others run.
+void run(uint32_t ms);
+// Runs until done() holds, checking every ms; false after timeoutMs.
+bool runUntil(const std::function<bool()> &done, uint32_t timeoutMs);
+// Ends the process without unwinding the parked task threads.
+[[noreturn]] void exit(int status);
+// The calling thread's task, or nullptr for a thread the scheduler has not
+// seen yet. Takes no lock and allocates nothing, so a malloc hook may call it.
+TaskHandle_t currentTask();
+
+// ---- Serial, LEDs and heap (arduino.cpp)
+extern bool serialEcho; // Copy Serial output to stdout
+uint32_t ledDuty(uint8_t pin);
+uint32_t ledDutyMax(uint8_t pin);
+extern void (*ledChanging)(); // Called before a duty change takes effect
+extern size_t heapFree;
+extern size_t heapMinFree;
+extern size_t heapLargestBlock;
+
+// ---- I2C bus (wire.cpp)
+class I2cDevice
+{
+public:
+  virtual ~I2cDevice() {}
+  // A write transaction; false NAKs it.
+  virtual bool write(const uint8_t *data, size_t len) = 0;
+  // A read transaction; returns the bytes supplied.
+  virtual size_t read(uint8_t *data, size_t len) = 0;
+};
+
+void i2cAttach(uint8_t address, I2cDevice *device);
+uint32_t i2cTransactions(); // START to STOP or repeated START, as the bus saw them
+void i2cFailNext(uint32_t count); // The next count transactions NAK
+
+// ---- APDS-9930 (apds9930.cpp)
+// An ambient light sensor looking through a cuvette at the three LEDs.
+// ALS cycles run on the virtual clock at (256 - ATIME) * 2.73 ms; each
+// integrates the light over its own span (so an LED switched mid-cycle
+// counts in part), applies the gain, adds dark counts and shot noise, and
+// saturates at 1024 counts per period, capped at 65535. AINT is raised at
+// the end of every cycle when AIEN is set and APERS is 0; other APERS
+// values and the proximity engine are not modelled.
+class Apds9930 : public I2cDevice
+{
+public:
+  struct Led
+  {
+    uint8_t pin;
+    float countsPerPeriod; // CH0 at full duty, 1x gain, through an empty cuvette
+    float ch1Fraction;     // Share of it CH1 (IR) sees
+  };
+
+  Led leds[3] = {{27, 160.0f, 0.30f}, {26, 130.0f, 0.06f}, {25, 100.0f, 0.03f}};
+  float absorbance[3] = {0.0f, 0.0f, 0.0f}; // Sample in the cuvette, per LED
+  float ambientPerPeriod = 0.2f;
+  float darkPerPeriod = 0.5f;
+  float noise = 0.25f; // Scales sqrt(counts) noise; 0 for exact counts
+  uint8_t id = 0x39;
+  uint32_t cycles = 0;      // Integrations completed
+  uint32_t channelReads = 0; // Read transactions that started at CH0DATAL
+
+  Apds9930();
+  bool write(const uint8_t *data, size_t len) override;
+  size_t read(uint8_t *data, size_t len) override;
+  // Brings the integration in progress up to the current time.
+  void update();
+  uint8_t reg(uint8_t address) const { return regs_[address & 0x1F]; }
+  uint16_t ch0() const { return (uint16_t)(regs_[0x15] << 8 | regs_[0x14]); }
+  uint16_t ch1() const { return (uint16_t)(regs_[0x17] << 8 | regs_[0x16]); }
+
+private:
+  void finishCycle();
+  void lightRate(float &ch0, float &ch1) const;
+
+  uint8_t regs_[0x20];
+  uint8_t pointer_ = 0;
+  bool autoIncrement_ = false;
+  bool integrating_ = false;
+  uint32_t cyclePeriods_ = 1;
+  uint64_t cycleStartUs_ = 0;
+  uint64_t lastUs_ = 0;
+  double ch0Periods_ = 0; // Light integrated this cycle, in 1x counts
+  double ch1Periods_ = 0;
+  std::mt19937 rng_;
+};
+
+// The instrument's sensor, on the bus at 0x39 from startup.
+Apds9930 &apds9930();
+
+// ---- BLE centrals (ble.cpp)
+struct Notification
+{
+  uint64_t atUs;
+  std::vector<uint8_t> data;
+  bool isFrame() const { return !data.empty() && data[0] == 0xA5; }
+  std::string text() const { return std::string(data.begin(), data.end()); }
+};
+
+// A central connected to the instrument's server. Its actions are queued
+// to the simulated BLE task, so they take effect once the caller blocks
+// (run(), runUntil() or a wait below). Link requests from the firmware are
+// granted: the interval nearest 15 ms in the requested range, 251-byte
+// packets and, on a BLE 5 controller, the 2M PHY.
+class BleClient
+{
+public:
+  explicit BleClient(uint16_t mtu = 247);
+  void connect(bool subscribe = true); // Connect, exchange the MTU, write the CCCD
+  void subscribe(bool enable);
+  void write(const char *text);
+  void write(const uint8_t *data, size_t len);
+  void setCongested(bool congested);
+  void disconnect();
+
+  // Takes the next notification not yet taken, waiting up to timeoutMs.
+  bool next(Notification &notification, uint32_t timeoutMs);
+  // Takes notifications until a text one starting with prefix; false on timeout.
+  bool waitForText(const char *prefix, uint32_t timeoutMs, std::string *text = nullptr);
+  // Texts of every notification received, frames left out.
+  std::vector<std::string> texts() const;
+
+  uint16_t connId;
+  uint16_t mtu;
+  uint8_t bda[6];
+  bool connected = false;
+  bool congested = false;
+  bool record = true; // Keep received notifications; count them either way
+  uint32_t notifications = 0;
+  std::vector<Notification> received;
+  size_t taken = 0;
+  uint16_t interval = 24; // Granted, 1.25 ms units
+  uint16_t txOctets = 27;
+  uint8_t phy = 1;
+};
+
+// ---- NVS and LittleFS (preferences.cpp, fs.cpp)
+void nvsErase();
+const std::string &fsRoot(); // Host directory holding the LittleFS partition
+void fsErase();
+
+} // namespace sim
@@ -0,0 +1,100 @@
+// The I2C master. Each transaction costs its bus time at the set clock
+// (9 bit times per byte, address included) on the virtual clock.
+#include <Wire.h>
+#include "sim.h"
+
+TwoWire Wire;
+
+namespace
+{
+
+sim::I2cDevice *devices[128];
+uint32_t transactions = 0;
+uint32_t failNext = 0;
+
+// Counts a transaction and charges its bus time; false if it is to fail.
+bool busTransaction(uint32_t clockHz, size_t bytes)
+{
+  transactions++;
+  sim::advanceUs((uint64_t)(bytes + 1) * 9 * 1000000 / clockHz);
+  if (failNext == 0)
+    return true;
+  failNext--;
+  return false;
+}
+
+} // namespace
+
+namespace sim
+{
+
+void i2cAttach(uint8_t address, I2cDevice *device)
+{
+  devices[address & 0x7F] = device;
+}
+
+uint32_t i2cTransactions()
+{
+  return transactions;
+}
+
+void i2cFailNext(uint32_t count)
+{
+  failNext = count;
+}
+
+} // namespace sim
+
+bool TwoWire::setClock(uint32_t hz)
+{
+  if (hz == 0)
+    return false;
+  clockHz_ = hz;
+  return true;
+}
+
+void TwoWire::beginTransmission(uint8_t address)
+{
+  address_ = address & 0x7F;
+  txLen_ = 0;
+}
+
+size_t TwoWire::write(uint8_t data)
+{
+  if (txLen_ == sizeof(txBuf_))
+    return 0;
+  txBuf_[txLen_++] = data;
+  return 1;
+}
+
+size_t TwoWire::write(const uint8_t *data, size_t len)
+{
+  size_t n = 0;
+  while (n < len && write(data[n]) == 1)
+    n++;
+  return n;
+}
+
+// 0 on success, 2 for a NAK on the address, 3 for a NAK on data.
+uint8_t TwoWire::endTransmission(bool sendStop)
+{
+  (void)sendStop;
+  sim::I2cDevice *device = devices[address_];
+  if (!busTransaction(clockHz_, txLen_) || device == nullptr)
+    return 2;
+  return device->write(txBuf_, txLen_) ? 0 : 3;
+}
+
+uint8_t TwoWire::requestFrom(uint8_t address, size_t len, bool sendStop)
+{
+  (void)sendStop;
+  rxLen_ = 0;
+  rxPos_ = 0;
+  if (len > sizeof(rxBuf_))
+    len = sizeof(rxBuf_);
+  sim::I2cDevice *device = devices[address & 0x7F];
+  if (!busTransaction(clockHz_, len) || device == nullptr)
+    return 0;
+  rxLen_ = (int)device->read(rxBuf_, len);
+  return (uint8_t)rxLen_;
+}
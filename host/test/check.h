@@ -0,0 +1,41 @@
+// Checks for the host tests. A failed CHECK prints where and what and the
+// test carries on; checkExit() reports the total and ends the process.
+#pragma once
+#include "sim.h"
+#include <cstdio>
+
+inline int checkFailures = 0;
+
+#define CHECK(cond)                                                        \
+  do                                                                       \
+  {                                                                        \
+    if (!(cond))                                                           \
+    {                                                                      \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      checkFailures++;                                                     \
+    }                                                                      \
+  } while (0)
+
+#define CHECK_EQ(a, b)                                                     \
+  do                                                                       \
+  {                                                                        \
+    long long a_ = (long long)(a), b_ = (long long)(b);                    \
+    if (a_ != b_)                                                          \
+    {                                                                      \
+      fprintf(stderr, "%s:%d: %s == %s failed: %lld != %lld\n", __FILE__,  \
+              __LINE__, #a, #b, a_, b_);                                   \
+      checkFailures++;                                                     \
+    }                                                                      \
+  } while (0)
+
+// Ends the test, through sim::exit() so that parked task threads are left
+// alone.
+[[noreturn]] inline void checkExit(const char *name)
+{
+  if (checkFailures == 0)
+    printf("%s: ok\n", name);
+  else
+    printf("%s: %d failed\n", name, checkFailures);
+  fflush(stdout);
+  sim::exit(checkFailures == 0 ? 0 : 1);
+}
@@ -0,0 +1,113 @@
+// The fixed-point absorbance kernel against log10 in double precision over
+// every 16-bit count, then a host benchmark of it against the float form
+// it replaced. The timings are printed for comparison only: host speed
+// says little about the ESP32, where the float log is in software.
+#include "ESPectro32.cpp"
+#include "check.h"
+#include <chrono>
+
+#define BENCH_SAMPLES 65536
+#define BENCH_ROUNDS 64
+
+namespace
+{
+
+int32_t referenceAbsorbance(uint16_t sample, uint16_t blank, uint16_t dark)
+{
+  return (int32_t)lround(log10((double)(blank - dark) / (sample - dark)) * ABS_FIXED_SCALE);
+}
+
+void testAccuracy()
+{
+  const uint16_t blanks[] = {2, 100, 1000, 4097, 30000, 65535};
+  const uint16_t darks[] = {0, 1, 340};
+  int32_t worst = 0;
+  for (uint16_t dark : darks)
+  {
+    for (uint16_t blank : blanks)
+    {
+      if (blank <= dark)
+        continue;
+      for (uint32_t sample = dark + 1; sample <= 65535; sample++)
+      {
+        int32_t error = absorbanceFixed((uint16_t)sample, blank, dark) - referenceAbsorbance((uint16_t)sample, blank, dark);
+        if (abs(error) > worst)
+          worst = abs(error);
+      }
+    }
+  }
+  printf("worst error %d x 0.1 mAU\n", (int)worst);
+  CHECK(worst <= 1);
+}
+
+void testEdges()
+{
+  CHECK_EQ(absorbanceFixed(500, 340, 340), ABS_INVALID);
+  CHECK_EQ(absorbanceFixed(500, 100, 340), ABS_INVALID);
+  CHECK_EQ(absorbanceFixed(340, 1000, 340), ABS_OPAQUE);
+  CHECK_EQ(absorbanceFixed(0, 1000, 340), ABS_OPAQUE);
+  CHECK_EQ(absorbanceFixed(1000, 1000, 340), 0);
+  CHECK_EQ(absorbanceFixed(100, 1000, 0), ABS_FIXED_SCALE);
+  CHECK(absorbanceFixed(2000, 1000, 0) < 0); // Brighter than the blank
+}
+
+void testBatch()
+{
+  static uint16_t samples[BENCH_SAMPLES];
+  static int32_t out[BENCH_SAMPLES];
+  for (uint32_t i = 0; i < BENCH_SAMPLES; i++)
+    samples[i] = (uint16_t)i;
+  absorbanceFixedBatch(samples, out, BENCH_SAMPLES, 30000, 340);
+  uint32_t mismatches = 0;
+  for (uint32_t i = 0; i < BENCH_SAMPLES; i++)
+    mismatches += out[i] != absorbanceFixed(samples[i], 30000, 340);
+  CHECK_EQ(mismatches, 0);
+  absorbanceFixedBatch(samples, out, 4, 340, 340);
+  CHECK_EQ(out[3], ABS_INVALID);
+}
+
+template <typename Kernel>
+double nsPerSample(Kernel kernel)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (int round = 0; round < BENCH_ROUNDS; round++)
+    kernel();
+  std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / ((double)BENCH_ROUNDS * BENCH_SAMPLES);
+}
+
+void benchmark()
+{
+  static uint16_t samples[BENCH_SAMPLES];
+  static int32_t out[BENCH_SAMPLES];
+  static float outFloat[BENCH_SAMPLES];
+  uint32_t state = 1;
+  for (uint16_t &sample : samples)
+  {
+    state = state * 1664525 + 1013904223;
+    sample = (uint16_t)(341 + (state >> 16) % 29660);
+  }
+  double floatNs = nsPerSample([&] {
+    for (uint32_t i = 0; i < BENCH_SAMPLES; i++)
+      outFloat[i] = log10f((30000.0f - 340.0f) / (samples[i] - 340.0f));
+  });
+  double scalarNs = nsPerSample([&] {
+    for (uint32_t i = 0; i < BENCH_SAMPLES; i++)
+      out[i] = absorbanceFixed(samples[i], 30000, 340);
+  });
+  double batchNs = nsPerSample([&] { absorbanceFixedBatch(samples, out, BENCH_SAMPLES, 30000, 340); });
+  printf("log10f %.2f ns, absorbanceFixed %.2f ns (with its probe), batch %.2f ns per sample\n",
+         floatNs, scalarNs, batchNs);
+  CHECK(fabsf(outFloat[0] * ABS_FIXED_SCALE - out[0]) <= 2.0f);
+}
+
+} // namespace
+
+int main()
+{
+  testAccuracy();
+  testEdges();
+  testBatch();
+  benchmark();
+  checkExit("test_absorbance");
+}
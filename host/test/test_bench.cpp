@@ -0,0 +1,245 @@
+// The web client's protocol benchmark (index3.html, Benchmark tab) run
+// headless on the simulator: the same script, metric names and report
+// layout, timed on the virtual clock so a run is repeatable. Each metric
+// is checked against the committed baseline, test/bench_baseline.json,
+// with the client's tolerance; the client's absolute thresholds are for
+// hardware and are not applied. The report goes to build/bench_report.json,
+// and "make bench-baseline" adopts it after an intended change.
+#include "ESPectro32.cpp"
+#include "check.h"
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#define BENCH_REPORT_VERSION 1
+#define BENCH_READS 20
+#define BENCH_STREAM_S 10
+#define BENCH_TIMEOUT_MS 30000
+#define BENCH_REGRESSION_TOLERANCE 0.2 // Fractional change vs baseline that fails
+
+namespace
+{
+
+typedef std::map<std::string, double> Metrics;
+
+const char *const ledNames[] = {"RED", "GREEN", "BLUE"};
+
+struct Tally
+{
+  uint32_t notifications = 0;
+  uint64_t bytes = 0;
+  uint32_t rawSamples = 0;
+};
+
+Tally tally;
+
+// Takes the next notification, counting it as the client's benchObserve does.
+bool observe(sim::BleClient &client, sim::Notification &notification)
+{
+  if (!client.next(notification, BENCH_TIMEOUT_MS))
+    return false;
+  tally.notifications++;
+  tally.bytes += notification.data.size() + ATT_NOTIFY_OVERHEAD;
+  if (notification.isFrame() && notification.data[2] == FRAME_TYPE_RAW)
+    tally.rawSamples += notification.data[3];
+  return true;
+}
+
+bool isText(const sim::Notification &notification, const char *prefix)
+{
+  return !notification.isFrame() && notification.text().rfind(prefix, 0) == 0;
+}
+
+// Time in ms from the write to the first notification that is a frame of
+// frameType, or a text starting with prefix; -1, failing the test, on an
+// error or timeout.
+double timedCommand(sim::BleClient &client, const char *command, int frameType, const char *prefix)
+{
+  uint64_t start = sim::nowUs();
+  client.write(command);
+  sim::Notification notification;
+  while (observe(client, notification))
+  {
+    if (isText(notification, "Error"))
+      break;
+    if ((notification.isFrame() && notification.data[2] == frameType) ||
+        (prefix != nullptr && isText(notification, prefix)))
+      return (notification.atUs - start) / 1000.0;
+  }
+  printf("%s: no reply\n", command);
+  CHECK(!"every benchmarked command is answered");
+  return -1;
+}
+
+double percentile(std::vector<double> values, double p)
+{
+  std::sort(values.begin(), values.end());
+  long index = std::min((long)values.size() - 1, (long)ceil(p / 100 * values.size()) - 1);
+  return values[std::max(0L, index)];
+}
+
+double round1(double value)
+{
+  return round(value * 10) / 10;
+}
+
+Metrics runBenchmark(sim::BleClient &client)
+{
+  Metrics metrics;
+  uint64_t startUs = sim::nowUs();
+  std::vector<double> ledSwitch;
+  std::vector<double> setZero;
+  for (uint8_t led = 0; led < LED_COUNT; led++)
+  {
+    std::string command = std::string("LED_") + ledNames[led] + "_ON";
+    double switchMs = timedCommand(client, command.c_str(), -1, "z:");
+    double zeroMs = timedCommand(client, "SET_ZERO", -1, "z:");
+    ledSwitch.push_back(switchMs);
+    setZero.push_back(zeroMs);
+    std::string name = ledNames[led];
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    metrics["time_to_zero_" + name + "_ms"] = round1(zeroMs);
+  }
+  metrics["led_switch_p50_ms"] = round1(percentile(ledSwitch, 50));
+  metrics["led_switch_p99_ms"] = round1(percentile(ledSwitch, 99));
+  metrics["set_zero_p50_ms"] = round1(percentile(setZero, 50));
+  metrics["set_zero_p99_ms"] = round1(percentile(setZero, 99));
+
+  std::vector<double> readLatency;
+  double readTotal = 0;
+  for (int i = 0; i < BENCH_READS; i++)
+  {
+    readLatency.push_back(timedCommand(client, "READ_SENSOR", FRAME_TYPE_READING, nullptr));
+    readTotal += readLatency.back();
+  }
+  metrics["read_sensor_p50_ms"] = round1(percentile(readLatency, 50));
+  metrics["read_sensor_p99_ms"] = round1(percentile(readLatency, 99));
+  metrics["readings_per_min"] = round1(60000 * BENCH_READS / readTotal);
+
+  Tally stream = tally;
+  uint64_t streamStartUs = sim::nowUs();
+  client.write("STREAM_START");
+  sim::run(BENCH_STREAM_S * 1000);
+  client.write("STREAM_STOP");
+  sim::Notification notification;
+  while (observe(client, notification) && !isText(notification, "s:STOP"))
+    ;
+  double streamElapsed = (sim::nowUs() - streamStartUs) / 1e6;
+  metrics["stream_samples_per_s"] = round1((tally.rawSamples - stream.rawSamples) / streamElapsed);
+  metrics["stream_notifications_per_s"] = round1((tally.notifications - stream.notifications) / streamElapsed);
+  metrics["stream_bytes_per_s"] = round1((tally.bytes - stream.bytes) / streamElapsed);
+
+  double elapsed = (sim::nowUs() - startUs) / 1e6;
+  metrics["notifications_per_s"] = round1(tally.notifications / elapsed);
+  metrics["bytes_on_air"] = (double)tally.bytes;
+  return metrics;
+}
+
+// The "metrics" object of a report; empty if the file is missing.
+Metrics readMetrics(const std::string &path)
+{
+  Metrics metrics;
+  FILE *file = fopen(path.c_str(), "r");
+  if (file == nullptr)
+    return metrics;
+  std::string text;
+  char buf[256];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), file)) > 0)
+    text.append(buf, n);
+  fclose(file);
+
+  size_t pos = text.find("\"metrics\"");
+  pos = pos == std::string::npos ? pos : text.find('{', pos);
+  size_t end = pos == std::string::npos ? pos : text.find('}', pos);
+  while (pos != std::string::npos && (pos = text.find('"', pos + 1)) < end)
+  {
+    size_t close = text.find('"', pos + 1);
+    std::string name = text.substr(pos + 1, close - pos - 1);
+    pos = text.find(':', close);
+    metrics[name] = strtod(text.c_str() + pos + 1, nullptr);
+  }
+  return metrics;
+}
+
+void writeReport(const std::string &path, const Metrics &metrics, const std::vector<std::string> &failures)
+{
+  FILE *file = fopen(path.c_str(), "w");
+  if (file == nullptr)
+    return;
+  fprintf(file, "{\n  \"version\": %d,\n  \"label\": \"host simulator\",\n  \"metrics\": {", BENCH_REPORT_VERSION);
+  const char *separator = "\n";
+  for (const auto &[name, value] : metrics)
+  {
+    fprintf(file, "%s    \"%s\": %g", separator, name.c_str(), value);
+    separator = ",\n";
+  }
+  fprintf(file, "\n  },\n  \"failures\": [");
+  separator = "";
+  for (const std::string &failure : failures)
+  {
+    fprintf(file, "%s\"%s\"", separator, failure.c_str());
+    separator = ", ";
+  }
+  fprintf(file, "],\n  \"passed\": %s\n}\n", failures.empty() ? "true" : "false");
+  fclose(file);
+}
+
+bool endsWith(const std::string &name, const char *suffix)
+{
+  size_t len = strlen(suffix);
+  return name.size() >= len && name.compare(name.size() - len, len, suffix) == 0;
+}
+
+// Lower is better for latencies (*_ms), higher is better for rates (*_per_s).
+// Metrics the baseline lacks, or has at 0, are not checked.
+std::vector<std::string> checkBenchmark(const Metrics &metrics, const Metrics &baseline)
+{
+  std::vector<std::string> failures;
+  char line[128];
+  for (const auto &[name, value] : metrics)
+  {
+    auto found = baseline.find(name);
+    if (found == baseline.end() || found->second == 0)
+      continue;
+    double change = (value - found->second) / found->second;
+    bool worse = endsWith(name, "_ms") ? change > BENCH_REGRESSION_TOLERANCE
+                 : endsWith(name, "_per_s") || endsWith(name, "_per_min") ? change < -BENCH_REGRESSION_TOLERANCE
+                                                                          : false;
+    if (worse)
+    {
+      snprintf(line, sizeof(line), "%s = %g (baseline %g)", name.c_str(), value, found->second);
+      failures.push_back(line);
+    }
+  }
+  return failures;
+}
+
+std::string directoryOf(const char *path)
+{
+  std::string text = path;
+  size_t slash = text.rfind('/');
+  return slash == std::string::npos ? "" : text.substr(0, slash + 1);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+  setup();
+  sim::BleClient client;
+  client.connect();
+  Metrics metrics = runBenchmark(client);
+
+  Metrics baseline = readMetrics(directoryOf(__FILE__) + "bench_baseline.json");
+  CHECK(!baseline.empty());
+  std::vector<std::string> failures = checkBenchmark(metrics, baseline);
+  writeReport(directoryOf(argv[0]) + "bench_report.json", metrics, failures);
+  for (const std::string &failure : failures)
+    printf("regression: %s\n", failure.c_str());
+  CHECK(failures.empty());
+  printf("read p50 %g ms, stream %g samples/s, %g notifications/s\n", metrics["read_sensor_p50_ms"],
+         metrics["stream_samples_per_s"], metrics["stream_notifications_per_s"]);
+  checkExit("test_bench");
+}
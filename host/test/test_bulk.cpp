@@ -0,0 +1,83 @@
+// BULK against competing requests and link changes: a second BULK is
+// refused while one is active, a resume on a link whose MTU cannot carry
+// the transfer's chunks is refused with "b:CANCEL" rather than sent cut
+// short, and a binary frame too long for a client is counted, never
+// truncated.
+#include "ESPectro32.cpp"
+#include "check.h"
+
+#define RECORDS 100
+
+namespace
+{
+
+uint32_t bulkFrames(const sim::BleClient &client)
+{
+  uint32_t frames = 0;
+  for (const sim::Notification &notification : client.received)
+    if (notification.isFrame() && notification.data[2] == FRAME_TYPE_BULK)
+      frames++;
+  return frames;
+}
+
+BleClient *serverSide(const sim::BleClient &client)
+{
+  for (BleClient &slot : bleClients)
+    if (slot.active && slot.connId == client.connId)
+      return &slot;
+  return nullptr;
+}
+
+} // namespace
+
+int main()
+{
+  setup();
+  for (uint32_t i = 0; i < RECORDS; i++)
+    kineticsBuffer[i] = {i * 100, (uint16_t)(1000 + i), 200};
+  kinetics.count.store(RECORDS, std::memory_order_release);
+
+  sim::BleClient wide;
+  wide.connect();
+  std::string line;
+  wide.write("BULK 0");
+  CHECK(wide.waitForText("b:START", 2000, &line));
+  uint32_t id = (uint32_t)atoi(line.c_str() + line.find("id=") + 3);
+
+  // The running transfer stays with its client until cancelled
+  wide.write("BULK 0");
+  CHECK(wide.waitForText("Error: Bulk transfer", 2000, &line));
+  CHECK(line == "Error: Bulk transfer " + std::to_string(id) + " busy; BULK_CANCEL first");
+  CHECK(bulk.active);
+  CHECK_EQ(bulk.id, id);
+  wide.write("BULK_CANCEL");
+  CHECK(wide.waitForText("b:CANCEL", 2000));
+  wide.write("BULK 0");
+  CHECK(wide.waitForText("b:START", 2000, &line));
+  CHECK_EQ((uint32_t)atoi(line.c_str() + line.find("id=") + 3), id + 1);
+  id++;
+  sim::run(100);
+  CHECK(bulkFrames(wide) > 0);
+  wide.disconnect();
+
+  // Chunks sized for 247 cannot go to 23 whole
+  sim::BleClient narrow(23);
+  narrow.connect();
+  std::string resume = "BULK_RESUME " + std::to_string(id) + " 0";
+  narrow.write(resume.c_str());
+  CHECK(narrow.waitForText("Error: MTU too small", 2000));
+  CHECK(narrow.waitForText("b:CANCEL", 2000, &line));
+  CHECK(line.rfind("b:CANCEL id=" + std::to_string(id) + " ", 0) == 0);
+  CHECK_EQ(bulkFrames(narrow), 0);
+  CHECK(!bulk.active);
+
+  BleClient *slot = serverSide(narrow);
+  CHECK(slot != nullptr);
+  CHECK_EQ(slot->oversized, 0);
+  uint8_t frame[100] = {FRAME_MAGIC, FRAME_VERSION, FRAME_TYPE_BULK, 1};
+  uint32_t before = narrow.notifications;
+  bleNotify(frame, sizeof(frame), true);
+  CHECK_EQ(narrow.notifications, before);
+  CHECK_EQ(slot->oversized, 1);
+  checkExit("test_bulk");
+}
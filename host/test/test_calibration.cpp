@@ -0,0 +1,51 @@
+// The calibration store across simulated reboots (calibrationLoad() on the
+// NVS the last "boot" left): exposures carry over, blanks carry over for
+// CAL_BLANK_MAX_BOOTS boots with their age restarted, and entries expire
+// CAL_MAX_BOOTS boots after their last write.
+#include "ESPectro32.cpp"
+#include "check.h"
+
+int main()
+{
+  sim::nvsErase();
+  calibrationLoad();
+  CHECK_EQ(bootId, 1);
+  CHECK(!calibrationHasExposure(LED_RED));
+
+  calibrationSetExposure(LED_RED, 100, AGAIN_8X, 900);
+  calibrationSetBlank(LED_RED, 30000, 340, 5000);
+  CHECK(calibrationBlankFresh(LED_RED, 6000));
+  CHECK(!calibrationBlankFresh(LED_RED, 5000 + CAL_MAX_AGE_MS + 1));
+
+  // Next boot: exposure and blank are a load, not a re-measurement; the
+  // blank ages from this boot, since the last one's millis() do not carry
+  calibrationLoad();
+  CHECK_EQ(bootId, 2);
+  CHECK(calibrationHasExposure(LED_RED));
+  CHECK_EQ(calibration[LED_RED].periods, 100);
+  CHECK_EQ(calibration[LED_RED].duty, 900);
+  CHECK(calibrationBlankFresh(LED_RED, 1000));
+  CHECK_EQ(calibration[LED_RED].blank, 30000);
+  CHECK(!calibrationBlankFresh(LED_RED, CAL_MAX_AGE_MS + 1));
+
+  // A blank more than CAL_BLANK_MAX_BOOTS boots old is stale; the exposure stays
+  for (int boot = 0; boot < CAL_BLANK_MAX_BOOTS; boot++)
+    calibrationLoad();
+  CHECK(!calibrationBlankFresh(LED_RED, 1000));
+  CHECK(calibrationHasExposure(LED_RED));
+  calibrationSetBlank(LED_RED, 30100, 340, 1000);
+  CHECK(calibrationBlankFresh(LED_RED, 2000));
+  uint32_t blankBoot = bootId;
+
+  // An entry counts its boots from its last write, with or without a blank
+  for (int boot = 0; boot < CAL_MAX_BOOTS; boot++)
+    calibrationLoad();
+  CHECK_EQ(bootId, blankBoot + CAL_MAX_BOOTS);
+  CHECK(calibrationHasExposure(LED_RED)); // Written CAL_MAX_BOOTS boots ago, still within reach
+  calibrationSetExposure(LED_GREEN, 60, AGAIN_16X, 700);
+  calibrationLoad();
+  CHECK(!calibrationHasExposure(LED_RED)); // CAL_MAX_BOOTS + 1 boots since its write
+  CHECK(calibrationHasExposure(LED_GREEN));
+  CHECK_EQ(calibration[LED_GREEN].bootId, blankBoot + CAL_MAX_BOOTS);
+  checkExit("test_calibration");
+}
@@ -0,0 +1,43 @@
+// parseCommand on raw writes: the longest well-formed commands keep every
+// digit, and a write longer than any valid command is refused whole rather
+// than run on the prefix that fits.
+#include "ESPectro32.cpp"
+#include "check.h"
+
+namespace
+{
+
+AcqCommand parse(const char *text)
+{
+  AcqCommand cmd;
+  parseCommand((const uint8_t *)text, strlen(text), cmd);
+  return cmd;
+}
+
+} // namespace
+
+int main()
+{
+  AcqCommand cmd = parse("LOG_FIND 65535 2147483647");
+  CHECK_EQ(cmd.type, CMD_LOG_FIND);
+  CHECK_EQ(cmd.argc, 2);
+  CHECK_EQ(cmd.args[1], 2147483647);
+
+  cmd = parse("FILTER -2147483648 -2147483648 -2147483648 -2147483648");
+  CHECK_EQ(cmd.type, CMD_FILTER);
+  CHECK_EQ(cmd.argc, 4);
+  CHECK_EQ(cmd.args[3], INT32_MIN);
+
+  cmd = parse("BULK 1 12345678 12345678");
+  CHECK_EQ(cmd.type, CMD_BULK);
+  CHECK_EQ(cmd.args[2], 12345678);
+
+  // One byte past the buffer, whatever it holds, is not a command
+  std::string longest = "BULK 1 12345678 ";
+  longest.append(sizeof(cmd.text) - longest.size(), '1');
+  cmd = parse(longest.c_str());
+  CHECK_EQ(cmd.type, CMD_UNKNOWN);
+  CHECK_EQ(cmd.argc, 0);
+  CHECK_EQ(strlen(cmd.text), sizeof(cmd.text) - 1); // Echoed cut short in the reply
+  checkExit("test_command");
+}
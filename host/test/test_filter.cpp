@@ -0,0 +1,104 @@
+// The filter engine: each kind on known input, MEDIAN never left with no
+// samples to average, and FILTER settings range-checked before use.
+#include "ESPectro32.cpp"
+#include "check.h"
+
+namespace
+{
+
+uint16_t filterOf(const FilterConfig &config, const uint16_t *samples, uint8_t n, StreamFilter &f)
+{
+  filterBegin(f, config, n);
+  for (uint8_t i = 0; i < n; i++)
+    filterPush(f, samples[i]);
+  return filterValue(f);
+}
+
+void testKinds()
+{
+  StreamFilter f;
+  const uint16_t flat[] = {1000, 1002, 998, 1001, 999, 1000, 1003, 997};
+  CHECK_EQ(filterOf(filterDefaults[FILTER_MEAN], flat, 8, f), 1000);
+  CHECK_EQ(f.used, 8);
+
+  const uint16_t spiked[] = {1000, 1002, 998, 1001, 5000, 1000, 999, 1000};
+  FilterConfig median = {FILTER_MEDIAN, 0, 35};
+  CHECK_EQ(filterOf(median, spiked, 8, f), 1000);
+  CHECK_EQ(f.used, 7); // The spike is dropped
+
+  FilterConfig ema = {FILTER_EMA, 64, 0};
+  uint16_t step[FILTER_WINDOW_MAX];
+  for (uint16_t &x : step)
+    x = 2000;
+  filterBegin(f, ema, 1);
+  filterPush(f, 1000);
+  for (uint16_t x : step)
+    filterPush(f, x);
+  uint16_t value = filterValue(f);
+  CHECK(value > 1900 && value < 2000); // 1 - (3/4)^16 of the way
+
+  FilterConfig kalman = {FILTER_KALMAN, 0, 100};
+  CHECK_EQ(filterOf(kalman, flat, 8, f), 1000);
+}
+
+void testMedianAlwaysUsesSamples()
+{
+  StreamFilter f;
+  // Every sample is as far from the median as the MAD: a k under one MAD
+  // rejects them all, and the median itself is what is left.
+  const uint16_t split[] = {0, 0, 100, 100};
+  FilterConfig tight = {FILTER_MEDIAN, 0, 1};
+  CHECK_EQ(filterOf(tight, split, 4, f), 50);
+  CHECK_EQ(f.used, 0);
+
+  // At the smallest k FILTER accepts, at least half the window passes
+  FilterConfig smallest = {FILTER_MEDIAN, 0, FILTER_MEDIAN_K_MIN};
+  uint32_t state = 7;
+  uint32_t short_ = 0;
+  for (int trial = 0; trial < 20000; trial++)
+  {
+    uint16_t samples[FILTER_WINDOW_MAX];
+    uint8_t n = 1 + trial % FILTER_WINDOW_MAX;
+    for (uint8_t i = 0; i < n; i++)
+    {
+      state = state * 1664525 + 1013904223;
+      samples[i] = (uint16_t)(trial % 3 == 0 ? (state >> 8) : 1000 + (state >> 28));
+    }
+    filterOf(smallest, samples, n, f);
+    short_ += f.used < (n + 1) / 2;
+  }
+  CHECK_EQ(short_, 0);
+}
+
+void testConfigure()
+{
+  FilterConfig saved[FILTER_MODE_COUNT];
+  memcpy(saved, filterConfig, sizeof(saved));
+  const int32_t tooTight[] = {8, FILTER_MEDIAN_K_MIN - 1};
+  const int32_t tightest[] = {8, FILTER_MEDIAN_K_MIN};
+  CHECK(!filterConfigure(FILTER_MODE_STREAM, FILTER_MEDIAN, tooTight, 2));
+  CHECK(filterConfigure(FILTER_MODE_STREAM, FILTER_MEDIAN, tightest, 2));
+  CHECK_EQ(filterConfig[FILTER_MODE_STREAM].p2, FILTER_MEDIAN_K_MIN);
+
+  // Out of range, including values that wrap to a valid one as uint8_t
+  CHECK(!filterConfigure(-1, FILTER_MEAN, nullptr, 0));
+  CHECK(!filterConfigure(256, FILTER_MEAN, nullptr, 0));
+  CHECK(!filterConfigure(FILTER_MODE_READ, -255, nullptr, 0));
+  CHECK(!filterConfigure(FILTER_MODE_READ, 256 + FILTER_EMA, nullptr, 0));
+  CHECK(!filterConfigure(FILTER_MODE_READ, FILTER_KIND_COUNT, nullptr, 0));
+  CHECK_EQ(filterConfig[FILTER_MODE_READ].kind, saved[FILTER_MODE_READ].kind);
+
+  CHECK(filterConfigure(FILTER_MODE_READ, FILTER_EMA, nullptr, 0));
+  CHECK_EQ(filterConfig[FILTER_MODE_READ].p1, filterDefaults[FILTER_EMA].p1);
+  memcpy(filterConfig, saved, sizeof(saved));
+}
+
+} // namespace
+
+int main()
+{
+  testKinds();
+  testMedianAlwaysUsesSamples();
+  testConfigure();
+  checkExit("test_filter");
+}
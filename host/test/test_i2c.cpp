@@ -0,0 +1,111 @@
+// Bus traffic of the APDS-9930 driver: a reading is one burst, the
+// configuration setters never read back, and failed transactions are
+// retried and counted.
+#include "ESPectro32.cpp"
+#include "check.h"
+
+namespace
+{
+
+struct BusCount
+{
+  uint32_t bus = sim::i2cTransactions();
+  uint32_t counted = i2cTransactionCount;
+  uint32_t delta() const
+  {
+    CHECK_EQ(i2cTransactionCount - counted, sim::i2cTransactions() - bus);
+    return sim::i2cTransactions() - bus;
+  }
+};
+
+void testBurstRead()
+{
+  sim::run(integrationTimeMs() + 1);
+  sim::Apds9930 &sensor = sim::apds9930();
+  uint32_t reads = sensor.channelReads;
+  BusCount count;
+  uint16_t ch0, ch1;
+  CHECK(readChannels(ch0, ch1));
+  CHECK_EQ(count.delta(), 2); // Pointer write, then one 4-byte read
+  CHECK_EQ(sensor.channelReads - reads, 1);
+  CHECK_EQ(ch0, sensor.ch0());
+  CHECK_EQ(ch1, sensor.ch1());
+  CHECK(ch0 > 0);
+}
+
+void testSettersOnlyWrite()
+{
+  BusCount gain;
+  CHECK(setAmbientLightGain(AGAIN_16X));
+  CHECK_EQ(gain.delta(), 1);
+  CHECK_EQ(sim::apds9930().reg(APDS9930_CONTROL) & 0x03, AGAIN_16X);
+
+  BusCount atime;
+  CHECK(setIntegrationTimePeriods(40));
+  CHECK_EQ(atime.delta(), 1);
+  CHECK_EQ(sim::apds9930().reg(APDS9930_ATIME), 256 - 40);
+  CHECK_EQ(integrationTimeMs(), 110); // 40 * 2.73 ms, rounded up
+
+  BusCount mode;
+  CHECK(setMode(AMBIENT_LIGHT_INT, OFF));
+  CHECK(setMode(AMBIENT_LIGHT_INT, ON));
+  CHECK_EQ(mode.delta(), 2);
+  CHECK_EQ(sim::apds9930().reg(APDS9930_ENABLE), apdsEnableShadow);
+}
+
+void testFreshReading()
+{
+  uint16_t ch0, ch1;
+  // Lets the cycle that was running at the ATIME change end; the next
+  // ones are 40 periods.
+  sim::run(DEFAULT_PERIODS * ATIME_CYCLE_US / 1000 + 1);
+  CHECK(clearDataReadyFlag());
+  BusCount pending;
+  CHECK_EQ(readFreshChannels(ch0, ch1), 0);
+  CHECK_EQ(pending.delta(), 2); // STATUS only
+
+  sim::run(integrationTimeMs() + 1);
+  BusCount fresh;
+  CHECK_EQ(readFreshChannels(ch0, ch1), 1);
+  CHECK_EQ(fresh.delta(), 5); // STATUS, the burst, then the AINT clear
+  CHECK((sim::apds9930().reg(APDS9930_STATUS) & APDS9930_AINT) == 0);
+}
+
+void testRetries()
+{
+  uint16_t ch0, ch1;
+  uint32_t retries = probeCounters[COUNTER_I2C_RETRY];
+  uint32_t fails = probeCounters[COUNTER_I2C_FAIL];
+
+  sim::i2cFailNext(1);
+  CHECK(readChannels(ch0, ch1));
+  CHECK_EQ(probeCounters[COUNTER_I2C_RETRY] - retries, 1);
+  CHECK_EQ(probeCounters[COUNTER_I2C_FAIL], fails);
+
+  // Each attempt stops at its NAKed pointer write: 1 + I2C_RETRIES of them.
+  sim::i2cFailNext(1 + I2C_RETRIES);
+  BusCount failed;
+  CHECK(!readChannels(ch0, ch1));
+  CHECK_EQ(failed.delta(), 1 + I2C_RETRIES);
+  CHECK_EQ(probeCounters[COUNTER_I2C_RETRY] - retries, 1 + I2C_RETRIES);
+  CHECK_EQ(probeCounters[COUNTER_I2C_FAIL] - fails, 1);
+
+  sim::i2cFailNext(1);
+  CHECK(setAmbientLightGain(AGAIN_8X));
+  CHECK_EQ(apdsControlShadow & 0x03, AGAIN_8X);
+}
+
+} // namespace
+
+int main()
+{
+  Wire.begin();
+  Wire.setClock(I2C_CLOCK_HZ);
+  CHECK(initAPD());
+  CHECK_EQ(sim::apds9930().reg(APDS9930_ENABLE), apdsEnableShadow);
+  testBurstRead();
+  testSettersOnlyWrite();
+  testFreshReading();
+  testRetries();
+  checkExit("test_i2c");
+}
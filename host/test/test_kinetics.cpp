@@ -0,0 +1,176 @@
+// A kinetics run end to end: KINETICS over BLE, KINETICS_GET during and
+// after the run, and the client's decoding of the delta-encoded frames,
+// which must give back the device's buffer exactly. Then a new run is
+// refused while a transfer is pending, a run's first record never comes
+// from the integration its LED switch fell in, and a run whose sensor never
+// raises AINT records nothing rather than stale counts.
+#include "ESPectro32.cpp"
+#include "check.h"
+#include <vector>
+
+#define RUN_INTERVAL_MS 500
+#define RUN_SECONDS 10
+#define RUN_ABSORBANCE 0.5f
+
+namespace
+{
+
+uint32_t get32(const uint8_t *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+uint32_t getVarint(const uint8_t *&p)
+{
+  uint32_t v = 0;
+  for (int shift = 0;; shift += 7)
+  {
+    uint8_t byte = *p++;
+    v |= (uint32_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      return v;
+  }
+}
+
+int32_t unzigzag(uint32_t v)
+{
+  return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+// Sends KINETICS_GET and decodes frames up to "k:END"; returns the index
+// the first frame starts at, or -1.
+int32_t kineticsGet(sim::BleClient &client, const char *command, std::vector<KineticsRecord> &records,
+                    uint32_t &end)
+{
+  records.clear();
+  client.write(command);
+  int32_t first = -1;
+  sim::Notification notification;
+  while (client.next(notification, 5000))
+  {
+    const std::vector<uint8_t> &data = notification.data;
+    if (!notification.isFrame())
+    {
+      if (notification.text().rfind("k:END n=", 0) == 0)
+      {
+        end = (uint32_t)atoi(notification.text().c_str() + 8);
+        return first;
+      }
+      continue;
+    }
+    if (data[2] != FRAME_TYPE_KINETICS)
+      continue;
+    const uint8_t *p = data.data() + FRAME_HEADER_LEN;
+    uint32_t index = get32(p);
+    if (first < 0)
+      first = (int32_t)index;
+    CHECK_EQ(index, first + records.size()); // Frames follow on
+    KineticsRecord record = {get32(data.data() + 6), (uint16_t)(p[4] | p[5] << 8), (uint16_t)(p[6] | p[7] << 8)};
+    records.push_back(record);
+    p += 8;
+    for (uint8_t i = 1; i < data[3]; i++)
+    {
+      record.t += getVarint(p);
+      record.ch0 += unzigzag(getVarint(p));
+      record.ch1 += unzigzag(getVarint(p));
+      records.push_back(record);
+    }
+    CHECK_EQ(p - data.data(), data.size());
+  }
+  CHECK(!"k:END never came");
+  return -1;
+}
+
+bool matchesBuffer(const std::vector<KineticsRecord> &records, uint32_t first)
+{
+  for (size_t i = 0; i < records.size(); i++)
+  {
+    const KineticsRecord &device = kineticsBuffer[first + i];
+    if (records[i].t != device.t || records[i].ch0 != device.ch0 || records[i].ch1 != device.ch1)
+      return false;
+  }
+  return true;
+}
+
+} // namespace
+
+int main()
+{
+  setup();
+  sim::BleClient client;
+  client.connect();
+  client.write("LED_RED_ON");
+  CHECK(client.waitForText("z:DONE", 20000));
+
+  sim::apds9930().absorbance[LED_RED] = RUN_ABSORBANCE;
+  std::string line;
+  client.write("KINETICS 500 10 0");
+  CHECK(client.waitForText("k:START", 2000, &line));
+  CHECK(line.rfind("k:START n=20 interval=500 ", 0) == 0);
+
+  // Part way through: what has been published so far
+  sim::run(RUN_SECONDS * 1000 / 2);
+  std::vector<KineticsRecord> records;
+  uint32_t end = 0;
+  CHECK_EQ(kineticsGet(client, "KINETICS_GET", records, end), 0);
+  CHECK_EQ(records.size(), end);
+  CHECK(end > 0 && end < RUN_SECONDS * 1000 / RUN_INTERVAL_MS);
+  CHECK(matchesBuffer(records, 0));
+
+  CHECK(client.waitForText("k:DONE", RUN_SECONDS * 1000, &line));
+  CHECK(line == "k:DONE n=20 missed=0");
+
+  CHECK_EQ(kineticsGet(client, "KINETICS_GET", records, end), 0);
+  CHECK_EQ(end, 20);
+  CHECK_EQ(records.size(), 20);
+  CHECK(matchesBuffer(records, 0));
+  for (size_t i = 1; i < records.size(); i++)
+  {
+    uint32_t dt = records[i].t - records[i - 1].t;
+    CHECK(dt + 2 >= RUN_INTERVAL_MS && dt <= RUN_INTERVAL_MS + 2); // Absolute schedule, no drift
+  }
+  for (const KineticsRecord &record : records)
+  {
+    float absorbance = absorbanceFixed(record.ch0, kinetics.blank, kinetics.dark) / (float)ABS_FIXED_SCALE;
+    CHECK(fabsf(absorbance - RUN_ABSORBANCE) < 0.02f);
+  }
+
+  CHECK_EQ(kineticsGet(client, "KINETICS_GET 15", records, end), 15);
+  CHECK_EQ(records.size(), 5);
+  CHECK(matchesBuffer(records, 15));
+
+  // The transfer would read records the new run is overwriting
+  client.write("KINETICS_GET");
+  client.write("KINETICS 500 10 0");
+  CHECK(client.waitForText("Error: KINETICS_GET still sending", 2000));
+  CHECK(client.waitForText("k:END n=20", 5000));
+
+  // From another LED at a long exposure, the integration the switch fell in
+  // is dropped and the first record is the new LED's alone, whatever the
+  // phase of the sensor's cycle at the switch
+  sim::apds9930().absorbance[LED_RED] = 0.0f;
+  client.write("SET_EXPOSURE 255 1");
+  CHECK(client.waitForText("z:DONE", 60000));
+  sim::apds9930().absorbance[LED_RED] = RUN_ABSORBANCE;
+  for (uint32_t phase = 0; phase < 700; phase += 100)
+  {
+    client.write("LED_GREEN_ON");
+    CHECK(client.waitForText("z:", 60000));
+    sim::run(phase);
+    client.write("KINETICS 1000 1 0");
+    CHECK(client.waitForText("k:DONE", 5000, &line));
+    CHECK(line == "k:DONE n=1 missed=0");
+    float absorbance = absorbanceFixed(kineticsBuffer[0].ch0, kinetics.blank, kinetics.dark) / (float)ABS_FIXED_SCALE;
+    CHECK(fabsf(absorbance - RUN_ABSORBANCE) < 0.02f);
+  }
+  client.write("SET_EXPOSURE 100 8");
+  CHECK(client.waitForText("z:DONE", 60000));
+
+  // No fresh integration is ever flagged, so every tick is a miss
+  CHECK(wireWriteDataByte(APDS9930_PERS, 0x01));
+  client.write("KINETICS 500 2 0");
+  CHECK(client.waitForText("k:START", 2000));
+  CHECK(client.waitForText("k:DONE", 5000, &line));
+  CHECK(line == "k:DONE n=0 missed=4");
+  checkExit("test_kinetics");
+}
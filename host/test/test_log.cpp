@@ -0,0 +1,130 @@
+// The sample log on a file-backed LittleFS: records round-trip through the
+// segment files, reads span segment boundaries, time lookups land on the
+// first record at or after the key, a torn record is cut off at mount, and
+// the oldest segments make room for new ones.
+#include "ESPectro32.cpp"
+#include "check.h"
+#include <sys/stat.h>
+
+namespace
+{
+
+// Files count readings from boot, t0 on, one per ms, as the log task would.
+void fileReadings(uint32_t count, uint16_t boot, uint32_t t0)
+{
+  uint32_t savedBoot = bootId;
+  bootId = boot;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    logReading(SAMPLE_READING, LED_RED, t0 + i, (uint16_t)i, (uint16_t)(i >> 16), 30000, 340, (int32_t)i);
+    logCollect(millis());
+  }
+  logFlush();
+  bootId = savedBoot;
+}
+
+// Forgets the mount, as a reboot after an NVS erase would, and mounts again.
+void remount()
+{
+  logMounted = false;
+  logFirstSeq = 0;
+  logNextSeq = 0;
+  bootId = 0;
+  logBatched = 0;
+  memset(logIndex, 0, sizeof(logIndex));
+  logInit();
+}
+
+off_t segmentSize(uint32_t segment)
+{
+  char path[LOG_PATH_LEN];
+  logSegmentPath(path, segment);
+  struct stat st;
+  return stat((sim::fsRoot() + path).c_str(), &st) == 0 ? st.st_size : -1;
+}
+
+void testRoundTrip()
+{
+  sim::fsErase();
+  remount();
+  CHECK(logMounted);
+  CHECK_EQ(logNextSeq, 0);
+
+  fileReadings(LOG_SEGMENT_RECORDS + 100, 0, 1000);
+  CHECK_EQ(logNextSeq, LOG_SEGMENT_RECORDS + 100);
+  CHECK_EQ(segmentSize(0), LOG_SEGMENT_RECORDS * sizeof(LogRecord));
+  CHECK_EQ(segmentSize(1), 100 * sizeof(LogRecord));
+
+  static LogRecord records[200];
+  CHECK(logReadSpan(LOG_SEGMENT_RECORDS - 100, records, 200));
+  uint32_t bad = 0;
+  for (uint32_t i = 0; i < 200; i++)
+  {
+    uint32_t seq = LOG_SEGMENT_RECORDS - 100 + i;
+    const LogRecord &r = records[i];
+    bad += r.seq != seq || r.t != 1000 + seq || r.ch0 != (uint16_t)seq || r.absorbance != (int32_t)seq ||
+           r.blank != 30000 || r.dark != 340 || r.kind != SAMPLE_READING || r.led != LED_RED;
+  }
+  CHECK_EQ(bad, 0);
+  CHECK(!logReadSpan(logNextSeq - 1, records, 2)); // Past the end
+}
+
+void testFind()
+{
+  // Boot 0 holds t 1000.., boot 1 starts again from t 0
+  fileReadings(50, 1, 0);
+  CHECK_EQ(logFind(0, 0), 0);
+  CHECK_EQ(logFind(0, 1000 + 4150), 4150); // In the second segment
+  CHECK_EQ(logFind(0, UINT32_MAX), LOG_SEGMENT_RECORDS + 100);
+  CHECK_EQ(logFind(1, 10), LOG_SEGMENT_RECORDS + 110);
+  CHECK_EQ(logFind(2, 0), logNextSeq);
+}
+
+void testTornRecord()
+{
+  uint32_t next = logNextSeq;
+  char path[LOG_PATH_LEN];
+  logSegmentPath(path, (next - 1) / LOG_SEGMENT_RECORDS);
+  FILE *file = fopen((sim::fsRoot() + path).c_str(), "ab");
+  CHECK(file != nullptr);
+  fwrite("torn", 1, 4, file);
+  fclose(file);
+
+  remount();
+  CHECK_EQ(logNextSeq, next);
+  CHECK_EQ(logFirstSeq, 0);
+  CHECK_EQ(segmentSize((next - 1) / LOG_SEGMENT_RECORDS) % sizeof(LogRecord), 0);
+  CHECK_EQ(bootId, 2); // Moved on past the newest record's boot
+  CHECK_EQ(logFind(1, 10), LOG_SEGMENT_RECORDS + 110); // Index rebuilt from the files
+}
+
+void testRotation()
+{
+  sim::fsErase();
+  remount();
+  fileReadings((LOG_MAX_SEGMENTS + 1) * LOG_SEGMENT_RECORDS + 1, 0, 0);
+  CHECK_EQ(logNextSeq, (LOG_MAX_SEGMENTS + 1) * LOG_SEGMENT_RECORDS + 1);
+  CHECK(logFirstSeq >= 2 * LOG_SEGMENT_RECORDS);
+  CHECK_EQ(segmentSize(0), -1);
+  CHECK_EQ(segmentSize(1), -1);
+  CHECK(LittleFS.usedBytes() <= LittleFS.totalBytes());
+  LogRecord record;
+  CHECK(logRead(logFirstSeq, &record, 1));
+  CHECK_EQ(record.seq, logFirstSeq);
+
+  uint32_t first = logFirstSeq;
+  remount();
+  CHECK_EQ(logFirstSeq, first);
+  CHECK_EQ(logNextSeq, (LOG_MAX_SEGMENTS + 1) * LOG_SEGMENT_RECORDS + 1);
+}
+
+} // namespace
+
+int main()
+{
+  testRoundTrip();
+  testFind();
+  testTornRecord();
+  testRotation();
+  checkExit("test_log");
+}
@@ -0,0 +1,65 @@
+// READ_N stays responsive: STATS is served alongside a series, and any
+// command that needs the sensor stops it, framing and reporting what was
+// taken before that command runs.
+#include "ESPectro32.cpp"
+#include "check.h"
+
+namespace
+{
+
+// Replicates framed up to the next r:DONE line, whose text goes in done.
+uint32_t untilDone(sim::BleClient &client, std::string &done)
+{
+  uint32_t framed = 0;
+  sim::Notification notification;
+  while (client.next(notification, 60000))
+  {
+    if (notification.isFrame() && notification.data[2] == FRAME_TYPE_REPLICATE)
+      framed += notification.data[3];
+    else if (!notification.isFrame() && notification.text().rfind("r:DONE", 0) == 0)
+    {
+      done = notification.text();
+      return framed;
+    }
+  }
+  CHECK(!"r:DONE never came");
+  return framed;
+}
+
+} // namespace
+
+int main()
+{
+  setup();
+  sim::BleClient client;
+  client.connect();
+  client.write("LED_RED_ON");
+  CHECK(client.waitForText("z:DONE", 20000));
+
+  client.write("READ_N 20 1000");
+  sim::run(3000);
+  client.write("STATS");
+  CHECK(client.waitForText("t:TX", 1000));
+  CHECK_EQ(acq.state, ACQ_READ_N); // Still running
+
+  client.write("STREAM_STOP");
+  std::string done;
+  uint32_t framed = untilDone(client, done);
+  CHECK(framed > 0 && framed < 20);
+  CHECK(done.rfind("r:DONE n=" + std::to_string(framed) + " ", 0) == 0);
+  CHECK(done.find(" left=" + std::to_string(20 - framed)) != std::string::npos);
+  sim::run(100);
+  CHECK_EQ(acq.state, ACQ_IDLE);
+
+  // A new READ_N replaces a running one; a series that runs out has no left=
+  client.write("READ_N 50 1000");
+  sim::run(1500);
+  client.write("READ_N 3");
+  untilDone(client, done);
+  CHECK(done.find(" left=") != std::string::npos);
+  framed = untilDone(client, done);
+  CHECK_EQ(framed, 3);
+  CHECK(done.rfind("r:DONE n=3 valid=3 ", 0) == 0);
+  CHECK(done.find(" left=") == std::string::npos);
+  checkExit("test_read_n");
+}
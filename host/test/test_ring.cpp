@@ -0,0 +1,79 @@
+// SpscRing under a real producer and consumer thread: every item arrives
+// once, in order and whole, and a full ring refuses and counts. `make
+// tsan` runs this under ThreadSanitizer to check the memory ordering.
+#include "ESPectro32.cpp"
+#include "check.h"
+#include <thread>
+
+#define RING_ITEMS 200000
+
+namespace
+{
+
+SpscRing<Sample, 64> ring;
+
+Sample sampleFor(uint32_t seq)
+{
+  return {seq, (uint16_t)seq, (uint16_t)(seq >> 16), (int32_t)~seq, SAMPLE_STREAM, 0, 0};
+}
+
+void testFullRing()
+{
+  SpscRing<uint32_t, 8> small;
+  for (uint32_t i = 0; i < 8; i++)
+    CHECK(small.push(i));
+  CHECK(!small.push(8));
+  CHECK(!small.push(9));
+  CHECK_EQ(small.overflows(), 2);
+  CHECK_EQ(small.highWater(), 8);
+  uint32_t value = UINT32_MAX;
+  CHECK(small.pop(value));
+  CHECK_EQ(value, 0);
+  CHECK(small.push(10));
+  CHECK_EQ(small.size(), 8);
+}
+
+void testStress()
+{
+  uint32_t errors = 0;
+  std::thread consumer([&] {
+    uint32_t expect = 0;
+    Sample sample;
+    while (expect < RING_ITEMS)
+    {
+      if (!ring.pop(sample))
+      {
+        std::this_thread::yield(); // Lets the producer in on a single core
+        continue;
+      }
+      Sample want = sampleFor(expect);
+      if (sample.t != want.t || sample.ch0 != want.ch0 || sample.ch1 != want.ch1 ||
+          sample.absorbance != want.absorbance)
+        errors++;
+      expect = sample.t + 1;
+    }
+  });
+  uint32_t refused = 0;
+  for (uint32_t seq = 0; seq < RING_ITEMS; seq++)
+  {
+    while (!ring.push(sampleFor(seq)))
+    {
+      refused++;
+      std::this_thread::yield();
+    }
+  }
+  consumer.join();
+  CHECK_EQ(errors, 0);
+  CHECK_EQ(ring.size(), 0);
+  CHECK_EQ(ring.overflows(), refused);
+  CHECK(ring.highWater() <= 64);
+}
+
+} // namespace
+
+int main()
+{
+  testFullRing();
+  testStress();
+  checkExit("test_ring");
+}
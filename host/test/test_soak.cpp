@@ -0,0 +1,87 @@
+// Runs readings, replicates, streaming and STATS for a few virtual minutes
+// and counts every heap allocation made by the acquisition and transmit
+// tasks meanwhile: the reading, formatting and notify paths must make
+// none. The client keeps no copies of what it receives during the soak,
+// since that would allocate inside the transmit task's notify call.
+#include "ESPectro32.cpp"
+#include "check.h"
+#include <atomic>
+
+#define SOAK_ROUNDS 10
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+namespace
+{
+
+std::atomic<bool> counting{false};
+std::atomic<uint32_t> allocations{0};
+
+void countAllocation()
+{
+  if (!counting.load(std::memory_order_relaxed))
+    return;
+  TaskHandle_t task = sim::currentTask();
+  if (task != nullptr && (task == acqTaskHandle || task == txTaskHandle))
+    allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+} // namespace
+
+extern "C" void *malloc(size_t size)
+{
+  countAllocation();
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+  countAllocation();
+  return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+  countAllocation();
+  return __libc_realloc(ptr, size);
+}
+
+int main()
+{
+  setup();
+  sim::BleClient client;
+  client.connect();
+  client.write("LED_RED_ON");
+  CHECK(client.waitForText("z:DONE", 20000));
+
+  client.record = false;
+  uint32_t notificationsBefore = client.notifications;
+  counting = true;
+  for (int round = 0; round < SOAK_ROUNDS; round++)
+  {
+    client.write("READ_SENSOR");
+    sim::run(6000);
+    client.write("READ_N 5 100");
+    sim::run(4000);
+    client.write("STREAM_START");
+    sim::run(2000);
+    client.write("STREAM_STOP");
+    sim::run(1000);
+    client.write("STATS");
+    sim::run(500);
+  }
+  counting = false;
+  client.record = true;
+
+  printf("%u notifications, %u allocations\n", (unsigned)(client.notifications - notificationsBefore),
+         (unsigned)allocations.load());
+  CHECK_EQ(allocations.load(), 0);
+  CHECK(client.notifications - notificationsBefore > SOAK_ROUNDS * 20);
+  client.write("STATS");
+  std::string line;
+  CHECK(client.waitForText("t:TX", 20000, &line));
+  CHECK(line == "t:TX dropped=0 overflows=0");
+  checkExit("test_soak");
+}